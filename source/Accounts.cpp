@@ -12,6 +12,7 @@ t_group::t_group()
 		nSpeedLimitType[i] = 0;
 		nSpeedLimit[i] = 10;
 		nBypassServerSpeedLimit[i] = 0;
+		nMinimumSpeed[i] = 0;
 	}
 }
 
@@ -227,6 +228,16 @@ unsigned char * t_group::ParseBuffer(unsigned char *pBuffer, int length)
 
 	forceSsl = *p++;
 
+	if ((endMarker - p) < 5) {
+		return nullptr;
+	}
+
+	nSpeedWeight = *p++;
+	for (int i = 0; i < 2; ++i) {
+		nMinimumSpeed[i] = int(*p++) << 8;
+		nMinimumSpeed[i] |= *p++;
+	}
+
 	return p;
 }
 
@@ -334,6 +345,12 @@ unsigned char * t_group::FillBuffer(unsigned char *p) const
 
 	*p++ = (char)forceSsl;
 
+	*p++ = (char)nSpeedWeight;
+	for (int i = 0; i < 2; ++i) {
+		*p++ = (char)(nMinimumSpeed[i] >> 8);
+		*p++ = (char)(nMinimumSpeed[i] & 0xff);
+	}
+
 	return p;
 }
 
@@ -375,16 +392,18 @@ int t_group::GetRequiredBufferLen() const
 
 	len++; //forceSsl
 
+	len += 5; // Weight and minimum speeds
+
 	return len;
 }
 
-int t_group::GetCurrentSpeedLimit(sltype type) const
+int t_group::GetCurrentSpeedLimit(sltype type, SYSTEMTIME const& time, int & validFor) const
 {
 	switch (nSpeedLimitType[type])
 	{
 	case 0:
 		if (pOwner) {
-			return pOwner->GetCurrentSpeedLimit(type);
+			return pOwner->GetCurrentSpeedLimit(type, time, validFor);
 		}
 		else {
 			return 0;
@@ -394,17 +413,16 @@ int t_group::GetCurrentSpeedLimit(sltype type) const
 	case 2:
 		return nSpeedLimit[type];
 	case 3:
-		if (!SpeedLimits[type].empty()) {
-			SYSTEMTIME st;
-			GetLocalTime(&st);
-			for (auto const& limit : SpeedLimits[type]) {
-				if (limit.IsItActive(st)) {
-					return limit.m_Speed;
-				}
+		// Rules after the first active one do not matter until the ones
+		// before it change
+		for (auto const& limit : SpeedLimits[type]) {
+			validFor = std::min(validFor, limit.GetSecondsToChange(time));
+			if (limit.IsItActive(time)) {
+				return limit.m_Speed;
 			}
 		}
 		if (pOwner) {
-			return pOwner->GetCurrentSpeedLimit(type);
+			return pOwner->GetCurrentSpeedLimit(type, time, validFor);
 		}
 		else {
 			return 0;
@@ -429,6 +447,28 @@ bool t_group::BypassServerSpeedLimit(sltype type) const
 	}
 }
 
+int t_group::GetSpeedWeight() const
+{
+	if (nSpeedWeight) {
+		return nSpeedWeight;
+	}
+	if (pOwner) {
+		return pOwner->GetSpeedWeight();
+	}
+	return 1;
+}
+
+int t_group::GetMinimumSpeed(sltype type) const
+{
+	if (nMinimumSpeed[type]) {
+		return nMinimumSpeed[type];
+	}
+	if (pOwner) {
+		return pOwner->GetMinimumSpeed(type);
+	}
+	return 0;
+}
+
 bool t_group::IsEnabled() const
 {
 	switch (nEnabled)
@@ -447,39 +487,6 @@ bool t_group::IsEnabled() const
 	}
 }
 
-bool t_group::AccessAllowed(std::wstring const& ip) const
-{
-	bool disallowed = false;
-
-	for (auto const& disallowedIP : disallowedIPs) {
-		if (disallowed = MatchesFilter(disallowedIP, ip)) {
-			break;
-		}
-	}
-
-	if (!disallowed) {
-		if (!pOwner) {
-			return true;
-		}
-
-		if (pOwner->AccessAllowed(ip)) {
-			return true;
-		}
-	}
-
-	for (auto const& allowedIP : allowedIPs) {
-		if (MatchesFilter(allowedIP, ip)) {
-			return true;
-		}
-	}
-
-	if (pOwner && !disallowed) {
-		return pOwner->AccessAllowed(ip);
-	}
-
-	return false;
-}
-
 unsigned char * t_user::ParseBuffer(unsigned char *pBuffer, int length)
 {
 	unsigned char *p = pBuffer;
@@ -41,10 +41,15 @@ public:
 	bool IsEnabled() const;
 	bool ForceSsl() const;
 
-	int GetCurrentSpeedLimit(sltype type) const;
+	// Lowers validFor to the number of seconds the returned limit stays in
+	// effect
+	int GetCurrentSpeedLimit(sltype type, SYSTEMTIME const& time, int & validFor) const;
 	bool BypassServerSpeedLimit(sltype type) const;
 
-	bool AccessAllowed(std::wstring const& ip) const;
+	// Share of the server-wide speed limit under contention, see
+	// CBandwidthScheduler. The minimum is in kB/s.
+	int GetSpeedWeight() const;
+	int GetMinimumSpeed(sltype type) const;
 
 	std::wstring group;
 	std::vector<t_directory> permissions;
@@ -58,6 +63,10 @@ public:
 	SPEEDLIMITSLIST SpeedLimits[2];
 	int nBypassServerSpeedLimit[2];
 
+	// 0 to inherit from the group
+	int nSpeedWeight{};
+	int nMinimumSpeed[2];
+
 	std::vector<std::wstring> allowedIPs, disallowedIPs;
 
 	std::wstring comment;
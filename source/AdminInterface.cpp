@@ -46,6 +46,7 @@ BOOL CAdminInterface::Add(CAdminSocket *pAdminSocket)
 	if (pAdminSocket->Init())
 	{
 		m_AdminSocketList.push_back(pAdminSocket);
+		m_pServer->UpdateStatusListeners();
 		return TRUE;
 	}
 	return FALSE;
@@ -75,6 +76,7 @@ BOOL CAdminInterface::Remove(CAdminSocket *pAdminSocket)
 		if (*iter == pAdminSocket) {
 			m_AdminSocketList.erase(iter);
 			pAdminSocket->Delete();
+			m_pServer->UpdateStatusListeners();
 			return TRUE;
 		}
 	}
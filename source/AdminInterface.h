@@ -32,6 +32,7 @@ public:
 	virtual ~CAdminInterface();
 	BOOL SendCommand(int nType, int nID, const void *pData, int nDataLength);
 	BOOL Remove(CAdminSocket *pAdminSocket);
+	bool HasAdmins() const { return !m_AdminSocketList.empty(); }
 
 protected:
 	CServer *m_pServer;
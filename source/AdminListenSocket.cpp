@@ -28,21 +28,7 @@ void CAdminListenSocket::OnAccept(int nErrorCode)
 		if (pSocket->GetPeerName(ip, port)) {
 			if (!IsLocalhost(ip)) {
 				COptions options;
-
-				// Get the list of IP filter rules.
-				CStdString ips = options.GetOption(OPTION_ADMINIPADDRESSES);
-				ips += _T(" ");
-
-				int pos = ips.Find(' ');
-				while (pos != -1)
-				{
-					CStdString filter = ips.Left(pos);
-					ips = ips.Mid(pos + 1);
-					pos = ips.Find(' ');
-
-					if ((allowed = MatchesFilter(filter, ip)))
-						break;
-				}
+				allowed = options.GetIpFilter(OPTION_ADMINIPADDRESSES)->Matches(CIpAddress::Parse(ip));
 			}
 			else
 				allowed = true;
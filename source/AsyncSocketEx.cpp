@@ -65,6 +65,7 @@ to tim.kosse@filezilla-project.org
 #include "AsyncSocketEx.h"
 
 #include "AsyncSocketExLayer.h"
+#include "iputils.h"
 
 #include <libfilezilla/string.hpp>
 
@@ -1013,6 +1014,31 @@ int CAsyncSocketEx::Send(const void* lpBuf, int nBufLen, int nFlags /*=0*/)
 		return send(m_SocketData.hSocket, (LPSTR)lpBuf, nBufLen, nFlags);
 }
 
+int CAsyncSocketEx::SendBuffers(WSABUF const* lpBuffers, DWORD dwBufferCount)
+{
+	if (m_pFirstLayer) {
+		int sent = 0;
+		for (DWORD i = 0; i < dwBufferCount; ++i) {
+			int res = m_pFirstLayer->Send(lpBuffers[i].buf, lpBuffers[i].len, 0);
+			if (res == SOCKET_ERROR) {
+				// The error gets reported by the next call
+				return sent ? sent : SOCKET_ERROR;
+			}
+			sent += res;
+			if (res < static_cast<int>(lpBuffers[i].len)) {
+				break;
+			}
+		}
+		return sent;
+	}
+
+	DWORD sent = 0;
+	if (WSASend(m_SocketData.hSocket, const_cast<WSABUF*>(lpBuffers), dwBufferCount, &sent, 0, 0, 0) == SOCKET_ERROR) {
+		return SOCKET_ERROR;
+	}
+	return static_cast<int>(sent);
+}
+
 bool CAsyncSocketEx::Connect(std::wstring const& hostAddress, UINT nHostPort)
 {
 	ASSERT(!hostAddress.empty());
@@ -1189,6 +1215,28 @@ bool CAsyncSocketEx::GetPeerName(std::wstring& rPeerAddress, UINT& rPeerPort)
 	return bResult;
 }
 
+bool CAsyncSocketEx::GetPeerName(CIpAddress& rPeerAddress, UINT& rPeerPort)
+{
+	sockaddr_storage sockAddr{ 0 };
+	if (!GetPeerName(sockAddr)) {
+		return false;
+	}
+
+	if (sockAddr.ss_family == AF_INET6) {
+		rPeerPort = ntohs(reinterpret_cast<sockaddr_in6&>(sockAddr).sin6_port);
+	}
+	else if (sockAddr.ss_family == AF_INET) {
+		rPeerPort = ntohs(reinterpret_cast<sockaddr_in&>(sockAddr).sin_port);
+	}
+	else {
+		WSASetLastError(WSAEPFNOSUPPORT);
+		return false;
+	}
+	rPeerAddress = CIpAddress::FromSockAddr(reinterpret_cast<sockaddr&>(sockAddr));
+
+	return true;
+}
+
 BOOL CAsyncSocketEx::GetPeerName(sockaddr_storage & sockAddr)
 {
 	int len = sizeof(sockAddr);
@@ -78,6 +78,8 @@ class CAsyncSocketExHelperWindow;
 
 class CAsyncSocketExLayer;
 
+class CIpAddress;
+
 struct t_callbackMsg
 {
 	CAsyncSocketExLayer* pLayer;
@@ -134,6 +136,7 @@ public:
 
 	//Gets the address of the peer socket to which the socket is connected.
 	bool GetPeerName(std::wstring& rPeerAddress, UINT& rPeerPort);
+	bool GetPeerName(CIpAddress& rPeerAddress, UINT& rPeerPort);
 
 	//Gets the local name for a socket.
 	BOOL GetSockName(CStdString& rSocketAddress, UINT& rSocketPort);
@@ -182,6 +185,10 @@ public:
 	//Sends data to a connected socket.
 	virtual int Send(const void* lpBuf, int nBufLen, int nFlags = 0);
 
+	//Sends the data of several buffers with a single call. Returns the number
+	//of bytes sent. Through layers the buffers are sent one after another.
+	int SendBuffers(WSABUF const* lpBuffers, DWORD dwBufferCount);
+
 	//Disables Send and/or Receive calls on the socket.
 	BOOL ShutDown();
 
@@ -37,14 +37,8 @@ CControlSocket::CControlSocket(CServerThread & owner)
 	, m_lastTransferTime(m_lastCmdTime)
 	, m_loginTime(m_lastTransferTime)
 	, m_hash_algorithm(CHashThread::SHA1)
+	, m_SlQuotas{ {CServerThread::GetBandwidthScheduler(download)}, {CServerThread::GetBandwidthScheduler(upload)} }
 {
-	for (int i = 0; i < 2; ++i) {
-		m_SlQuotas[i].bContinue = false;
-		m_SlQuotas[i].nBytesAllowedToTransfer = owner.GetInitialSpeedLimit(i);
-		m_SlQuotas[i].nTransferred = 0;
-		m_SlQuotas[i].bBypassed = false;
-	}
-
 	for (int i = 0; i < 3; ++i) {
 		m_facts[i] = true;
 	}
@@ -65,8 +59,9 @@ CControlSocket::~CControlSocket()
 	m_owner.SendNotification(FSM_CONNECTIONDATA, (LPARAM)op);
 	ResetTransferstatus(false);
 
-	delete [] m_pSendBuffer;
-	m_nSendBufferLen = 0;
+	if (m_hash_id) {
+		m_owner.GetHashThread().Cancel(m_hash_id);
+	}
 
 	RemoveAllLayers();
 	delete m_pSslLayer;
@@ -75,7 +70,6 @@ CControlSocket::~CControlSocket()
 /////////////////////////////////////////////////////////////////////////////
 // Member-Funktion CControlSocket
 
-#define BUFFERSIZE 500
 void CControlSocket::OnReceive(int nErrorCode)
 {
 	if (m_antiHammeringWaitTime) {
@@ -88,60 +82,33 @@ void CControlSocket::OnReceive(int nErrorCode)
 		return;
 	}
 
-	int len = BUFFERSIZE;
 	long long nLimit = GetSpeedLimit(upload);
 	if (!nLimit) {
 		ParseCommand();
 		return;
 	}
-	if (len > nLimit && nLimit > -1)
-		len = static_cast<int>(nLimit);
 
-	unsigned char *buffer = new unsigned char[BUFFERSIZE];
-	int numread = Receive(buffer, len);
+	size_t len{};
+	char* buffer = m_recvBuffer.GetWritePos(len);
+	if (!len) {
+		// ParseCommand resumes receiving once commands got executed
+		m_recvStalled = true;
+		ParseCommand();
+		return;
+	}
+	if (nLimit > -1 && len > static_cast<size_t>(nLimit))
+		len = static_cast<size_t>(nLimit);
+
+	int numread = Receive(buffer, static_cast<int>(len));
 	if (numread != SOCKET_ERROR && numread) {
 		if (nLimit > -1)
-			m_SlQuotas[upload].nTransferred += numread;
+			ConsumeSpeedLimit(upload, numread);
 
 		m_owner.IncRecvCount(numread);
-		//Parse all received bytes
-		for (int i = 0; i < numread; i++)
-		{
-			if (!m_nRecvBufferPos)
-			{
-				//Remove telnet characters
-				if (m_nTelnetSkip) {
-					if (buffer[i] < 240)
-						m_nTelnetSkip = 0;
-					else
-						continue;
-				}
-				else if (buffer[i] == 255) {
-					m_nTelnetSkip = 1;
-					continue;
-				}
-			}
-
-			//Check for line endings
-			if ((buffer[i] == '\r')||(buffer[i] == 0)||(buffer[i] == '\n'))
-			{
-				//If input buffer is not empty...
-				if (m_nRecvBufferPos)
-				{
-					m_RecvBuffer[m_nRecvBufferPos] = 0;
-					m_RecvLineBuffer.push_back(m_RecvBuffer);
-					m_nRecvBufferPos = 0;
+		m_recvBuffer.Commit(numread);
 
-					//Signal that there is a new command waiting to be processed.
-					m_lastCmdTime = fz::monotonic_clock::now();
-				}
-			}
-			else
-				//The command may only be 2000 chars long. This ensures that a malicious user can't
-				//send extremely large commands to fill the memory of the server
-				if (m_nRecvBufferPos < 2000) {
-					m_RecvBuffer[m_nRecvBufferPos++] = buffer[i];
-				}
+		if (m_recvBuffer.HasLine()) {
+			m_lastCmdTime = fz::monotonic_clock::now();
 		}
 	}
 	else {
@@ -150,92 +117,16 @@ void CControlSocket::OnReceive(int nErrorCode)
 			Close();
 			SendStatus(_T("disconnected."), 0);
 			m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_DELSOCKET, m_userid);
-
-			delete [] buffer;
 			return;
 		}
 	}
 
 	ParseCommand();
-
-	delete [] buffer;
-}
-
-bool CControlSocket::GetCommand(CStdString &command, CStdString &args)
-{
-	//Get first command from input buffer
-	CStdStringA str;
-	if (m_RecvLineBuffer.empty()) {
-		return false;
-	}
-	str = m_RecvLineBuffer.front();
-	m_RecvLineBuffer.pop_front();
-
-	//Output command in status window
-	CStdString str2 = ConvFromNetwork(str);
-
-	//Hide passwords if the server admin wants to.
-	if (!str2.Left(5).CompareNoCase(_T("PASS "))) {
-		if (m_owner.m_pOptions->GetOptionVal(OPTION_LOGSHOWPASS)) {
-			SendStatus(str2, 2);
-		}
-		else {
-			CStdString msg = str2;
-			for (size_t i = 5; i < msg.size(); ++i) {
-				msg[i] = '*';
-			}
-			SendStatus(msg, 2);
-		}
-	}
-	else {
-		SendStatus(str2, 2);
-	}
-
-	// Split command and arguments
-	int pos = str2.Find(_T(" "));
-	if (pos != -1) {
-		command = str2.Left(pos);
-		if (pos == str2.GetLength() - 1) {
-			args.clear();
-		}
-		else {
-			args = str2.Mid(pos + 1);
-			if (args.empty()) {
-				Send(_T("501 Syntax error, failed to decode string"));
-				return false;
-			}
-		}
-	}
-	else {
-		args.clear();
-		command = str2;
-	}
-	if (command.empty()) {
-		return false;
-	}
-	command.MakeUpper();
-	return true;
 }
 
 void CControlSocket::SendStatus(LPCTSTR status, int type)
 {
-	t_statusmsg *msg = new t_statusmsg;
-	_tcsncpy(msg->ip,  m_RemoteIP, sizeof(msg->ip) / sizeof(TCHAR));
-	msg->ip[sizeof(msg->ip) / sizeof(TCHAR) - 1] = 0;
-	GetLocalTime(&msg->time);
-	if (!m_status.loggedon) {
-		msg->user = new TCHAR[16];
-		_tcscpy(msg->user, _T("(not logged in)"));
-	}
-	else {
-		msg->user = new TCHAR[_tcslen(m_status.username) + 1];
-		_tcscpy(msg->user, m_status.username);
-	}
-	msg->userid = m_userid;
-	msg->type = type;
-	msg->status = new TCHAR[_tcslen(status) + 1];
-	_tcscpy(msg->status, status);
-	m_owner.SendNotification(FSM_STATUSMESSAGE, (LPARAM)msg);
+	m_owner.SendStatus(m_userid, m_status.loggedon ? static_cast<LPCTSTR>(m_status.username) : _T("(not logged in)"), m_RemoteIP, status, type);
 }
 
 BOOL CControlSocket::Send(LPCTSTR str, bool sendStatus, bool newline)
@@ -248,97 +139,65 @@ BOOL CControlSocket::Send(LPCTSTR str, bool sendStatus, bool newline)
 		SendStatus(str, 3);
 	}
 
-	char* buffer;
-	int len;
-	{
-		auto utf8 = fz::to_utf8(str);
-		if (utf8.empty()) {
-			Close();
-			SendStatus(_T("Failed to convert reply to UTF-8"), 1);
-			m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_DELSOCKET, m_userid);
-
-			return false;
-		}
+	auto const utf8 = fz::to_utf8(str);
+	if (utf8.empty()) {
+		Close();
+		SendStatus(_T("Failed to convert reply to UTF-8"), 1);
+		m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_DELSOCKET, m_userid);
 
-		buffer = new char[utf8.size() + 3];
-		strcpy(buffer, utf8.c_str());
-		if (newline) {
-			strcpy(buffer + utf8.size(), "\r\n");
-			len = utf8.size() + 2;
-		}
-		else {
-			len = utf8.size();
-		}
+		return false;
 	}
 
-	//Add line to back of send buffer if it's not empty
-	if (m_pSendBuffer) {
-		char *tmp = m_pSendBuffer;
-		m_pSendBuffer = new char[m_nSendBufferLen + len];
-		memcpy(m_pSendBuffer, tmp, m_nSendBufferLen);
-		memcpy(m_pSendBuffer + m_nSendBufferLen, buffer, len);
-		delete [] tmp;
-		m_nSendBufferLen += len;
-		delete [] buffer;
+	// With a backlog, OnSend picks up the reply together with the rest
+	bool const idle = m_sendQueue.empty();
+	m_sendQueue.Append(utf8.c_str(), utf8.size());
+	if (newline) {
+		m_sendQueue.Append("\r\n", 2);
+	}
+	if (!idle || m_holdReplies) {
 		return TRUE;
 	}
 
+	return FlushSendQueue();
+}
+
+bool CControlSocket::FlushSendQueue()
+{
 	long long nLimit = GetSpeedLimit(download);
 	if (!nLimit) {
-		if (!m_pSendBuffer) {
-			m_pSendBuffer = buffer;
-			m_nSendBufferLen = len;
-		}
-		else {
-			char *tmp = m_pSendBuffer;
-			m_pSendBuffer = new char[m_nSendBufferLen + len];
-			memcpy(m_pSendBuffer, tmp, m_nSendBufferLen);
-			memcpy(m_pSendBuffer + m_nSendBufferLen, buffer, len);
-			delete [] tmp;
-			m_nSendBufferLen += len;
-			delete [] buffer;
-		}
-		return TRUE;
+		// Continue triggers FD_WRITE once there is bandwidth again
+		return true;
 	}
-	int numsend = len;
-	if (nLimit > -1 && numsend > nLimit)
-		numsend = static_cast<int>(nLimit);
 
-	int res = CAsyncSocketEx::Send(buffer, numsend);
+	size_t const limit = (nLimit > -1) ? static_cast<size_t>(nLimit) : m_sendQueue.size();
+
+	WSABUF buffers[CSendQueue::maxGather];
+	DWORD const count = m_sendQueue.Gather(buffers, CSendQueue::maxGather, limit);
+
+	int res = SendBuffers(buffers, count);
 	if (res == SOCKET_ERROR && GetLastError() == WSAEWOULDBLOCK) {
-		res = 0;
+		// FD_WRITE follows once the socket is writable again
+		return true;
 	}
 	else if (!res || res == SOCKET_ERROR) {
-		delete [] buffer;
+		m_sendQueue.clear();
 		Close();
 		SendStatus(_T("could not send reply, disconnected."), 0);
 		m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_DELSOCKET, m_userid);
-		return FALSE;
+		return false;
 	}
 
 	if (nLimit > -1)
-		m_SlQuotas[download].nTransferred += res;
+		ConsumeSpeedLimit(download, res);
 
-	if (res != len) {
-		if (!m_pSendBuffer) {
-			m_pSendBuffer = new char[len - res];
-			memcpy(m_pSendBuffer, buffer + res, len - res);
-			m_nSendBufferLen = len - res;
-		}
-		else {
-			char *tmp = m_pSendBuffer;
-			m_pSendBuffer = new char[m_nSendBufferLen + len - res];
-			memcpy(m_pSendBuffer, tmp, m_nSendBufferLen);
-			memcpy(m_pSendBuffer + m_nSendBufferLen, buffer + res, len - res);
-			delete [] tmp;
-			m_nSendBufferLen += len - res;
-		}
+	m_sendQueue.Consume(res);
+	m_owner.IncSendCount(res);
+
+	if (!m_sendQueue.empty()) {
 		TriggerEvent(FD_WRITE);
 	}
-	delete [] buffer;
 
-	m_owner.IncSendCount(res);
-	return TRUE;
+	return true;
 }
 
 void CControlSocket::OnClose(int nErrorCode)
@@ -350,7 +209,6 @@ void CControlSocket::OnClose(int nErrorCode)
 }
 
 enum class commands {
-	invalid = -1,
 	USER,
 	PASS,
 	QUIT,
@@ -395,116 +253,298 @@ enum class commands {
 	CLNT,
 	MFMT,
 	HASH,
+	RANG,
 
 	HTTP
 };
 
-t_command const invalid_command = {commands::invalid, false, false};
-std::map<CStdString, t_command> const command_map = {
-	{_T("USER"), {commands::USER, true,  true}},
-	{_T("PASS"), {commands::PASS, false, true}},
-	{_T("QUIT"), {commands::QUIT, false, true}},
-	{_T("CWD"),  {commands::CWD,  false, false}},
-	{_T("PWD"),  {commands::PWD,  false, false}},
-	{_T("PORT"), {commands::PORT, true,  false}},
-	{_T("PASV"), {commands::PASV, false, false}},
-	{_T("TYPE"), {commands::TYPE, true,  false}},
-	{_T("LIST"), {commands::LIST, false, false}},
-	{_T("REST"), {commands::REST, true,  false}},
-	{_T("CDUP"), {commands::CDUP, false, false}},
-	{_T("RETR"), {commands::RETR, true,  false}},
-	{_T("STOR"), {commands::STOR, true,  false}},
-	{_T("SIZE"), {commands::SIZE, true,  false}},
-	{_T("DELE"), {commands::DELE, true,  false}},
-	{_T("RMD"),  {commands::RMD,  true,  false}},
-	{_T("MKD"),  {commands::MKD,  true,  false}},
-	{_T("RNFR"), {commands::RNFR, true,  false}},
-	{_T("RNTO"), {commands::RNTO, true,  false}},
-	{_T("ABOR"), {commands::ABOR, false, false}},
-	{_T("SYST"), {commands::SYST, false, true}},
-	{_T("NOOP"), {commands::NOOP, false, false}},
-	{_T("APPE"), {commands::APPE, true,  false}},
-	{_T("NLST"), {commands::NLST, false, false}},
-	{_T("MDTM"), {commands::MDTM, true,  false}},
-	{_T("XPWD"), {commands::PWD,  false, false}},
-	{_T("XCUP"), {commands::CDUP, false, false}},
-	{_T("XMKD"), {commands::MKD,  true,  false}},
-	{_T("XRMD"), {commands::RMD,  true,  false}},
-	{_T("XCWD"), {commands::CWD,  true,  false}},
-	{_T("NOP"),  {commands::NOP,  false, false}},
-	{_T("EPSV"), {commands::EPSV, false, false}},
-	{_T("EPRT"), {commands::EPRT, true,  false}},
-	{_T("AUTH"), {commands::AUTH, true,  true}},
-	{_T("ADAT"), {commands::ADAT, true,  true}},
-	{_T("PBSZ"), {commands::PBSZ, true,  true}},
-	{_T("PROT"), {commands::PROT, true,  true}},
-	{_T("FEAT"), {commands::FEAT, false, true}},
-	{_T("MODE"), {commands::MODE, true,  false}},
-	{_T("OPTS"), {commands::OPTS, true,  true}},
-	{_T("HELP"), {commands::HELP, false, true}},
-	{_T("ALLO"), {commands::ALLO, false, false}},
-	{_T("MLST"), {commands::MLST, false, false}},
-	{_T("MLSD"), {commands::MLSD, false, false}},
-	{_T("SITE"), {commands::SITE, true,  true}},
-	{_T("STRU"), {commands::STRU, true, false}},
-	{_T("CLNT"), {commands::CLNT, true, true}},
-	{_T("MFMT"), {commands::MFMT, true, false}},
-	{_T("HASH"), {commands::HASH, true, false}},
-	{_T("GET"),  {commands::HTTP, false, true}},
-	{_T("HEAD"), {commands::HTTP, false, true}},
-	{_T("POST"), {commands::HTTP, false, true}},
-	{_T("PUT"),  {commands::HTTP, false, true}}
+namespace {
+struct t_verb
+{
+	char const* name;
+	t_command command;
+};
+
+// Sorted by name, HELP lists the verbs in this order
+constexpr t_verb verbs[] = {
+	{"ABOR", {commands::ABOR, false, false}},
+	{"ADAT", {commands::ADAT, true,  true}},
+	{"ALLO", {commands::ALLO, false, false}},
+	{"APPE", {commands::APPE, true,  false}},
+	{"AUTH", {commands::AUTH, true,  true}},
+	{"CDUP", {commands::CDUP, false, false}},
+	{"CLNT", {commands::CLNT, true,  true}},
+	{"CWD",  {commands::CWD,  false, false}},
+	{"DELE", {commands::DELE, true,  false}},
+	{"EPRT", {commands::EPRT, true,  false}},
+	{"EPSV", {commands::EPSV, false, false}},
+	{"FEAT", {commands::FEAT, false, true}},
+	{"GET",  {commands::HTTP, false, true}},
+	{"HASH", {commands::HASH, true,  false}},
+	{"HEAD", {commands::HTTP, false, true}},
+	{"HELP", {commands::HELP, false, true}},
+	{"LIST", {commands::LIST, false, false}},
+	{"MDTM", {commands::MDTM, true,  false}},
+	{"MFMT", {commands::MFMT, true,  false}},
+	{"MKD",  {commands::MKD,  true,  false}},
+	{"MLSD", {commands::MLSD, false, false}},
+	{"MLST", {commands::MLST, false, false}},
+	{"MODE", {commands::MODE, true,  false}},
+	{"NLST", {commands::NLST, false, false}},
+	{"NOOP", {commands::NOOP, false, false}},
+	{"NOP",  {commands::NOP,  false, false}},
+	{"OPTS", {commands::OPTS, true,  true}},
+	{"PASS", {commands::PASS, false, true}},
+	{"PASV", {commands::PASV, false, false}},
+	{"PBSZ", {commands::PBSZ, true,  true}},
+	{"PORT", {commands::PORT, true,  false}},
+	{"POST", {commands::HTTP, false, true}},
+	{"PROT", {commands::PROT, true,  true}},
+	{"PUT",  {commands::HTTP, false, true}},
+	{"PWD",  {commands::PWD,  false, false}},
+	{"QUIT", {commands::QUIT, false, true}},
+	{"RANG", {commands::RANG, true,  false}},
+	{"REST", {commands::REST, true,  false}},
+	{"RETR", {commands::RETR, true,  false}},
+	{"RMD",  {commands::RMD,  true,  false}},
+	{"RNFR", {commands::RNFR, true,  false}},
+	{"RNTO", {commands::RNTO, true,  false}},
+	{"SITE", {commands::SITE, true,  true}},
+	{"SIZE", {commands::SIZE, true,  false}},
+	{"STOR", {commands::STOR, true,  false}},
+	{"STRU", {commands::STRU, true,  false}},
+	{"SYST", {commands::SYST, false, true}},
+	{"TYPE", {commands::TYPE, true,  false}},
+	{"USER", {commands::USER, true,  true}},
+	{"XCUP", {commands::CDUP, false, false}},
+	{"XCWD", {commands::CWD,  true,  false}},
+	{"XMKD", {commands::MKD,  true,  false}},
+	{"XPWD", {commands::PWD,  false, false}},
+	{"XRMD", {commands::RMD,  true,  false}}
 };
 
-t_command const& CControlSocket::MapCommand(CStdString const& command, CStdString const& args)
+/*
+Verbs are looked up in a perfect hash table built at compile time. A verb has
+at most four characters, they get packed into a single 32-bit key which is
+hashed by multiplying it with a constant and keeping the top bits of the
+product. The constant is the first one at or above the golden ratio constant
+for which no two verbs share a slot, so adding a verb never requires any
+manual tuning.
+*/
+unsigned int const hashBits = 8;
+size_t const hashSlots = size_t(1) << hashBits;
+
+constexpr uint32_t PackVerb(char const* verb)
 {
-	auto const& it = command_map.find(command);
-	if( it != command_map.end() ) {
-		//Does the command needs an argument?
-		if( it->second.bHasargs && args.empty() ) {
-			Send(_T("501 Syntax error"));
-			if (!m_RecvLineBuffer.empty()) {
-				m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_COMMAND, m_userid);
-			}
+	uint32_t key{};
+	for (size_t i = 0; i < 4; ++i) {
+		key = (key << 8) | static_cast<unsigned char>(*verb);
+		if (*verb) {
+			++verb;
 		}
-		//Can it be issued before logon?
-		else if( !m_status.loggedon && !it->second.bValidBeforeLogon) {
-			Send(_T("530 Please log in with USER and PASS first."));
-			if (!m_RecvLineBuffer.empty()) {
-				m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_COMMAND, m_userid);
+	}
+	return key;
+}
+
+constexpr size_t HashVerb(uint32_t key, uint32_t multiplier)
+{
+	return (key * multiplier) >> (32 - hashBits);
+}
+
+constexpr bool IsPerfect(uint32_t multiplier)
+{
+	bool used[hashSlots]{};
+	for (auto const& verb : verbs) {
+		size_t const slot = HashVerb(PackVerb(verb.name), multiplier);
+		if (used[slot]) {
+			return false;
+		}
+		used[slot] = true;
+	}
+	return true;
+}
+
+constexpr uint32_t FindMultiplier()
+{
+	uint32_t multiplier = 0x9e3779b1u;
+	while (!IsPerfect(multiplier)) {
+		multiplier += 2;
+	}
+	return multiplier;
+}
+
+struct t_commandTable
+{
+	struct t_slot
+	{
+		uint32_t key;
+		t_command const* command;
+	};
+
+	uint32_t multiplier;
+	t_slot slots[hashSlots];
+};
+
+constexpr t_commandTable BuildCommandTable()
+{
+	t_commandTable table{FindMultiplier(), {}};
+	for (auto const& verb : verbs) {
+		auto & slot = table.slots[HashVerb(PackVerb(verb.name), table.multiplier)];
+		slot.key = PackVerb(verb.name);
+		slot.command = &verb.command;
+	}
+	return table;
+}
+
+constexpr t_commandTable commandTable = BuildCommandTable();
+
+// Looks up a verb as received from the client, case-insensitively
+t_command const* FindCommand(std::string_view const& verb)
+{
+	if (verb.empty() || verb.size() > 4) {
+		return 0;
+	}
+
+	uint32_t key{};
+	for (size_t i = 0; i < 4; ++i) {
+		unsigned char c = (i < verb.size()) ? static_cast<unsigned char>(verb[i]) : 0;
+		if (c >= 'a' && c <= 'z') {
+			c -= 'a' - 'A';
+		}
+		key = (key << 8) | c;
+	}
+
+	auto const& slot = commandTable.slots[HashVerb(key, commandTable.multiplier)];
+	return (slot.key == key) ? slot.command : 0;
+}
+}
+
+bool CControlSocket::GetCommand(t_command const*& command, CStdString &args)
+{
+	//Get first command from input buffer
+	std::string_view line;
+	if (!m_recvBuffer.GetLine(line)) {
+		return false;
+	}
+
+	// Split command and arguments. The verb is looked up as is, only the
+	// arguments of known commands need to be decoded.
+	size_t const pos = line.find(' ');
+	std::string_view const verb = line.substr(0, pos);
+	std::string_view const rawArgs = (pos != std::string_view::npos) ? line.substr(pos + 1) : std::string_view();
+
+	command = FindCommand(verb);
+	args.clear();
+	if (command && !rawArgs.empty()) {
+		args = ConvFromNetwork(rawArgs);
+	}
+
+	//Output command in status window, unless nobody would see it
+	if (CStatusQueue::IsEnabled()) {
+		if (command) {
+			CStdString str = ConvFromNetwork(verb);
+			if (pos != std::string_view::npos) {
+				str += ' ';
+
+				//Hide passwords if the server admin wants to.
+				if (command->id == commands::PASS && !m_owner.m_pOptions->GetOptionVal(OPTION_LOGSHOWPASS)) {
+					str.append(args.size(), '*');
+				}
+				else {
+					str += args;
+				}
 			}
+			SendStatus(str, 2);
 		}
 		else {
-			// Valid command!
-			return it->second;
+			SendStatus(ConvFromNetwork(line), 2);
 		}
 	}
-	else {
+
+	if (verb.empty()) {
+		return false;
+	}
+	if (command && args.empty() && !rawArgs.empty()) {
+		Send(_T("501 Syntax error, failed to decode string"));
+		return false;
+	}
+	return true;
+}
+
+t_command const* CControlSocket::MapCommand(t_command const* command, CStdString const& args)
+{
+	if (!command) {
 		//Command not recognized
 		Send(_T("500 Syntax error, command unrecognized."));
-		if (!m_RecvLineBuffer.empty()) {
-			m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_COMMAND, m_userid);
-		}
+	}
+	//Does the command needs an argument?
+	else if (command->bHasargs && args.empty()) {
+		Send(_T("501 Syntax error"));
+	}
+	//Can it be issued before logon?
+	else if (!m_status.loggedon && !command->bValidBeforeLogon) {
+		Send(_T("530 Please log in with USER and PASS first."));
+	}
+	else {
+		// Valid command!
+		return command;
 	}
 
-	return invalid_command;
+	return 0;
 }
 
 void CControlSocket::ParseCommand()
 {
-	if (m_antiHammeringWaitTime)
+	// Commands which arrived together are executed back to back, a limited
+	// number at a time so that other connections of the thread get their turn
+	int const maxPipelinedCommands = 64;
+
+	m_holdReplies = true;
+	int executed = 0;
+	while (!m_antiHammeringWaitTime && !m_shutdown && m_SocketData.hSocket != INVALID_SOCKET) {
+		if (executed == maxPipelinedCommands) {
+			if (m_recvBuffer.HasLine()) {
+				m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_COMMAND, m_userid);
+			}
+			break;
+		}
+		if (!ExecuteCommand()) {
+			break;
+		}
+		++executed;
+	}
+	m_holdReplies = false;
+
+	if (m_SocketData.hSocket == INVALID_SOCKET) {
 		return;
+	}
+
+	if (!m_sendQueue.empty() && !FlushSendQueue()) {
+		return;
+	}
+
+	if (m_recvStalled && !m_recvBuffer.full()) {
+		m_recvStalled = false;
+		TriggerEvent(FD_READ);
+	}
+}
+
+bool CControlSocket::ExecuteCommand()
+{
+	if (!m_recvBuffer.HasLine()) {
+		return false;
+	}
 
 	//Get command
-	CStdString command;
+	t_command const* command;
 	CStdString args;
 	if (!GetCommand(command, args))
-		return;
+		return true;
 
-	t_command const& cmd = MapCommand(command, args);
-	if (cmd.id == commands::invalid) {
-		return;
+	if (!MapCommand(command, args)) {
+		return true;
 	}
+	t_command const& cmd = *command;
 
 	//Now process the commands
 	switch (cmd.id)
@@ -818,10 +858,10 @@ void CControlSocket::ParseCommand()
 				addFunc = CPermissions::AddShortListingEntry;
 			}
 
-			std::list<t_dirlisting> result;
+			std::unique_ptr<CDirectoryListing> result;
 			CStdString physicalDir, logicalDir;
 			int error = m_owner.m_pPermissions->GetDirectoryListing(m_status.user, m_CurrentServerDir, args, result, physicalDir, logicalDir
-				, addFunc, m_facts);
+				, addFunc, m_facts, &m_owner.GetListingCache());
 			if (error & PERMISSION_DENIED) {
 				Send(_T("550 Permission denied."));
 				ResetTransferstatus();
@@ -842,7 +882,7 @@ void CControlSocket::ParseCommand()
 
 					CTransferSocket *transfersocket = new CTransferSocket(this);
 					m_transferstatus.socket = transfersocket;
-					transfersocket->Init(result, TRANSFERMODE_LIST);
+					transfersocket->Init(std::move(result), TRANSFERMODE_LIST);
 					if (m_transferMode == mode_zlib) {
 						if (!transfersocket->InitZLib(m_zlibLevel))
 						{
@@ -860,7 +900,7 @@ void CControlSocket::ParseCommand()
 						Send(_T("503 Bad sequence of commands."));
 						break;
 					}
-					m_transferstatus.socket->Init(result, TRANSFERMODE_LIST);
+					m_transferstatus.socket->Init(std::move(result), TRANSFERMODE_LIST);
 					if (m_transferMode == mode_zlib)
 					{
 						if (!m_transferstatus.socket->InitZLib(m_zlibLevel))
@@ -1025,6 +1065,8 @@ void CControlSocket::ParseCommand()
 					}
 				}
 
+				m_owner.InvalidateCaches(physicalFile);
+
 				m_transferstatus.resource = logicalFile;
 				if (!m_transferstatus.pasv) {
 					CTransferSocket *transfersocket = new CTransferSocket(this);
@@ -1122,8 +1164,10 @@ void CControlSocket::ParseCommand()
 				}
 				if (!success)
 					Send(_T("500 Failed to delete the file."));
-				else
+				else {
+					m_owner.InvalidateCaches(physicalFile);
 					Send(_T("250 File deleted successfully"));
+				}
 			}
 		}
 		break;
@@ -1152,8 +1196,10 @@ void CControlSocket::ParseCommand()
 					else
 						Send(_T("450 Internal error deleting the directory."));
 				}
-				else
+				else {
+					m_owner.InvalidateCaches(physicalFile);
 					Send(_T("250 Directory deleted successfully"));
+				}
 			}
 		}
 		break;
@@ -1195,6 +1241,9 @@ void CControlSocket::ParseCommand()
 					str += piece;
 					physicalFile = physicalFile.Mid(physicalFile.Find('\\') + 1);
 					res = CreateDirectory(str, 0);
+					if (res) {
+						m_owner.InvalidateCaches(str);
+					}
 				}
 				if (!bReplySent)
 					if (!res)//CreateDirectory(result+"\\",0))
@@ -1280,8 +1329,11 @@ void CControlSocket::ParseCommand()
 				{
 					if (!MoveFile(RenName, physicalFile))
 						Send(_T("450 Internal error renaming the file"));
-					else
+					else {
+						m_owner.InvalidateCaches(RenName);
+						m_owner.InvalidateCaches(physicalFile);
 						Send(_T("250 file renamed successfully"));
+					}
 				}
 			}
 			else {
@@ -1301,8 +1353,11 @@ void CControlSocket::ParseCommand()
 				{
 					if (!MoveFile(RenName, physicalFile))
 						Send(_T("450 Internal error renaming the file"));
-					else
+					else {
+						m_owner.InvalidateCaches(RenName);
+						m_owner.InvalidateCaches(physicalFile);
 						Send(_T("250 file renamed successfully"));
+					}
 				}
 			}
 		}
@@ -1462,12 +1517,18 @@ void CControlSocket::ParseCommand()
 		}
 	case commands::AUTH:
 		{
-			if (m_nRecvBufferPos || m_RecvLineBuffer.size() ) {
+			if (m_recvBuffer.HasData()) {
 				Send(_T("503 Bad sequence of commands. Received additional data after the AUTH command before this reply could be sent."));
 				ForceClose(-1);
 				break;
 			}
 
+			// Replies of preceding commands must not end up inside the TLS session
+			m_holdReplies = false;
+			if (!m_sendQueue.empty() && !FlushSendQueue()) {
+				break;
+			}
+
 			if (m_pSslLayer) {
 				Send(_T("534 Authentication type already set to TLS"));
 				break;
@@ -1678,8 +1739,8 @@ void CControlSocket::ParseCommand()
 			Send(_T("214-The following commands are recognized:"));
 			CString str;
 			int i = 0;
-			for( auto const& it : command_map ) {
-				CString cmd = it.first;
+			for( auto const& verb : verbs ) {
+				CString cmd = verb.name;
 				while (cmd.GetLength() < 4)
 					cmd += _T(" ");
 				str += _T("   ") + cmd;
@@ -1695,8 +1756,7 @@ void CControlSocket::ParseCommand()
 		else {
 			args.MakeUpper();
 
-			auto const& it = command_map.find(args);
-			if( it != command_map.end() ) {
+			if( FindCommand(fz::to_utf8(args)) ) {
 				CStdString str;
 				str.Format(_T("214 Command %s is supported by FileZilla Server"), args);
 				Send(str);
@@ -1881,8 +1941,10 @@ void CControlSocket::ParseCommand()
 				{
 					if (!SetFileTime(hFile, 0, 0, &ft))
 						Send(_T("550 Failed to set file modification time"));
-					else
+					else {
+						m_owner.InvalidateCaches(physicalFile);
 						Send(_T("213 modify=") + timeval.Left(14) + _T("; ") + logicalFile);
+					}
 
 					CloseHandle(hFile);
 				}
@@ -1920,16 +1982,57 @@ void CControlSocket::ParseCommand()
 				Send(_T("550 File not found"));
 				ResetTransferstatus();
 			}
+			else if (m_hash_id) {
+				Send(_T("450 Another hash operation is already in progress."));
+			}
 			else
 			{
-				int hash_res = m_owner.GetHashThread().Hash(physicalFile, m_hash_algorithm, m_hash_id, &m_owner);
+				m_hashRange[0] = m_rangeStart;
+				m_hashRange[1] = m_rangeEnd;
+				m_rangeStart = 0;
+				m_rangeEnd = -1;
+
+				int64_t const length = (m_hashRange[1] == -1) ? -1 : (m_hashRange[1] - m_hashRange[0] + 1);
+				int hash_res = m_owner.GetHashThread().Hash(physicalFile, m_hash_algorithm, m_hashRange[0], length, m_hash_id, &m_owner);
 				if (hash_res == CHashThread::BUSY)
-					Send(_T("450 Another hash operation is already in progress."));
+					Send(_T("450 Too many hash operations in progress, try again later."));
 				else if (hash_res != CHashThread::PENDING)
 					Send(_T("550 Failed to hash file"));
 			}
 		}
 		break;
+	case commands::RANG:
+		{
+			int pos = args.Find(' ');
+			CStdString start = args.Left(pos);
+			CStdString end = (pos == -1) ? CStdString() : args.Mid(pos + 1);
+			if (start.empty() || end.empty() ||
+				start.find_first_not_of(_T("0123456789")) != CStdString::npos ||
+				end.find_first_not_of(_T("0123456789")) != CStdString::npos)
+			{
+				Send(_T("501 Bad parameter. Numeric values required"));
+				break;
+			}
+
+			int64_t const rangeStart = _ttoi64(start);
+			int64_t const rangeEnd = _ttoi64(end);
+			if (rangeStart == 1 && rangeEnd == 0) {
+				m_rangeStart = 0;
+				m_rangeEnd = -1;
+				Send(_T("350 Resetting range"));
+			}
+			else if (rangeEnd < rangeStart) {
+				Send(_T("501 Bad parameter. End of range must not be before its start"));
+			}
+			else {
+				m_rangeStart = rangeStart;
+				m_rangeEnd = rangeEnd;
+				CStdString str;
+				str.Format(_T("350 Restarting at %I64d. End byte range at %I64d"), rangeStart, rangeEnd);
+				Send(str);
+			}
+		}
+		break;
 	case commands::HTTP:
 		m_bQuitCommand = true;
 		Send(_T("501 this is not an HTTP server, closing connection."));
@@ -1946,10 +2049,7 @@ void CControlSocket::ParseCommand()
 		Send(_T("502 Command not implemented."));
 	}
 
-	if (!m_RecvLineBuffer.empty())
-		m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_COMMAND, m_userid);
-
-	return;
+	return true;
 }
 
 void CControlSocket::ProcessTransferMsg()
@@ -2067,6 +2167,8 @@ CTransferSocket* CControlSocket::GetTransferSocket()
 
 void CControlSocket::ForceClose(int nReason)
 {
+	m_holdReplies = false;
+
 	// Don't call SendTransferInfoNotification, since connection
 	// does get removed real soon.
 	ResetTransferstatus(false);
@@ -2091,6 +2193,12 @@ void CControlSocket::ForceClose(int nReason)
 	{
 		// 221 Goodbye
 	}
+
+	// Includes replies of pipelined commands which were held back
+	if (!m_sendQueue.empty() && !FlushSendQueue()) {
+		return;
+	}
+
 	SendStatus(_T("disconnected."), 0);
 	m_shutdown = true;
 	int res = ShutDown();
@@ -2233,48 +2341,8 @@ BOOL CControlSocket::UnquoteArgs(CStdString &args)
 
 void CControlSocket::OnSend(int nErrorCode)
 {
-	if (m_nSendBufferLen && m_pSendBuffer) {
-		long long nLimit = GetSpeedLimit(download);
-		if (!nLimit)
-			return;
-		int numsend;
-		if (nLimit <= -1 || nLimit > m_nSendBufferLen)
-			numsend = m_nSendBufferLen;
-		else
-			numsend = static_cast<int>(nLimit);
-
-		int numsent = CAsyncSocketEx::Send(m_pSendBuffer, numsend);
-
-		if (numsent==SOCKET_ERROR && GetLastError() == WSAEWOULDBLOCK)
-			return;
-		if (!numsent || numsent == SOCKET_ERROR) {
-			Close();
-			SendStatus(_T("could not send reply, disconnected."), 0);
-			m_owner.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_DELSOCKET, m_userid);
-
-			delete [] m_pSendBuffer;
-			m_pSendBuffer = NULL;
-			m_nSendBufferLen = 0;
-
-			return;
-		}
-
-		if (nLimit > -1)
-			m_SlQuotas[download].nTransferred += numsent;
-
-		if (numsent == m_nSendBufferLen) {
-			delete [] m_pSendBuffer;
-			m_pSendBuffer = NULL;
-			m_nSendBufferLen = 0;
-		}
-		else {
-			char *tmp = m_pSendBuffer;
-			m_pSendBuffer = new char[m_nSendBufferLen-numsent];
-			memcpy(m_pSendBuffer, tmp+numsent, m_nSendBufferLen-numsent);
-			delete [] tmp;
-			m_nSendBufferLen -= numsent;
-			TriggerEvent(FD_WRITE);
-		}
+	if (!m_sendQueue.empty()) {
+		FlushSendQueue();
 	}
 }
 
@@ -2317,38 +2385,26 @@ BOOL CControlSocket::DoUserLogin(std::wstring const& password)
 		return FALSE;
 	}
 
-	std::wstring peerIP;
-	UINT port = 0;
-
-	BOOL bResult = GetPeerName(peerIP, port);
-	if (bResult) {
-		if (!m_status.user.AccessAllowed(peerIP)) {
-			Send(_T("521 This user is not allowed to connect from this IP"));
-			ForceClose(-1);
-			return FALSE;
-		}
-	}
-	else {
-		SendStatus(_T("Could not get peer name"), 1);
-		Send(_T("421 Refusing connection. Could not get peer name."));
+	if (!m_status.user.AccessAllowed(m_RemoteIP)) {
+		Send(_T("521 This user is not allowed to connect from this IP"));
 		ForceClose(-1);
 		return FALSE;
 	}
 
-	int count = m_owner.GetIpCount(peerIP);
+	int count = m_owner.GetIpCount(m_RemoteIP);
 	if (m_status.user.GetIpLimit() && count >= m_status.user.GetIpLimit()) {
 		CStdString str;
 		if (count==1)
-			str.Format(_T("Refusing connection. Reason: No more connections allowed from this IP. (%s already connected once)"), peerIP.c_str());
+			str.Format(_T("Refusing connection. Reason: No more connections allowed from this IP. (%s already connected once)"), m_RemoteIP.ToString().c_str());
 		else
-			str.Format(_T("Refusing connection. Reason: No more connections allowed from this IP. (%s already connected %d times)"), peerIP.c_str(), count);
+			str.Format(_T("Refusing connection. Reason: No more connections allowed from this IP. (%s already connected %d times)"), m_RemoteIP.ToString().c_str(), count);
 		SendStatus(str, 1);
 		Send(_T("421 Refusing connection. No more connections allowed from your IP."));
 		ForceClose(-1);
 		return FALSE;
 	}
 
-	m_status.ip = peerIP;
+	m_status.ip = m_RemoteIP;
 
 	count = GetUserCount(m_status.user.user);
 	if (m_status.user.GetUserLimit() && count >= m_status.user.GetUserLimit()) {
@@ -2361,7 +2417,7 @@ BOOL CControlSocket::DoUserLogin(std::wstring const& password)
 		return FALSE;
 	}
 
-	m_owner.IncIpCount(peerIP);
+	m_owner.IncIpCount(m_RemoteIP);
 	IncUserCount(m_status.username);
 	m_status.loggedon = TRUE;
 
@@ -2401,7 +2457,7 @@ BOOL CControlSocket::DoUserLogin(std::wstring const& password)
 void CControlSocket::Continue()
 {
 	if (m_SlQuotas[download].bContinue) {
-		if( m_nSendBufferLen ) {
+		if (!m_sendQueue.empty()) {
 			TriggerEvent(FD_WRITE);
 		}
 		if (m_transferstatus.socket && m_transferstatus.socket->Started())
@@ -2421,25 +2477,26 @@ long long CControlSocket::GetSpeedLimit(sltype mode)
 {
 	long long nLimit = -1;
 	if (m_status.loggedon ) {
-		nLimit = m_status.user.GetCurrentSpeedLimit(mode);
-	}
-	if (nLimit > 0) {
-		nLimit *= 100;
-		if (m_SlQuotas[mode].nTransferred >= nLimit) {
-			m_SlQuotas[mode].bContinue = true;
-			return 0;
-		}
-		else {
-			nLimit -= m_SlQuotas[mode].nTransferred;
+		CSpeedLimitSchedule & schedule = m_SlQuotas[mode].schedule;
+		int limit;
+		if (!schedule.Get(limit)) {
+			SYSTEMTIME st;
+			GetLocalTime(&st);
+			int validFor = CSpeedLimitSchedule::maxValidity;
+			limit = m_status.user.GetCurrentSpeedLimit(mode, st, validFor);
+			schedule.Set(limit, validFor);
 		}
+		nLimit = limit;
 	}
-	else
-		nLimit = -1;
-	if (m_status.user.BypassServerSpeedLimit(mode))
-		m_SlQuotas[mode].bBypassed = true;
-	else if (m_SlQuotas[mode].nBytesAllowedToTransfer > -1) {
-		if (nLimit <= -1 || nLimit > (m_SlQuotas[mode].nBytesAllowedToTransfer - m_SlQuotas[mode].nTransferred))
-			nLimit = std::max(0ll, m_SlQuotas[mode].nBytesAllowedToTransfer - m_SlQuotas[mode].nTransferred);
+
+	CTokenBucket & bucket = m_SlQuotas[mode].bucket;
+	bucket.SetRate(nLimit > 0 ? nLimit * 1000 : -1);
+	nLimit = bucket.Available();
+
+	if (!m_status.user.BypassServerSpeedLimit(mode)) {
+		long long const serverLimit = m_SlQuotas[mode].flow.Available();
+		if (serverLimit > -1 && (nLimit <= -1 || nLimit > serverLimit))
+			nLimit = serverLimit;
 	}
 
 	if (!nLimit)
@@ -2448,6 +2505,13 @@ long long CControlSocket::GetSpeedLimit(sltype mode)
 	return nLimit;
 }
 
+void CControlSocket::ConsumeSpeedLimit(sltype mode, long long bytes)
+{
+	m_SlQuotas[mode].bucket.Consume(bytes);
+	if (!m_status.user.BypassServerSpeedLimit(mode))
+		m_SlQuotas[mode].flow.Consume(bytes);
+}
+
 BOOL CControlSocket::CreateTransferSocket(CTransferSocket *pTransferSocket)
 {
 	/* Create socket
@@ -2513,30 +2577,10 @@ creation_fallback:
 
 bool CControlSocket::CheckIpForZlib()
 {
-	std::wstring peerIP;
-	UINT port = 0;
-	BOOL bResult = GetPeerName(peerIP, port);
-	if (!bResult)
-		return false;
-
-	if (!m_owner.m_pOptions->GetOptionVal(OPTION_MODEZ_ALLOWLOCAL) && !IsRoutableAddress(peerIP))
+	if (!m_owner.m_pOptions->GetOptionVal(OPTION_MODEZ_ALLOWLOCAL) && !IsRoutableAddress(m_RemoteIP.ToString()))
 		return false;
 
-	CStdString ips = m_owner.m_pOptions->GetOption(OPTION_MODEZ_DISALLOWED_IPS);
-	ips += " ";
-
-	int pos = ips.Find(' ');
-	while (pos != -1)
-	{
-		CStdString blockedIP = ips.Left(pos);
-		ips = ips.Mid(pos + 1);
-		pos = ips.Find(' ');
-
-		if (MatchesFilter(blockedIP, peerIP))
-			return false;
-	}
-
-	return true;
+	return !m_owner.m_pOptions->GetIpFilter(OPTION_MODEZ_DISALLOWED_IPS)->Matches(m_RemoteIP);
 }
 
 void CControlSocket::AntiHammerIncrease(int amount /*=1*/)
@@ -2837,6 +2881,9 @@ void CControlSocket::ProcessHashResult(int hash_id, int res, CHashThread::_algor
 	else if (res == CHashThread::FAILURE_READ) {
 		Send(_T("550 Could not read from file"));
 	}
+	else if (res != CHashThread::OK) {
+		Send(_T("550 Failed to hash file"));
+	}
 	else {
 		std::wstring algname;
 		switch (alg)
@@ -2852,7 +2899,13 @@ void CControlSocket::ProcessHashResult(int hash_id, int res, CHashThread::_algor
 			break;
 		}
 
-		std::wstring result = _T("213 ") + algname + _T(" ") + hash + _T(" ") + file;
+		std::wstring result = _T("213 ") + algname + _T(" ");
+		if (m_hashRange[0] || m_hashRange[1] != -1) {
+			CStdString range;
+			range.Format(_T("%I64d-%I64d "), m_hashRange[0], m_hashRange[1]);
+			result += range;
+		}
+		result += hash + _T(" ") + file;
 		Send(result.c_str());
 	}
 }
@@ -2903,12 +2956,8 @@ bool CControlSocket::CreatePassiveTransferSocket()
 {
 	m_transferstatus.socket = new CTransferSocket(this);
 
-	std::wstring peerIP;
-	UINT tmp = 0;
-	(void)GetPeerName(peerIP, tmp);
-
 	unsigned int retries = 15;
-	PasvPortRandomizer randomizer(pasvPortManager, peerIP, *m_owner.m_pOptions);
+	PasvPortRandomizer randomizer(pasvPortManager, m_RemoteIP, *m_owner.m_pOptions);
 	while (retries > 0) {
 		PortLease port = randomizer.GetPort();
 		if (!port.GetPort()) {
@@ -2943,6 +2992,10 @@ bool CControlSocket::CreatePassiveTransferSocket()
 void CControlSocket::UpdateUser()
 {
 	m_status.user = m_owner.m_pPermissions->GetUser(m_status.username);
+	for (int i = 0; i < 2; ++i) {
+		m_SlQuotas[i].schedule.Invalidate();
+		m_SlQuotas[i].flow.SetShare(m_status.user.user, m_status.user.GetSpeedWeight(), m_status.user.GetMinimumSpeed(static_cast<sltype>(i)) * 1000ll);
+	}
 }
 
 CStdString CControlSocket::PrepareSend(CStdString const& str, bool sendStatus)
@@ -2955,21 +3008,15 @@ CStdString CControlSocket::PrepareSend(CStdString const& str, bool sendStatus)
 
 bool CControlSocket::VerifyIPFromPortCommand(CStdString & ip)
 {
-	std::wstring controlIP;
-	UINT tmp{};
-	if (!GetPeerName(controlIP, tmp)) {
-		Send(_T("421 Rejected command. Could not get peer name."));
-		return false;
-	}
-
 	if (m_owner.m_pOptions->GetOptionVal(OPTION_ACTIVE_IGNORELOCAL)) {
+		std::wstring const controlIP = m_RemoteIP.ToString();
 		if (!IsRoutableAddress(ip) && IsRoutableAddress(controlIP)) {
 			ip = controlIP;
 		}
 	}
 
 	// Verify peer IP against control connection
-	if (!CTransferSocket::IsAllowedDataConnectionIP(controlIP, ip, GetFamily(), *m_owner.m_pOptions)) {
+	if (!CTransferSocket::IsAllowedDataConnectionIP(m_RemoteIP, CIpAddress::Parse(ip), *m_owner.m_pOptions)) {
 		Send(_T("421 Rejected command, requested IP address does not match control connection IP."));
 		return false;
 	}
@@ -20,7 +20,10 @@
 #define AFX_CONTROLSOCKET_H__17DD46FD_8A4A_4394_9F90_C14BA65F6BF6__INCLUDED_
 
 #include "hash_thread.h"
+#include "command_buffer.h"
 #include "Permissions.h"
+#include "send_queue.h"
+#include "speed_limiter.h"
 
 #include <libfilezilla/time.hpp>
 
@@ -49,7 +52,7 @@ public:
 	virtual ~CControlSocket();
 
 	CServerThread & m_owner;
-	CStdString m_RemoteIP;
+	CIpAddress m_RemoteIP;
 	void WaitGoOffline();
 	bool m_bWaitGoOffline{};
 	void CheckForTimeout(fz::monotonic_clock const& now);
@@ -57,12 +60,12 @@ public:
 	CTransferSocket* GetTransferSocket();
 	void ProcessTransferMsg();
 	void ParseCommand();
-	t_command const& MapCommand(CStdString const& command, CStdString const& args);
+	t_command const* MapCommand(t_command const* command, CStdString const& args);
 	int m_userid{};
 	BOOL Send(LPCTSTR str, bool sendStatus = true, bool newline = true);
 	void SendStatus(LPCTSTR status,int type);
 	CStdString PrepareSend(CStdString const& str, bool sendStatus = true);
-	bool GetCommand(CStdString &command, CStdString &args);
+	bool GetCommand(t_command const*& command, CStdString &args);
 	bool InitImplicitSsl();
 
 	virtual void OnReceive(int nErrorCode);
@@ -96,17 +99,27 @@ protected:
 	bool CreatePassiveTransferSocket();
 	bool VerifyIPFromPortCommand(CStdString & ip);
 
+	// Sends as much of the queued replies as the socket and the speed limit
+	// allow. Returns false if the connection got closed.
+	bool FlushSendQueue();
+
+	// Executes the next command, returns false if there was none
+	bool ExecuteCommand();
+
 	virtual int OnLayerCallback(std::list<t_callbackMsg> const& callbacks);
 
 	CAsyncSslSocketLayer *m_pSslLayer{};
 
-	std::list<CStdStringA> m_RecvLineBuffer;
-	char m_RecvBuffer[2048];
-	int m_nRecvBufferPos{};
-	char *m_pSendBuffer{};
-	int m_nSendBufferLen{};
+	CCommandBuffer m_recvBuffer;
+
+	// Set if receiving got suspended as the buffer is full of commands
+	bool m_recvStalled{};
 
-	int m_nTelnetSkip{};
+	CSendQueue m_sendQueue;
+
+	// Set while pipelined commands get executed, their replies are sent
+	// together afterwards
+	bool m_holdReplies{};
 	bool m_bQuitCommand{};
 	fz::monotonic_clock m_lastCmdTime, m_lastTransferTime, m_loginTime;
 	static std::map<CStdString, int> m_UserCount;
@@ -118,7 +131,7 @@ protected:
 		BOOL loggedon{};
 		CStdString username;
 		CUser user;
-		CStdString ip;
+		CIpAddress ip;
 
 		int hammerValue{};
 	} m_status;
@@ -162,17 +175,34 @@ protected:
 
 	int m_hash_id{};
 
+	// Byte range set with RANG for the next HASH, end is inclusive.
+	// m_hashRange is the range of the hash in progress.
+	int64_t m_rangeStart{};
+	int64_t m_rangeEnd{-1};
+	int64_t m_hashRange[2]{0, -1};
+
 	enum CHashThread::_algorithm m_hash_algorithm;
 
 public:
 	long long GetSpeedLimit(enum sltype);
 
-	typedef struct {
-		bool bContinue;
-		long long nBytesAllowedToTransfer;
-		long long nTransferred;
-		bool bBypassed;
-	} t_Quota;
+	// Takes the transferred bytes from the speed limit buckets
+	void ConsumeSpeedLimit(enum sltype, long long bytes);
+
+	struct t_Quota {
+		t_Quota(CBandwidthScheduler & scheduler)
+			: flow(scheduler)
+		{}
+
+		bool bContinue{};
+
+		// The user's own limit, applies to this connection only
+		CTokenBucket bucket;
+		CSpeedLimitSchedule schedule;
+
+		// Share of the server-wide limit
+		CBandwidthScheduler::flow flow;
+	};
 	t_Quota m_SlQuotas[2];
 };
 
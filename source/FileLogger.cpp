@@ -21,23 +21,62 @@
 #include "Options.h"
 
 #include <libfilezilla/string.hpp>
+#include <libfilezilla/thread.hpp>
 
 #include <string_view>
 
+namespace {
+// Lines are written at most this long after being logged
+fz::duration const flushDelay = fz::duration::from_seconds(1);
+}
+
+class CFileLogger::worker final : protected fz::thread
+{
+public:
+	explicit worker(CFileLogger& logger)
+		: logger_(logger)
+	{
+		run();
+	}
+
+	virtual ~worker()
+	{
+		join();
+	}
+
+private:
+	virtual void entry()
+	{
+		logger_.Run();
+	}
+
+	CFileLogger& logger_;
+};
+
 //////////////////////////////////////////////////////////////////////
 // Konstruktion/Destruktion
 //////////////////////////////////////////////////////////////////////
 
 CFileLogger::CFileLogger(COptions *pOptions)
+	: m_pOptions(pOptions)
+	, path_(GetExecutableDirectory() + _T("Logs\\"))
 {
-	m_hLogFile = INVALID_HANDLE_VALUE;
-	m_pOptions = pOptions;
-
 	CheckLogFile();
+
+	worker_ = make_unique<worker>(*this);
 }
 
 CFileLogger::~CFileLogger()
 {
+	{
+		fz::scoped_lock lock(mutex_);
+		quit_ = true;
+		cond_.signal(lock);
+	}
+
+	// Writes out the remaining lines
+	worker_.reset();
+
 	if (m_hLogFile != INVALID_HANDLE_VALUE) {
 		CloseHandle(m_hLogFile);
 	}
@@ -45,7 +84,7 @@ CFileLogger::~CFileLogger()
 
 bool CFileLogger::Log(LPCTSTR msg)
 {
-	if (m_hLogFile == INVALID_HANDLE_VALUE) {
+	if (!m_enabled) {
 		return true;
 	}
 
@@ -54,37 +93,131 @@ bool CFileLogger::Log(LPCTSTR msg)
 		return false;
 	}
 
-	DWORD numwritten;
-	if (!WriteFile(m_hLogFile, utf8.c_str(), utf8.size(), &numwritten, 0) || !WriteFile(m_hLogFile, "\r\n", 2, &numwritten, 0)) {
-		CloseHandle(m_hLogFile);
-		m_hLogFile = INVALID_HANDLE_VALUE;
+	return Log(std::string_view(utf8));
+}
+
+bool CFileLogger::Log(std::string_view const& utf8)
+{
+	if (!m_enabled) {
+		return true;
+	}
+
+	fz::scoped_lock lock(mutex_);
+
+	size_t const size = pending_.size();
+	if (size + utf8.size() + 2 > maxPending) {
+		++dropped_;
 		return false;
 	}
 
+	pending_.append(utf8.data(), utf8.size());
+	pending_ += "\r\n";
+
+	// The logging thread needs to start its timer for the first line and
+	// needs to write right away once there is enough
+	if (!size) {
+		pendingSince_ = fz::monotonic_clock::now();
+		cond_.signal(lock);
+	}
+	else if (size < flushSize && pending_.size() >= flushSize) {
+		cond_.signal(lock);
+	}
+
 	return true;
 }
 
-bool CFileLogger::CheckLogFile()
+void CFileLogger::CheckLogFile()
+{
+	t_settings settings;
+	settings.enabled = m_pOptions->GetOptionVal(OPTION_ENABLELOGGING) != 0;
+	settings.logType = m_pOptions->GetOptionVal(OPTION_LOGTYPE);
+	settings.limit = m_pOptions->GetOptionVal(OPTION_LOGLIMITSIZE);
+	settings.deleteTime = m_pOptions->GetOptionVal(OPTION_LOGDELETETIME);
+
+	m_enabled = settings.enabled;
+
+	fz::scoped_lock lock(mutex_);
+	settings_ = settings;
+	check_ = true;
+	cond_.signal(lock);
+}
+
+void CFileLogger::Run()
+{
+	std::string data;
+
+	fz::scoped_lock lock(mutex_);
+	while (true) {
+		while (!quit_ && !check_ && pending_.size() < flushSize) {
+			if (pending_.empty()) {
+				cond_.wait(lock);
+			}
+			else {
+				fz::duration const waited = fz::monotonic_clock::now() - pendingSince_;
+				if (waited >= flushDelay) {
+					break;
+				}
+				cond_.wait(lock, flushDelay - waited);
+			}
+		}
+
+		bool const quit = quit_;
+		bool const check = check_;
+		t_settings const settings = settings_;
+		uint64_t const dropped = dropped_;
+		check_ = false;
+		dropped_ = 0;
+		data.swap(pending_);
+
+		lock.unlock();
+
+		// Rotation happens before writing, lines logged after changing the
+		// settings or a date change already belong into the new file.
+		if (check) {
+			Rotate(settings);
+		}
+		if (dropped) {
+			data += std::to_string(dropped) + " log messages have been dropped, the log file cannot keep up.";
+			data += "\r\n";
+		}
+		if (!data.empty()) {
+			Write(data);
+			data.clear();
+		}
+
+		lock.lock();
+
+		if (quit) {
+			break;
+		}
+	}
+}
+
+void CFileLogger::Write(std::string const& data)
 {
-	if (!m_pOptions->GetOptionVal(OPTION_ENABLELOGGING)) {
+	if (m_hLogFile == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	DWORD numwritten;
+	if (!WriteFile(m_hLogFile, data.c_str(), static_cast<DWORD>(data.size()), &numwritten, 0)) {
+		CloseHandle(m_hLogFile);
+		m_hLogFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+void CFileLogger::Rotate(t_settings const& settings)
+{
+	if (!settings.enabled) {
 		if (m_hLogFile != INVALID_HANDLE_VALUE) {
 			CloseHandle(m_hLogFile);
 			m_hLogFile = INVALID_HANDLE_VALUE;
 		}
-		return true;
-	}
-
-	//Get logfile path
-	TCHAR path[MAX_PATH + 1000]; //Make it large enough
-	GetModuleFileName( 0, path, MAX_PATH );
-	LPTSTR pos = _tcsrchr(path, '\\');
-	if (pos) {
-		*++pos = 0;
+		return;
 	}
-	_tcscat(path, _T("Logs\\"));
 
 	//Get logfile name
-	int64_t nLogType = m_pOptions->GetOptionVal(OPTION_LOGTYPE);
+	int64_t nLogType = settings.logType;
 	TCHAR filename[MAX_PATH + 1];
 	if (!nLogType) {
 		_tcscpy(filename, _T("FileZilla Server.log"));
@@ -95,25 +228,23 @@ bool CFileLogger::CheckLogFile()
 		_stprintf(filename, _T("fzs-%d-%02d-%02d.log"), time.wYear, time.wMonth, time.wDay);
 	}
 
-	if (m_hLogFile == INVALID_HANDLE_VALUE || fileName_.empty()) {
-		TCHAR buffer[MAX_PATH + 1000]; //Make it large enough
-		_tcscpy(buffer, path);
-		CreateDirectory(buffer, NULL);
+	// Also switches to a new file once the date changes
+	if (m_hLogFile == INVALID_HANDLE_VALUE || fileName_ != filename) {
+		CreateDirectory(path_.c_str(), NULL);
 
 		fileName_ = filename;
-		_tcscat(buffer, filename);
 
 		if (m_hLogFile != INVALID_HANDLE_VALUE) {
 			CloseHandle(m_hLogFile);
 		}
-		m_hLogFile = CreateFile(buffer, GENERIC_WRITE|GENERIC_READ, FILE_SHARE_READ, 0, OPEN_ALWAYS, 0, 0);
+		m_hLogFile = CreateFile((path_ + fileName_).c_str(), GENERIC_WRITE|GENERIC_READ, FILE_SHARE_READ, 0, OPEN_ALWAYS, 0, 0);
 		if (m_hLogFile == INVALID_HANDLE_VALUE) {
-			return false;
+			return;
 		}
 
 		SetFilePointer(m_hLogFile, 0, 0, FILE_END);
 	}
-	int64_t nLimit = m_pOptions->GetOptionVal(OPTION_LOGLIMITSIZE);
+	int64_t nLimit = settings.limit;
 
 	if (nLogType) {
 		//Different logfiles for each day
@@ -128,16 +259,14 @@ bool CFileLogger::CheckLogFile()
 		SystemTimeToFileTime(&time, &curFileTime);
 		int64_t nTime = curFileTime.dwLowDateTime + ((int64_t)curFileTime.dwHighDateTime<<32);
 
-		TCHAR buffer[MAX_PATH + 1000]; //Make it large enough
-		_tcscpy(buffer, path);
-		_tcscat(buffer, _T("fzs-*.log"));
+		std::wstring const pattern = path_ + _T("fzs-*.log");
 
 		WIN32_FIND_DATA FindFileData;
 		WIN32_FIND_DATA NextFindFileData;
 		HANDLE hFind;
-		hFind = FindFirstFile(buffer, &NextFindFileData);
+		hFind = FindFirstFile(pattern.c_str(), &NextFindFileData);
 
-		int64_t nDeleteTime = (int64_t)m_pOptions->GetOptionVal(OPTION_LOGDELETETIME);
+		int64_t nDeleteTime = settings.deleteTime;
 		if (nDeleteTime) {
 			nDeleteTime = (nDeleteTime + 1) * 60 * 60 * 24 * 10000000;
 		}
@@ -166,27 +295,30 @@ bool CFileLogger::CheckLogFile()
 
 			int64_t curtime=FindFileData.ftLastWriteTime.dwLowDateTime + ((int64_t)FindFileData.ftLastWriteTime.dwHighDateTime<<32);
 			int64_t span = nTime - curtime;
-			TCHAR filename[MAX_PATH + 1000];
-			_tcscpy(filename, path);
-			_tcscat(filename, FindFileData.cFileName);
+			std::wstring const file = path_ + FindFileData.cFileName;
 			if (nDeleteTime && span > nDeleteTime) {
-				DeleteFile(filename); //File is too old, delete it
+				DeleteFile(file.c_str()); //File is too old, delete it
 			}
 			else {
 				totalsize += size;
 				if (curtime < oldestDate || !oldestDate) {
 					oldestDate = curtime;
-					oldestname = filename;
+					oldestname = file;
 				}
 			}
 		}
 
 		if (!oldestname.empty() && nLimit && totalsize > nLimit * 1024) {
 			DeleteFile(oldestname.c_str());
-			return true;
+			return;
 		}
 	}
 
+	Shrink(nLimit);
+}
+
+void CFileLogger::Shrink(int64_t nLimit)
+{
 	//Single logfile, check size...
 	if (nLimit) {
 		int64_t size = GetPosition64(m_hLogFile);
@@ -237,5 +369,4 @@ bool CFileLogger::CheckLogFile()
 			SetEndOfFile(m_hLogFile);
 		}
 	}
-	return true;
 }
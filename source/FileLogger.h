@@ -19,6 +19,23 @@
 #if !defined(AFX_FILELOGGER_H__FDF4A6C8_5A47_40FE_8D82_804E0DCCE3FE__INCLUDED_)
 #define AFX_FILELOGGER_H__FDF4A6C8_5A47_40FE_8D82_804E0DCCE3FE__INCLUDED_
 
+#include <libfilezilla/mutex.hpp>
+#include <libfilezilla/time.hpp>
+
+/*
+Writes the log file on a thread of its own, so that slow storage never holds
+up the main thread.
+
+Log only appends the line to a buffer in memory. The logging thread writes
+the buffer with a single call once a second or as soon as it reaches
+flushSize, whatever happens first. If the buffer grows beyond maxPending
+because the disk cannot keep up, further lines get dropped and counted.
+
+CheckLogFile reads the logging options on the calling thread. Opening the
+file, switching to a new file on date changes, deleting old logs and
+enforcing the size limit is left to the logging thread.
+*/
+
 class COptions;
 class CFileLogger final
 {
@@ -26,13 +43,56 @@ public:
 	CFileLogger(COptions *pOptions);
 	~CFileLogger();
 
-	bool CheckLogFile();
+	void CheckLogFile();
+
 	bool Log(LPCTSTR msg);
+	bool Log(std::string_view const& utf8);
+
+	bool IsEnabled() const { return m_enabled; }
+
+	static size_t const flushSize = 64 * 1024;
+	static size_t const maxPending = 4 * 1024 * 1024;
 
 protected:
-	std::wstring fileName_;
+	struct t_settings
+	{
+		bool enabled{};
+		int64_t logType{};
+		int64_t limit{};
+		int64_t deleteTime{};
+	};
+
+	class worker;
+	void Run();
+
+	// Only used by the logging thread
+	void Rotate(t_settings const& settings);
+	void Shrink(int64_t limit);
+	void Write(std::string const& data);
+
 	COptions *m_pOptions;
-	HANDLE m_hLogFile;
+
+	// Only used by the thread calling Log
+	bool m_enabled{};
+
+	// Directory of the logs, with trailing separator
+	std::wstring const path_;
+
+	fz::mutex mutex_{false};
+	fz::condition cond_;
+	std::string pending_;
+	fz::monotonic_clock pendingSince_;
+	uint64_t dropped_{};
+	t_settings settings_;
+	bool check_{};
+	bool quit_{};
+
+	// Only used by the logging thread
+	std::wstring fileName_;
+	HANDLE m_hLogFile{INVALID_HANDLE_VALUE};
+
+	// Declared last, it needs to be destroyed first as it joins the thread
+	std::unique_ptr<worker> worker_;
 };
 
 #endif // !defined(AFX_FILELOGGER_H__FDF4A6C8_5A47_40FE_8D82_804E0DCCE3FE__INCLUDED_)
@@ -42,6 +42,7 @@ COptionsAutobanPage::COptionsAutobanPage(COptionsDlg *pOptionsDlg, CWnd* pParent
 	m_attempts = _T("5");
 	m_time = _T("1");
 	m_type = 0;
+	m_subnets = false;
 	//}}AFX_DATA_INIT
 }
 
@@ -56,6 +57,7 @@ void COptionsAutobanPage::DoDataExchange(CDataExchange* pDX)
 	DDX_Text(pDX, ID_BANTIME, m_time);
 	DDV_MaxChars(pDX, m_time, 3);
 	DDX_Radio(pDX, IDC_BANTYPE1, m_type);
+	DDX_Check(pDX, IDC_AUTOBAN_SUBNETS, m_subnets);
 	//}}AFX_DATA_MAP
 }
 
@@ -82,6 +84,7 @@ void COptionsAutobanPage::LoadData()
 	m_attempts.Format(_T("%d"), static_cast<int>(m_pOptionsDlg->GetOptionVal(OPTION_AUTOBAN_ATTEMPTS)));
 	m_time.Format(_T("%d"), static_cast<int>(m_pOptionsDlg->GetOptionVal(OPTION_AUTOBAN_BANTIME)));
 	m_type = m_pOptionsDlg->GetOptionVal(OPTION_AUTOBAN_TYPE) ? 1 : 0;
+	m_subnets = m_pOptionsDlg->GetOptionVal(OPTION_AUTOBAN_SUBNETS) ? true : false;
 }
 
 void COptionsAutobanPage::SaveData()
@@ -90,6 +93,7 @@ void COptionsAutobanPage::SaveData()
 	m_pOptionsDlg->SetOption(OPTION_AUTOBAN_ATTEMPTS, _ttoi(m_attempts));
 	m_pOptionsDlg->SetOption(OPTION_AUTOBAN_BANTIME, _ttoi(m_time));
 	m_pOptionsDlg->SetOption(OPTION_AUTOBAN_TYPE, (m_type == 0) ? 0 : 1);
+	m_pOptionsDlg->SetOption(OPTION_AUTOBAN_SUBNETS, m_subnets ? 1 : 0);
 }
 
 BOOL COptionsAutobanPage::IsDataValid()
@@ -41,6 +41,7 @@ public:
 	CString	m_attempts;
 	CString	m_time;
 	int		m_type;
+	BOOL	m_subnets;
 	//}}AFX_DATA
 
 
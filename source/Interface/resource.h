@@ -259,6 +259,7 @@
 #define IDC_DATAIPMATCH_EXACT           1208
 #define IDC_DATAIPMATCH_RELAXED         1209
 #define IDC_DATAIPMATCH_NONE            1210
+#define IDC_AUTOBAN_SUBNETS             1211
 #define ID_ACTIVE                       32768
 #define ID_DIRMENU_ADD                  32769
 #define ID_DIRMENU_REMOVE               32770
@@ -307,7 +308,7 @@
 #define _APS_3D_CONTROLS                     1
 #define _APS_NEXT_RESOURCE_VALUE        168
 #define _APS_NEXT_COMMAND_VALUE         32807
-#define _APS_NEXT_CONTROL_VALUE         1211
+#define _APS_NEXT_CONTROL_VALUE         1212
 #define _APS_NEXT_SYMED_VALUE           1228
 #endif
 #endif
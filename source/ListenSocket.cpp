@@ -55,17 +55,7 @@ void CListenSocket::OnAccept(int nErrorCode)
 		return;
 	}
 
-	int minnum = 255*255*255;
-	CServerThread *pBestThread = 0;
-	for (auto const& pThread : m_threadList) {
-		int num = pThread->GetNumConnections();
-		if (num < minnum && pThread->IsReady()) {
-			minnum = num;
-			pBestThread = pThread;
-			if (!num)
-				break;
-		}
-	}
+	CServerThread *pBestThread = SelectThread();
 
 	if (!pBestThread) {
 		char str[] = "421 Server offline.";
@@ -84,6 +74,58 @@ void CListenSocket::OnAccept(int nErrorCode)
 	pBestThread->AddSocket(sockethandle, m_ssl);
 }
 
+CServerThread* CListenSocket::SelectThread() const
+{
+	struct t_load
+	{
+		CServerThread *pThread;
+		int connections;
+		int64_t rate;
+	};
+
+	std::vector<t_load> loads;
+	loads.reserve(m_threadList.size());
+
+	int totalConnections = 0;
+	int64_t totalRate = 0;
+	for (auto const& pThread : m_threadList) {
+		if (!pThread->IsReady()) {
+			continue;
+		}
+
+		t_load load{pThread, pThread->GetNumConnections(), pThread->GetTransferRate()};
+		if (!load.connections && !load.rate) {
+			// Idle thread, can't do any better
+			return pThread;
+		}
+		totalConnections += load.connections;
+		totalRate += load.rate;
+		loads.push_back(load);
+	}
+
+	// A thread's load is its share of all connections plus its share of the
+	// data currently being transferred. Otherwise a thread with a few bulk
+	// transfers would keep getting new connections while others with many
+	// idle connections sit around doing nothing.
+	CServerThread *pBestThread = 0;
+	double minLoad = 0;
+	for (auto const& load : loads) {
+		double share = 0;
+		if (totalConnections) {
+			share += static_cast<double>(load.connections) / totalConnections;
+		}
+		if (totalRate) {
+			share += static_cast<double>(load.rate) / totalRate;
+		}
+		if (!pBestThread || share < minLoad) {
+			minLoad = share;
+			pBestThread = load.pThread;
+		}
+	}
+
+	return pBestThread;
+}
+
 void CListenSocket::SendStatus(CStdString status, int type)
 {
 	m_server.ShowStatus(status, type);
@@ -91,53 +133,21 @@ void CListenSocket::SendStatus(CStdString status, int type)
 
 bool CListenSocket::AccessAllowed(CAsyncSocketEx &socket) const
 {
-	std::wstring peerIP;
+	CIpAddress address;
 	UINT port = 0;
-	BOOL bResult = socket.GetPeerName(peerIP, port);
-	if (!bResult) {
+	if (!socket.GetPeerName(address, port)) {
 		return true;
 	}
 
 	if (m_server.m_pAutoBanManager) {
-		if (m_server.m_pAutoBanManager->IsBanned((peerIP.find(':') == std::wstring::npos) ? peerIP : GetIPV6ShortForm(peerIP))) {
+		if (m_server.m_pAutoBanManager->IsBanned(address)) {
 			return false;
 		}
 	}
 
-	bool disallowed = false;
-
-	// Get the list of IP filter rules.
-	std::wstring ips = m_server.m_pOptions->GetOption(OPTION_IPFILTER_DISALLOWED);
-	ips += L" ";
-
-	size_t pos = ips.find(' ');
-	while (pos != std::wstring::npos) {
-		std::wstring blockedIP = ips.substr(0, pos);
-		ips = ips.substr(pos + 1);
-		pos = ips.find(' ');
-
-		if ((disallowed = MatchesFilter(blockedIP, peerIP))) {
-			break;
-		}
-	}
-
-	if (!disallowed) {
+	if (!m_server.m_pOptions->GetIpFilter(OPTION_IPFILTER_DISALLOWED)->Matches(address)) {
 		return true;
 	}
 
-	ips = m_server.m_pOptions->GetOption(OPTION_IPFILTER_ALLOWED);
-	ips += L" ";
-
-	pos = ips.find(' ');
-	while (pos != std::wstring::npos) {
-		std::wstring blockedIP = ips.substr(0, pos);
-		ips = ips.substr(pos + 1);
-		pos = ips.find(' ');
-
-		if (MatchesFilter(blockedIP, peerIP)) {
-			return true;
-		}
-	}
-
-	return false;
+	return m_server.m_pOptions->GetIpFilter(OPTION_IPFILTER_ALLOWED)->Matches(address);
 }
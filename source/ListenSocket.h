@@ -39,6 +39,9 @@ protected:
 	virtual void OnAccept(int nErrorCode);
 
 	void SendStatus(CStdString status, int type);
+
+	// Returns the least loaded server thread that accepts new connections
+	CServerThread* SelectThread() const;
 	bool AccessAllowed(CAsyncSocketEx &socket) const;
 
 	CServer & m_server;
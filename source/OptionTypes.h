@@ -78,8 +78,9 @@
 #define OPTION_AUTOBAN_TYPE 57
 #define OPTION_AUTOBAN_BANTIME 58
 #define OPTION_TLS_MINVERSION 59
+#define OPTION_AUTOBAN_SUBNETS 60
 
-#define OPTIONS_NUM 59
+#define OPTIONS_NUM 60
 
 #define CONST_WELCOMEMESSAGE_LINESIZE 75
 
@@ -91,7 +92,7 @@ struct t_Option
 };
 
 const DWORD SERVER_VERSION = 0x00096000;
-const DWORD PROTOCOL_VERSION = 0x00014000;
+const DWORD PROTOCOL_VERSION = 0x00014100;
 
 //												Name					Type		Not remotely
 //																(0=str, 1=numeric)   changeable
@@ -153,7 +154,8 @@ static const t_Option m_Options[OPTIONS_NUM]={	"Serverports",				0,	false,
 												"Autoban attempts",			1,	false,
 												"Autoban type",				1,	false,
 												"Autoban time",				1,	false,
-												"Minimum TLS version",		1,	false
+												"Minimum TLS version",		1,	false,
+												"Autoban subnets",			1,	false
 											};
 
 #endif
@@ -117,6 +117,8 @@ protected:
 			simple_lock lock(COptions::m_mutex);
 			pWnd->m_pOptions->m_SpeedLimits[0] = COptions::m_sSpeedLimits[0];
 			pWnd->m_pOptions->m_SpeedLimits[1] = COptions::m_sSpeedLimits[1];
+			pWnd->m_pOptions->m_ipFilters.clear();
+			++pWnd->m_pOptions->m_revision;
 		}
 		return ::DefWindowProc(hWnd, message, wParam, lParam);
 	}
@@ -271,6 +273,7 @@ void COptions::SetOption(int nOptionID, int64_t value, bool save)
 		}
 		break;
 	case OPTION_MODEZ_ALLOWLOCAL:
+	case OPTION_AUTOBAN_SUBNETS:
 		if (value < 0 || value > 1) {
 			value = 0;
 		}
@@ -540,6 +543,7 @@ void COptions::SetOption(int nOptionID, std::wstring str, bool save)
 		m_sOptionsCache[nOptionID - 1].value = fz::to_integral<int64_t>(str);
 		m_OptionsCache[nOptionID - 1] = m_sOptionsCache[nOptionID - 1];
 	}
+	m_ipFilters.erase(nOptionID);
 
 	if (!save) {
 		return;
@@ -1034,7 +1038,7 @@ bool COptions::ReadSpeedLimits(pugi::xml_node const& settings)
 	return true;
 }
 
-int COptions::GetCurrentSpeedLimit(int nMode)
+int COptions::GetCurrentSpeedLimit(int nMode, SYSTEMTIME const& time, int & validFor)
 {
 	Init();
 
@@ -1050,10 +1054,9 @@ int COptions::GetCurrentSpeedLimit(int nMode)
 		return (int)GetOptionVal(limit[nMode]);
 	default:
 		{
-			SYSTEMTIME s;
-			GetLocalTime(&s);
 			for (SPEEDLIMITSLIST::const_iterator iter = m_SpeedLimits[nMode].begin(); iter != m_SpeedLimits[nMode].end(); ++iter) {
-				if (iter->IsItActive(s)) {
+				validFor = std::min(validFor, iter->GetSecondsToChange(time));
+				if (iter->IsItActive(time)) {
 					return iter->m_Speed;
 				}
 			}
@@ -1062,6 +1065,15 @@ int COptions::GetCurrentSpeedLimit(int nMode)
 	}
 }
 
+std::shared_ptr<CIpFilter const> COptions::GetIpFilter(int nOptionID)
+{
+	auto & filter = m_ipFilters[nOptionID];
+	if (!filter) {
+		filter = std::make_shared<CIpFilter const>(GetOption(nOptionID));
+	}
+	return filter;
+}
+
 void COptions::ReloadConfig()
 {
 	Init(true);
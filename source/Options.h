@@ -32,6 +32,7 @@ namespace XML {
 class file;
 }
 
+class CIpFilter;
 class COptionsHelperWindow;
 class COptions final
 {
@@ -51,7 +52,15 @@ public:
 	bool ParseOptionsCommand(unsigned char *pData, DWORD dwDataLength, bool bFromLocal = false);
 	void SetOption(int nOptionID, std::wstring str, bool save = true);
 	void SetOption(int nOptionID, int64_t value, bool save = true);
-	int GetCurrentSpeedLimit(int nMode);
+	// Lowers validFor to the number of seconds the returned limit stays in
+	// effect
+	int GetCurrentSpeedLimit(int nMode, SYSTEMTIME const& time, int & validFor);
+
+	// Changes whenever this instance picks up modified options
+	unsigned int GetRevision() const { return m_revision; }
+
+	// Compiled form of an address filter option, kept until the options change
+	std::shared_ptr<CIpFilter const> GetIpFilter(int nOptionID);
 	void ReloadConfig();
 
 protected:
@@ -78,6 +87,13 @@ protected:
 
 	static void UpdateInstances();
 	COptionsHelperWindow *m_pOptionsHelperWindow{};
+
+	unsigned int m_revision{};
+
+	std::map<int, std::shared_ptr<CIpFilter const>> m_ipFilters;
 };
 
+// Backslash-terminated
+std::wstring GetExecutableDirectory();
+
 #endif
@@ -30,6 +30,7 @@
 #include <libfilezilla/string.hpp>
 
 #include <array>
+#include <atomic>
 #include <cwctype>
 
 class CPermissionsHelperWindow final
@@ -133,7 +134,96 @@ CPermissions::~CPermissions()
 	delete m_pPermissionsHelperWindow;
 }
 
-void CPermissions::AddLongListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, const t_directory& directory, __int64 size, FILETIME* pTime, std::string const&, bool *)
+namespace {
+// Writes v right-aligned to at least width characters, returns the number of
+// characters written.
+unsigned int FormatNumber(char* out, uint64_t v, unsigned int width = 0, char fill = '0')
+{
+	char buf[20];
+	char* p = buf + sizeof(buf);
+	do {
+		*--p = '0' + static_cast<char>(v % 10);
+		v /= 10;
+	} while (v);
+
+	unsigned int const digits = static_cast<unsigned int>(buf + sizeof(buf) - p);
+	unsigned int pad = 0;
+	if (width > digits) {
+		pad = width - digits;
+		memset(out, fill, pad);
+	}
+	memcpy(out + pad, p, digits);
+	return pad + digits;
+}
+
+void FormatTwoDigits(char* out, unsigned int v)
+{
+	out[0] = '0' + static_cast<char>(v / 10);
+	out[1] = '0' + static_cast<char>(v % 10);
+}
+
+struct t_dateTime
+{
+	int year;
+	unsigned int month, day, hour, minute, second;
+};
+
+// Same as FileTimeToSystemTime, takes 100ns intervals since 1601-01-01.
+t_dateTime ToDateTime(int64_t ticks)
+{
+	int64_t const ticksPerDay = 864000000000ll;
+	int64_t days = ticks / ticksPerDay;
+	int64_t rem = ticks % ticksPerDay;
+	if (rem < 0) {
+		rem += ticksPerDay;
+		--days;
+	}
+
+	t_dateTime ret;
+	unsigned int const seconds = static_cast<unsigned int>(rem / 10000000);
+	ret.hour = seconds / 3600;
+	ret.minute = seconds / 60 % 60;
+	ret.second = seconds % 60;
+
+	// Civil from days, with days counted from 0000-03-01 in the proleptic
+	// Gregorian calendar so that leap days come last in a year.
+	int64_t const z = days + 584694;
+	int64_t const era = (z >= 0 ? z : z - 146096) / 146097;
+	unsigned int const doe = static_cast<unsigned int>(z - era * 146097);
+	unsigned int const yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned int const doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned int const mp = (5 * doy + 2) / 153;
+	ret.day = doy - (153 * mp + 2) / 5 + 1;
+	ret.month = mp < 10 ? mp + 3 : mp - 9;
+	ret.year = static_cast<int>(yoe + era * 400) + (ret.month <= 2 ? 1 : 0);
+	return ret;
+}
+
+int64_t ToTicks(FILETIME const& t)
+{
+	return (static_cast<int64_t>(t.dwHighDateTime) << 32) + t.dwLowDateTime;
+}
+
+char const months[][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+}
+
+t_listingContext::t_listingContext(std::string const& dirToDisplay, bool *enabledFacts)
+	: dirToDisplay(dirToDisplay)
+	, enabledFacts(enabledFacts)
+{
+	SYSTEMTIME sLocalTime;
+	GetLocalTime(&sLocalTime);
+	FILETIME fTime;
+	VERIFY(SystemTimeToFileTime(&sLocalTime, &fTime));
+	now = ToTicks(fTime);
+
+	TIME_ZONE_INFORMATION tzInfo;
+	int tzRes = GetTimeZoneInformation(&tzInfo);
+	tzOffset = tzInfo.Bias + ((tzRes == TIME_ZONE_ID_DAYLIGHT) ? tzInfo.DaylightBias : tzInfo.StandardBias);
+	tzOffset *= 60 * 10000000ll;
+}
+
+void CPermissions::AddLongListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, const t_directory& directory, __int64 size, FILETIME* pTime, t_listingContext const& context)
 {
 	WIN32_FILE_ATTRIBUTE_DATA status{};
 	if (!pTime && GetStatus64(directory.dir.c_str(), status)) {
@@ -146,87 +236,72 @@ void CPermissions::AddLongListingEntry(std::list<t_dirlisting> &result, bool isD
 		result.push_back(t_dirlisting());
 	}
 
+	t_dirlisting & listing = result.back();
+	char* p = listing.buffer + listing.len;
+
 	if (isDir) {
-		memcpy(result.back().buffer + result.back().len, "drwxr-xr-x", 10);
-		result.back().len += 10;
+		memcpy(p, "drwxr-xr-x", 10);
+		p += 10;
 	}
 	else {
-		result.back().buffer[result.back().len++] = '-';
-		result.back().buffer[result.back().len++] = directory.bFileRead ? 'r' : '-';
-		result.back().buffer[result.back().len++] = directory.bFileWrite ? 'w' : '-';
+		*p++ = '-';
+		*p++ = directory.bFileRead ? 'r' : '-';
+		*p++ = directory.bFileWrite ? 'w' : '-';
 
 		bool isexe = false;
 		if (name.size() > 4 && name[name.size() - 4] == '.') {
-			std::string ext = name.substr(name.size() - 3);
-			ext = fz::str_tolower_ascii(ext);
-			if (ext == "exe") {
-				isexe = true;
-			}
-			else if (ext == "bat") {
-				isexe = true;
-			}
-			else if (ext == "com") {
-				isexe = true;
-			}
+			char const* ext = name.c_str() + name.size() - 3;
+			isexe = !_strnicmp(ext, "exe", 3) || !_strnicmp(ext, "bat", 3) || !_strnicmp(ext, "com", 3);
 		}
-		result.back().buffer[result.back().len++] = isexe ? 'x' : '-';
-		result.back().buffer[result.back().len++] = directory.bFileRead ? 'r' : '-';
-		result.back().buffer[result.back().len++] = '-';
-		result.back().buffer[result.back().len++] = isexe ? 'x' : '-';
-		result.back().buffer[result.back().len++] = directory.bFileRead ? 'r' : '-';
-		result.back().buffer[result.back().len++] = '-';
-		result.back().buffer[result.back().len++] = isexe ? 'x' : '-';
+		*p++ = isexe ? 'x' : '-';
+		*p++ = directory.bFileRead ? 'r' : '-';
+		*p++ = '-';
+		*p++ = isexe ? 'x' : '-';
+		*p++ = directory.bFileRead ? 'r' : '-';
+		*p++ = '-';
+		*p++ = isexe ? 'x' : '-';
 	}
 
-	memcpy(result.back().buffer + result.back().len, " 1 ftp ftp ", 11);
-	result.back().len += 11;
+	memcpy(p, " 1 ftp ftp ", 11);
+	p += 11;
 
-	result.back().len += sprintf(result.back().buffer + result.back().len, "% 14I64d", size);
+	// Space-padded to a width of 14, with a blank in place of the sign
+	*p++ = ' ';
+	p += FormatNumber(p, size > 0 ? static_cast<uint64_t>(size) : 0, 13, ' ');
 
-	// Adjust time zone info and output file date/time
-	SYSTEMTIME sLocalTime;
-	GetLocalTime(&sLocalTime);
-	FILETIME fTime;
-	VERIFY(SystemTimeToFileTime(&sLocalTime, &fTime));
+	// Output file date/time in local time
+	int64_t const mtime = pTime ? (ToTicks(*pTime) - context.tzOffset) : (context.now - context.tzOffset);
+	t_dateTime const t = ToDateTime(mtime);
 
-	FILETIME mtime;
-	if (pTime) {
-		mtime = *pTime;
+	*p++ = ' ';
+	memcpy(p, months[t.month - 1], 3);
+	p += 3;
+	*p++ = ' ';
+	FormatTwoDigits(p, t.day);
+	p += 2;
+	*p++ = ' ';
+	if (mtime > context.now || (context.now - mtime) > (1000000ll * 60 * 60 * 24 * 350)) {
+		*p++ = ' ';
+		p += FormatNumber(p, t.year > 0 ? t.year : 0);
+		*p++ = ' ';
 	}
 	else {
-		mtime = fTime;
+		FormatTwoDigits(p, t.hour);
+		p[2] = ':';
+		FormatTwoDigits(p + 3, t.minute);
+		p[5] = ' ';
+		p += 6;
 	}
 
-	TIME_ZONE_INFORMATION tzInfo;
-	int tzRes = GetTimeZoneInformation(&tzInfo);
-	_int64 offset = tzInfo.Bias+((tzRes==TIME_ZONE_ID_DAYLIGHT)?tzInfo.DaylightBias:tzInfo.StandardBias);
-	offset *= 60 * 10000000;
-
-	long long t1 = (static_cast<long long>(mtime.dwHighDateTime) << 32) + mtime.dwLowDateTime;
-	t1 -= offset;
-	mtime.dwHighDateTime = static_cast<DWORD>(t1 >> 32);
-	mtime.dwLowDateTime = static_cast<DWORD>(t1 & 0xFFFFFFFF);
+	memcpy(p, name.c_str(), name.size());
+	p += name.size();
+	*p++ = '\r';
+	*p++ = '\n';
 
-	SYSTEMTIME sFileTime;
-	FileTimeToSystemTime(&mtime, &sFileTime);
-
-	long long t2 = (static_cast<long long>(fTime.dwHighDateTime) << 32) + fTime.dwLowDateTime;
-	const char months[][4]={"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-	result.back().len += sprintf(result.back().buffer + result.back().len, " %s %02d ", months[sFileTime.wMonth-1], sFileTime.wDay);
-	if (t1 > t2 || (t2 - t1) > (1000000ll * 60 * 60 * 24 * 350)) {
-		result.back().len += sprintf(result.back().buffer + result.back().len, " %d ", sFileTime.wYear);
-	}
-	else {
-		result.back().len += sprintf(result.back().buffer + result.back().len, "%02d:%02d ", sFileTime.wHour, sFileTime.wMinute);
-	}
-
-	memcpy(result.back().buffer + result.back().len, name.c_str(), name.size());
-	result.back().len += name.size();
-	result.back().buffer[result.back().len++] = '\r';
-	result.back().buffer[result.back().len++] = '\n';
+	listing.len = static_cast<unsigned int>(p - listing.buffer);
 }
 
-void CPermissions::AddFactsListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, const t_directory& directory, __int64 size, FILETIME* pTime, std::string const&, bool *enabledFacts)
+void CPermissions::AddFactsListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, const t_directory& directory, __int64 size, FILETIME* pTime, t_listingContext const& context)
 {
 	WIN32_FILE_ATTRIBUTE_DATA status{};
 	if (!pTime && GetStatus64(directory.dir.c_str(), status)) {
@@ -239,77 +314,78 @@ void CPermissions::AddFactsListingEntry(std::list<t_dirlisting> &result, bool is
 		result.push_back(t_dirlisting());
 	}
 
+	t_dirlisting & listing = result.back();
+	char* p = listing.buffer + listing.len;
+
+	bool const* enabledFacts = context.enabledFacts;
 	if (!enabledFacts || enabledFacts[0]) {
 		if (isDir) {
-			memcpy(result.back().buffer + result.back().len, "type=dir;", 9);
-			result.back().len += 9;
+			memcpy(p, "type=dir;", 9);
+			p += 9;
 		}
 		else {
-			memcpy(result.back().buffer + result.back().len, "type=file;", 10);
-			result.back().len += 10;
+			memcpy(p, "type=file;", 10);
+			p += 10;
 		}
 	}
 
-	// Adjust time zone info and output file date/time
-	SYSTEMTIME sLocalTime;
-	GetLocalTime(&sLocalTime);
-	FILETIME fTime;
-	VERIFY(SystemTimeToFileTime(&sLocalTime, &fTime));
-
-	FILETIME mtime;
-	if (pTime) {
-		mtime = *pTime;
-	}
-	else {
-		mtime = fTime;
-	}
-
 	if (!enabledFacts || enabledFacts[2]) {
-		if (mtime.dwHighDateTime || mtime.dwLowDateTime) {
-			SYSTEMTIME time;
-			FileTimeToSystemTime(&mtime, &time);
-			std::string str = fz::sprintf("modify=%04d%02d%02d%02d%02d%02d;",
-				time.wYear,
-				time.wMonth,
-				time.wDay,
-				time.wHour,
-				time.wMinute,
-				time.wSecond);
-
-			memcpy(result.back().buffer + result.back().len, str.c_str(), str.size());
-			result.back().len += str.size();
+		int64_t const mtime = pTime ? ToTicks(*pTime) : context.now;
+		if (mtime) {
+			t_dateTime const t = ToDateTime(mtime);
+			memcpy(p, "modify=", 7);
+			p += 7;
+			p += FormatNumber(p, t.year > 0 ? t.year : 0, 4);
+			FormatTwoDigits(p, t.month);
+			FormatTwoDigits(p + 2, t.day);
+			FormatTwoDigits(p + 4, t.hour);
+			FormatTwoDigits(p + 6, t.minute);
+			FormatTwoDigits(p + 8, t.second);
+			p[10] = ';';
+			p += 11;
 		}
 	}
 
 	if (!enabledFacts || enabledFacts[1]) {
 		if (!isDir) {
-			result.back().len += sprintf(result.back().buffer + result.back().len, "size=%I64d;", size);
+			memcpy(p, "size=", 5);
+			p += 5;
+			p += FormatNumber(p, size > 0 ? static_cast<uint64_t>(size) : 0);
+			*p++ = ';';
 		}
 	}
 
 	if (enabledFacts && enabledFacts[fact_perm]) {
 		// TODO: a, d,f,p,r,w
-		memcpy(result.back().buffer + result.back().len, "perm=", 5);
-		result.back().len += 5;
+		memcpy(p, "perm=", 5);
+		p += 5;
 		if (isDir) {
 			if (directory.bFileWrite) {
-				result.back().buffer[result.back().len++] = 'c';
+				*p++ = 'c';
 			}
-			result.back().buffer[result.back().len++] = 'e';
+			*p++ = 'e';
 			if (directory.bDirList) {
-				result.back().buffer[result.back().len++] = 'l';
+				*p++ = 'l';
 			}
 			if (directory.bFileDelete || directory.bDirDelete) {
-				result.back().buffer[result.back().len++] = 'p';
+				*p++ = 'p';
 			}
 		}
 	}
 
-	result.back().len += sprintf(result.back().buffer + result.back().len, " %s\r\n", name.c_str());
+	*p++ = ' ';
+	memcpy(p, name.c_str(), name.size());
+	p += name.size();
+	*p++ = '\r';
+	*p++ = '\n';
+
+	listing.len = static_cast<unsigned int>(p - listing.buffer);
 }
 
-void CPermissions::AddShortListingEntry(std::list<t_dirlisting> &result, bool, std::string const& name, const t_directory&, __int64, FILETIME*, std::string const& dirToDisplay, bool *)
+void CPermissions::AddShortListingEntry(std::list<t_dirlisting> &result, bool, std::string const& name, const t_directory&, __int64, FILETIME*, t_listingContext const& context)
 {
+	std::string const& dirToDisplay = context.dirToDisplay;
+
 	// This wastes some memory but keeps the whole thing fast
 	if (result.empty() || (8192 - result.back().len) < (10 + name.size() + dirToDisplay.size())) {
 		result.push_back(t_dirlisting());
@@ -324,9 +400,9 @@ void CPermissions::AddShortListingEntry(std::list<t_dirlisting> &result, bool, s
 }
 
 int CPermissions::GetDirectoryListing(CUser const& user, std::wstring currentDir, std::wstring dirToDisplay,
-									  std::list<t_dirlisting> &result, std::wstring& physicalDir,
+									  std::unique_ptr<CDirectoryListing> &result, std::wstring& physicalDir,
 									  std::wstring& logicalDir, addFunc_t addFunc,
-									  bool *enabledFacts)
+									  bool *enabledFacts, CListingCache* cache)
 {
 	std::wstring dir = CanonifyServerDir(currentDir, dirToDisplay);
 	if (dir.empty()) {
@@ -385,11 +461,6 @@ int CPermissions::GetDirectoryListing(CUser const& user, std::wstring currentDir
 		return PERMISSION_DENIED;
 	}
 
-	TIME_ZONE_INFORMATION tzInfo;
-	int tzRes = GetTimeZoneInformation(&tzInfo);
-	_int64 offset = tzInfo.Bias+((tzRes==TIME_ZONE_ID_DAYLIGHT)?tzInfo.DaylightBias:tzInfo.StandardBias);
-	offset *= 60 * 10000000;
-
 	if (!dirToDisplay.empty() && dirToDisplay.back() != '/') {
 		dirToDisplay.append(L"/");
 	}
@@ -399,6 +470,49 @@ int CPermissions::GetDirectoryListing(CUser const& user, std::wstring currentDir
 		return PERMISSION_DENIED;
 	}
 
+	physicalDir = directory.dir;
+	if (sFileSpec != L"*" && sFileSpec != L"*.*") {
+		physicalDir += sFileSpec;
+	}
+
+	std::unique_ptr<CDirectoryListing> listing(new CDirectoryListing(user, directory, dirToDisplayUTF8, addFunc, enabledFacts));
+
+	int format = 0;
+	if (addFunc == AddLongListingEntry) {
+		format = 1;
+	}
+	else if (addFunc == AddShortListingEntry) {
+		format = 2;
+	}
+	else if (addFunc == AddFactsListingEntry) {
+		format = 3;
+		for (int i = 0; enabledFacts && i <= fact_perm; ++i) {
+			if (enabledFacts[i]) {
+				format |= 4 << i;
+			}
+		}
+	}
+
+	if (cache && format) {
+		CListingCache::key & key = listing->cacheKey_;
+		key.physicalDir = directory.dir;
+		key.fileSpec = sFileSpec;
+		key.logicalDir = dir;
+		key.dirToDisplay = dirToDisplayUTF8;
+		key.format = format;
+		key.permissions = user.GetPermissionsKey();
+
+		listing->cached_ = cache->Lookup(key, listing->generation_);
+		if (listing->cached_) {
+			result = std::move(listing);
+			return 0;
+		}
+		if (listing->generation_) {
+			listing->cache_ = cache;
+			listing->recorded_ = std::make_shared<CListingCache::listing>();
+		}
+	}
+
 	for (auto const& virtualAliasName : user.virtualAliasNames) {
 		if (fz::stricmp(virtualAliasName.first, dir)) {
 			continue;
@@ -424,59 +538,126 @@ int CPermissions::GetDirectoryListing(CUser const& user, std::wstring currentDir
 
 		auto name = fz::to_utf8(virtualAliasName.second);
 		if (!name.empty()) {
-			addFunc(result, true, name, directory, 0, 0, dirToDisplayUTF8, enabledFacts);
+			addFunc(listing->pending_, true, name, directory, 0, 0, listing->context_);
 		}
 	}
 
-	physicalDir = directory.dir;
-	if (sFileSpec != L"*" && sFileSpec != L"*.*") {
-		physicalDir += sFileSpec;
+	listing->hFind_ = FindFirstFile((directory.dir + L"\\" + sFileSpec).c_str(), &listing->findData_);
+	result = std::move(listing);
+
+	return 0;
+}
+
+CDirectoryListing::CDirectoryListing(CUser const& user, t_directory const& directory,
+	std::string const& dirToDisplay, CPermissions::addFunc_t addFunc, bool *enabledFacts)
+	: user_(user)
+	, directory_(directory)
+	, context_(dirToDisplay, enabledFacts)
+	, addFunc_(addFunc)
+{
+	permissionNode_ = user_.FindPermissionNode(directory_.dir);
+	permissionsRevision_ = user_.GetPermissionsRevision();
+}
+
+CDirectoryListing::~CDirectoryListing()
+{
+	if (hFind_ != INVALID_HANDLE_VALUE) {
+		FindClose(hFind_);
 	}
+}
 
-	WIN32_FIND_DATA FindFileData;
-	WIN32_FIND_DATA NextFindFileData;
-	HANDLE hFind;
-	hFind = FindFirstFile((directory.dir + L"\\" + sFileSpec).c_str(), &NextFindFileData);
-	while (hFind != INVALID_HANDLE_VALUE) {
-		FindFileData = NextFindFileData;
-		if (!FindNextFile(hFind, &NextFindFileData)) {
-			FindClose(hFind);
-			hFind = INVALID_HANDLE_VALUE;
-		}
+bool CDirectoryListing::Fill(std::list<t_dirlisting> &result, size_t maxChunks)
+{
+	// Entries get appended to the last chunk, it must not have been recorded yet
+	ASSERT(result.empty());
 
-		if (!_tcscmp(FindFileData.cFileName, _T(".")) || !_tcscmp(FindFileData.cFileName, _T(".."))) {
-			continue;
+	if (cached_) {
+		while (cachedPos_ < cached_->size() && result.size() < maxChunks) {
+			result.push_back((*cached_)[cachedPos_++]);
 		}
+		return cachedPos_ < cached_->size();
+	}
 
-		std::wstring const fn = FindFileData.cFileName;
+	if (!pending_.empty()) {
+		result.splice(result.end(), pending_);
+	}
 
-		if (FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-			// Check permissions of subdir. If we don't have LIST permission,
-			// don't display the subdir.
-			bool truematch{};
-			t_directory subDir;
-			if (GetRealDirectory(dir + _T("/") + fn, user, subDir, truematch)) {
-				continue;
-			}
+	while (hFind_ != INVALID_HANDLE_VALUE && result.size() < maxChunks) {
+		AddEntry(result);
 
-			if (subDir.bDirList) {
-				auto utf8 = fz::to_utf8(fn);
-				if (utf8.empty() && !fn.empty()) {
-					continue;
-				}
-				addFunc(result, true, utf8, subDir, 0, &FindFileData.ftLastWriteTime, dirToDisplayUTF8, enabledFacts);
-			}
+		if (!FindNextFile(hFind_, &findData_)) {
+			FindClose(hFind_);
+			hFind_ = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	if (recorded_) {
+		if ((recorded_->size() + result.size()) * sizeof(t_dirlisting) > CListingCache::maxListingSize) {
+			recorded_.reset();
 		}
 		else {
-			auto utf8 = fz::to_utf8(fn);
-			if (utf8.empty() && !fn.empty()) {
-				continue;
+			recorded_->insert(recorded_->end(), result.begin(), result.end());
+			if (hFind_ == INVALID_HANDLE_VALUE) {
+				cache_->Store(cacheKey_, recorded_, generation_);
+				recorded_.reset();
 			}
-			addFunc(result, false, utf8, directory, FindFileData.nFileSizeLow + ((_int64)FindFileData.nFileSizeHigh<<32), &FindFileData.ftLastWriteTime, dirToDisplayUTF8, enabledFacts);
 		}
 	}
 
-	return 0;
+	return hFind_ != INVALID_HANDLE_VALUE;
+}
+
+void CDirectoryListing::AddEntry(std::list<t_dirlisting> &result)
+{
+	if (!_tcscmp(findData_.cFileName, _T(".")) || !_tcscmp(findData_.cFileName, _T(".."))) {
+		return;
+	}
+
+	std::wstring_view const fn(findData_.cFileName);
+
+	// Converted into a reused buffer, no allocation per entry
+	int const len = static_cast<int>(fn.size());
+	name_.resize(len * 3);
+	int const converted = WideCharToMultiByte(CP_UTF8, 0, fn.data(), len, &name_[0], static_cast<int>(name_.size()), 0, 0);
+	if (converted <= 0) {
+		return;
+	}
+	name_.resize(converted);
+
+	if (findData_.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+		// Check permissions of subdir. If we don't have LIST permission,
+		// don't display the subdir.
+		// The subdir exists physically right below the listed directory, so
+		// there is no need to resolve its path again. Unless it has a
+		// permission of its own, the permission of the listed directory
+		// applies, same as in GetRealDirectory.
+		t_directory const* subDir = user_.FindChildPermission(PermissionNode(), fn);
+		if (!subDir) {
+			if (!directory_.bDirSubdirs) {
+				return;
+			}
+			subDir = &directory_;
+		}
+		if (!subDir->bDirList) {
+			return;
+		}
+
+		// The formatters only look at the path if no time is passed
+		addFunc_(result, true, name_, *subDir, 0, &findData_.ftLastWriteTime, context_);
+	}
+	else {
+		addFunc_(result, false, name_, directory_, findData_.nFileSizeLow + ((_int64)findData_.nFileSizeHigh<<32), &findData_.ftLastWriteTime, context_);
+	}
+}
+
+size_t CDirectoryListing::PermissionNode()
+{
+	// The permissions of the user may have been reloaded in the meantime
+	if (permissionsRevision_ != user_.GetPermissionsRevision()) {
+		permissionNode_ = user_.FindPermissionNode(directory_.dir);
+		permissionsRevision_ = user_.GetPermissionsRevision();
+	}
+	return permissionNode_;
 }
 
 int CPermissions::CheckDirectoryPermissions(CUser const& user, std::wstring dirname, std::wstring currentdir, int op, std::wstring& physicalDir, std::wstring& logicalDir)
@@ -721,6 +902,18 @@ int CPermissions::GetRealDirectory(std::wstring directory, const CUser &user, t_
 		}
 	}
 	else {
+		// If the whole path exists physically, aliases cannot come into play
+		// and there is no need to look at every segment.
+		std::wstring full = path;
+		for (auto const& piece : pathPieces) {
+			full += L"\\" + piece;
+		}
+		DWORD const nAttributes = GetFileAttributesW(full.c_str());
+		if (nAttributes != INVALID_FILE_ATTRIBUTES && (nAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+			path = std::move(full);
+			pathPieces.clear();
+		}
+
 		// Go through all pieces
 		for (auto const& piece : pathPieces) {
 			// Check if piece exists
@@ -755,69 +948,28 @@ int CPermissions::GetRealDirectory(std::wstring directory, const CUser &user, t_
 			return PERMISSION_NOTFOUND;
 		}
 	}
-	std::wstring const realpath = path;
 
 	// Check permissions
 	// -----------------
 
 	/* We got a valid local path, now find the closest matching path within the
-	 * permissions.
-	 * We do this by sequentially comparing the path with all permissions and
-	 * sequentially removing the last path segment until we found a match or
-	 * all path segments have been removed
-	 * Distinguish the case
+	 * permissions. The permissions have been compiled into a trie, see
+	 * CUser::PreparePermissions.
 	 */
-	truematch = true;
-
-	while (!path.empty()) {
-		bool bFoundMatch = false;
-
-		// Check user permissions
-		for (size_t i = 0; i < user.permissions.size(); ++i) {
-			std::wstring permissionPath = user.permissions[i].dir;
-			user.DoReplacements(permissionPath);
-			if (!fz::stricmp(permissionPath, path)) {
-				bFoundMatch = true;
-				ret = user.permissions[i];
-				break;
-			}
-		}
-
-		// Check owner (group) permissions
-		if (!bFoundMatch && user.pOwner) {
-			for (size_t i = 0; i < user.pOwner->permissions.size(); ++i) {
-				std::wstring permissionPath = user.pOwner->permissions[i].dir;
-				user.DoReplacements(permissionPath);
-				if (!fz::stricmp(permissionPath, path)) {
-					bFoundMatch = true;
-					ret = user.pOwner->permissions[i];
-					break;
-				}
-			}
-		}
-
-		if (!bFoundMatch) {
-			// No match found, remove last segment and try again
-			size_t pos = path.rfind('\\');
-			if (pos != std::wstring::npos) {
-				path = path.substr(0, pos);
-			}
-			else {
-				return PERMISSION_DENIED;
-			}
-			truematch = FALSE;
-			continue;
-		}
-		ret.dir = realpath;
+	t_directory const* permission = user.FindPermission(path, truematch);
+	if (!permission) {
+		return PERMISSION_DENIED;
+	}
 
-		// We can check the bDirSubdirs permission right here
-		if (!truematch && !ret.bDirSubdirs) {
-			return PERMISSION_DENIED;
-		}
+	ret = *permission;
+	ret.dir = path;
 
-		return 0;
+	// We can check the bDirSubdirs permission right here
+	if (!truematch && !ret.bDirSubdirs) {
+		return PERMISSION_DENIED;
 	}
-	return PERMISSION_NOTFOUND;
+
+	return 0;
 }
 
 int CPermissions::ChangeCurrentDir(CUser const& user, std::wstring &currentdir, std::wstring &dir)
@@ -1048,6 +1200,11 @@ void ReadSpeedLimits(pugi::xml_node const& xml, t_group &group)
 	const char* names[] = { "Download", "Upload" };
 
 	for (auto speedLimits = xml.child("SpeedLimits"); speedLimits; speedLimits = speedLimits.next_sibling("SpeedLimits")) {
+		group.nSpeedWeight = speedLimits.attribute("Weight").as_int();
+		if (group.nSpeedWeight < 0 || group.nSpeedWeight > 100) {
+			group.nSpeedWeight = 0;
+		}
+
 		for (int i = 0; i < 2; ++i) {
 			group.nSpeedLimitType[i] = speedLimits.attribute((prefixes[i] + "Type").c_str()).as_int();
 			if (group.nSpeedLimitType[i] < 0 || group.nSpeedLimitType[i] > 3) {
@@ -1067,6 +1224,11 @@ void ReadSpeedLimits(pugi::xml_node const& xml, t_group &group)
 				group.nBypassServerSpeedLimit[i] = 0;
 			}
 
+			group.nMinimumSpeed[i] = speedLimits.attribute((prefixes[i] + "Minimum").c_str()).as_int();
+			if (group.nMinimumSpeed[i] < 0 || group.nMinimumSpeed[i] > 65535) {
+				group.nMinimumSpeed[i] = 0;
+			}
+
 			for (auto direction = speedLimits.child(names[i]); direction; direction = direction.next_sibling(names[i])) {
 				for (auto rule = direction.child("Rule"); rule; rule = rule.next_sibling("Rule")) {
 					CSpeedLimit limit;
@@ -1090,10 +1252,13 @@ void SaveSpeedLimits(pugi::xml_node & xml, t_group const& group)
 	std::string const prefixes[] = { "Dl"s, "Ul"s };
 	const char* names[] = { "Download", "Upload" };
 
+	speedLimits.append_attribute("Weight").set_value(group.nSpeedWeight);
+
 	for (int i = 0; i < 2; ++i) {
 		speedLimits.append_attribute((prefixes[i] + "Type").c_str()).set_value(group.nSpeedLimitType[i]);
 		speedLimits.append_attribute((prefixes[i] + "Limit").c_str()).set_value(group.nSpeedLimit[i]);
 		speedLimits.append_attribute(("Server" + prefixes[i] + "LimitBypass").c_str()).set_value(group.nBypassServerSpeedLimit[i]);
+		speedLimits.append_attribute((prefixes[i] + "Minimum").c_str()).set_value(group.nMinimumSpeed[i]);
 
 		auto direction = speedLimits.append_child(names[i]);
 
@@ -1745,16 +1910,229 @@ void CUser::PrepareAliasMap()
 	}
 }
 
-std::wstring CUser::GetAliasTarget(std::wstring const& virtualPath) const
+std::wstring const& CUser::GetAliasTarget(std::wstring const& virtualPath) const
 {
 	// Find the target for the alias with the specified path and name
+	auto const it = virtualAliases.find(virtualPath);
+	if (it != virtualAliases.end()) {
+		return it->second;
+	}
+
+	static std::wstring const empty;
+	return empty;
+}
+
+bool CUser::t_less_nocase::operator()(std::wstring_view const& lhs, std::wstring_view const& rhs) const
+{
+	int const res = _wcsnicmp(lhs.data(), rhs.data(), std::min(lhs.size(), rhs.size()));
+	if (res) {
+		return res < 0;
+	}
+	return lhs.size() < rhs.size();
+}
+
+void CUser::PreparePermissions()
+{
+	permissionTrie_.clear();
+	permissionTrie_.emplace_back();
+
+	// Earlier entries win, just like with a sequential search
+	for (size_t i = 0; i < permissions.size(); ++i) {
+		AddPermissionPath(permissions[i].dir, static_cast<int>(i), false);
+	}
+	if (pOwner) {
+		for (size_t i = 0; i < pOwner->permissions.size(); ++i) {
+			AddPermissionPath(pOwner->permissions[i].dir, static_cast<int>(i), true);
+		}
+	}
+
+	static std::atomic<unsigned int> revision{};
+	permissionsRevision_ = ++revision;
+
+	// See GetPermissionsKey
+	permissionsKey_.clear();
+	auto const addKey = [this](t_directory const& permission) {
+		std::wstring dir = permission.dir;
+		DoReplacements(dir);
+		permissionsKey_ += dir + L"|";
+		for (bool flag : { permission.bFileRead, permission.bFileWrite, permission.bFileDelete, permission.bFileAppend,
+			permission.bDirCreate, permission.bDirDelete, permission.bDirList, permission.bDirSubdirs, permission.bIsHome })
+		{
+			permissionsKey_ += flag ? '1' : '0';
+		}
+		permissionsKey_ += '\n';
+	};
+	for (auto const& permission : permissions) {
+		addKey(permission);
+	}
+	permissionsKey_ += L"-\n";
+	if (pOwner) {
+		for (auto const& permission : pOwner->permissions) {
+			addKey(permission);
+		}
+	}
+	permissionsKey_ += L"-\n";
 	for (auto const& alias : virtualAliases) {
-		if (!fz::stricmp(alias.first, virtualPath)) {
-			return alias.second;
+		permissionsKey_ += alias.first + L"|" + alias.second + L"\n";
+	}
+}
+
+CUser::t_ipFilters CUser::CompileIpFilters(t_group const& group)
+{
+	t_ipFilters filters;
+	filters.disallowed = std::make_shared<CIpFilter const>(group.disallowedIPs);
+	filters.allowed = std::make_shared<CIpFilter const>(group.allowedIPs);
+	return filters;
+}
+
+void CUser::PrepareIpFilters(t_ipFilters const& groupFilters)
+{
+	ipFilters_ = CompileIpFilters(*this);
+	groupIpFilters_ = groupFilters;
+}
+
+bool CUser::AccessAllowed(CIpAddress const& address) const
+{
+	if (!ipFilters_.disallowed) {
+		// Filters have not been prepared
+		return true;
+	}
+
+	if (!ipFilters_.disallowed->Matches(address)) {
+		if (!groupIpFilters_.disallowed) {
+			return true;
+		}
+		if (!groupIpFilters_.disallowed->Matches(address) || groupIpFilters_.allowed->Matches(address)) {
+			return true;
+		}
+	}
+
+	return ipFilters_.allowed->Matches(address);
+}
+
+void CUser::AddPermissionPath(std::wstring path, int index, bool group)
+{
+	DoReplacements(path);
+
+	size_t node = 0;
+	for (auto const& segment : fz::strtok(path, L"\\")) {
+		auto it = permissionTrie_[node].children.find(segment);
+		if (it != permissionTrie_[node].children.end()) {
+			node = it->second;
+		}
+		else {
+			size_t const child = permissionTrie_.size();
+			permissionTrie_[node].children.emplace(segment, child);
+			permissionTrie_.emplace_back();
+			node = child;
 		}
 	}
 
-	return std::wstring();
+	if (!node) {
+		return;
+	}
+
+	int & target = group ? permissionTrie_[node].groupPermission : permissionTrie_[node].userPermission;
+	if (target == -1) {
+		target = index;
+	}
+}
+
+size_t CUser::FindPermissionNode(std::wstring const& path) const
+{
+	if (permissionTrie_.empty()) {
+		return std::wstring::npos;
+	}
+
+	std::wstring_view const view(path);
+
+	size_t node = 0;
+	size_t pos = 0;
+	while (pos < view.size()) {
+		size_t end = view.find('\\', pos);
+		if (end == std::wstring_view::npos) {
+			end = view.size();
+		}
+		if (end > pos) {
+			auto const& children = permissionTrie_[node].children;
+			auto const it = children.find(view.substr(pos, end - pos));
+			if (it == children.end()) {
+				return std::wstring::npos;
+			}
+			node = it->second;
+		}
+		pos = end + 1;
+	}
+
+	return node;
+}
+
+t_directory const* CUser::FindChildPermission(size_t node, std::wstring_view const& name) const
+{
+	if (node >= permissionTrie_.size()) {
+		return 0;
+	}
+
+	auto const& children = permissionTrie_[node].children;
+	auto const it = children.find(name);
+	if (it == children.end()) {
+		return 0;
+	}
+
+	t_permissionNode const& n = permissionTrie_[it->second];
+	if (n.userPermission != -1) {
+		return &permissions[n.userPermission];
+	}
+	else if (n.groupPermission != -1 && pOwner) {
+		return &pOwner->permissions[n.groupPermission];
+	}
+	return 0;
+}
+
+t_directory const* CUser::FindPermission(std::wstring const& path, bool& truematch) const
+{
+	truematch = false;
+	if (permissionTrie_.empty()) {
+		return 0;
+	}
+
+	std::wstring_view const view(path);
+
+	t_directory const* ret{};
+	size_t matchEnd{};
+
+	size_t node = 0;
+	size_t pos = 0;
+	while (pos < view.size()) {
+		size_t end = view.find('\\', pos);
+		if (end == std::wstring_view::npos) {
+			end = view.size();
+		}
+		if (end > pos) {
+			auto const& children = permissionTrie_[node].children;
+			auto const it = children.find(view.substr(pos, end - pos));
+			if (it == children.end()) {
+				break;
+			}
+			node = it->second;
+
+			t_permissionNode const& n = permissionTrie_[node];
+			if (n.userPermission != -1) {
+				ret = &permissions[n.userPermission];
+				matchEnd = end;
+			}
+			else if (n.groupPermission != -1 && pOwner) {
+				ret = &pOwner->permissions[n.groupPermission];
+				matchEnd = end;
+			}
+		}
+		pos = end + 1;
+	}
+
+	if (ret) {
+		truematch = view.find_first_not_of('\\', matchEnd) == std::wstring_view::npos;
+	}
+	return ret;
 }
 
 void ReadCommonOption(pugi::xml_node const& option, std::string const& name, t_group & group)
@@ -2021,6 +2399,11 @@ void CPermissions::UpdatePermissions(bool notifyOwner)
 			m_GroupsList.push_back(group);
 		}
 
+		std::map<t_group const*, CUser::t_ipFilters> groupIpFilters;
+		for (auto const& group : m_GroupsList) {
+			groupIpFilters[&group] = CUser::CompileIpFilters(group);
+		}
+
 		// Clear old user data and copy over the new data
 		m_UsersList.clear();
 		for (auto const& it : m_sUsersList) {
@@ -2034,6 +2417,8 @@ void CPermissions::UpdatePermissions(bool notifyOwner)
 					}
 				}
 			}
+			user.PreparePermissions();
+			user.PrepareIpFilters(user.pOwner ? groupIpFilters[user.pOwner] : CUser::t_ipFilters());
 			m_UsersList[it.first] = user;
 		}
 	}
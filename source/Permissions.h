@@ -20,8 +20,11 @@
 #define FILEZILLA_SERVER_SERVICE_PERMISSIONS_HEADER
 
 #include "Accounts.h"
+#include "iputils.h"
+#include "listing_cache.h"
 
 #include <functional>
+#include <string_view>
 
 #define FOP_READ		0x01
 #define FOP_WRITE		0x02
@@ -68,10 +71,87 @@ public:
 
 	// GetAliasTarget returns the target of the alias with the specified
 	// path or returns an empty string if the alias can't be found.
-	std::wstring GetAliasTarget(std::wstring const& virtualPath) const;
+	std::wstring const& GetAliasTarget(std::wstring const& virtualPath) const;
 
-	std::map<std::wstring, std::wstring> virtualAliases;
+	// Case-insensitive ordering for path segments, supports lookups
+	// by string_view.
+	struct t_less_nocase
+	{
+		typedef void is_transparent;
+		bool operator()(std::wstring_view const& lhs, std::wstring_view const& rhs) const;
+	};
+
+	std::map<std::wstring, std::wstring, t_less_nocase> virtualAliases;
 	std::multimap<std::wstring, std::wstring> virtualAliasNames;
+
+	/*
+	 * The local paths of all permissions of the user and its group, with
+	 * :u and :g already replaced, are compiled into a trie over the path
+	 * segments. Must be called again whenever permissions or pOwner change.
+	 */
+	void PreparePermissions();
+
+	// Returns the permission whose path is the closest ancestor of the
+	// given local path, or the path itself in which case truematch is set.
+	// Permissions of the user take precedence over those of its group.
+	t_directory const* FindPermission(std::wstring const& path, bool& truematch) const;
+
+	// Returns the trie node of the given local path for FindChildPermission,
+	// or npos if none of its subdirectories can have a permission of its own.
+	size_t FindPermissionNode(std::wstring const& path) const;
+
+	// Returns the permission set for the immediate subdirectory with the given
+	// name of the path whose node has been looked up. Returns 0 if there is
+	// none, the permission of the path then applies to the subdirectory as well.
+	t_directory const* FindChildPermission(size_t node, std::wstring_view const& name) const;
+
+	// Changes whenever the permissions get prepared, nodes are only valid
+	// while it stays the same.
+	unsigned int GetPermissionsRevision() const { return permissionsRevision_; }
+
+	// Identifies everything the permission checks of the user depend on.
+	// Users with equal keys get to see the same directory listings.
+	std::wstring const& GetPermissionsKey() const { return permissionsKey_; }
+
+	// Compiled address filters of a user or group. Shared between all copies
+	// of the user, compiling large lists is expensive.
+	struct t_ipFilters
+	{
+		std::shared_ptr<CIpFilter const> disallowed;
+		std::shared_ptr<CIpFilter const> allowed;
+	};
+
+	static t_ipFilters CompileIpFilters(t_group const& group);
+
+	// Must be called again whenever the filters or pOwner change, takes the
+	// compiled filters of the group.
+	void PrepareIpFilters(t_ipFilters const& groupFilters);
+
+	// Addresses not disallowed by the user are allowed if the group allows
+	// them, other addresses only if the user explicitly allows them.
+	bool AccessAllowed(CIpAddress const& address) const;
+
+private:
+	struct t_permissionNode
+	{
+		// Indexes into permissionTrie_
+		std::map<std::wstring, size_t, t_less_nocase> children;
+
+		// Indexes into permissions and pOwner->permissions
+		int userPermission{-1};
+		int groupPermission{-1};
+	};
+
+	void AddPermissionPath(std::wstring path, int index, bool group);
+
+	// Root node comes first
+	std::vector<t_permissionNode> permissionTrie_;
+
+	std::wstring permissionsKey_;
+	unsigned int permissionsRevision_{};
+
+	t_ipFilters ipFilters_;
+	t_ipFilters groupIpFilters_;
 };
 
 struct t_dirlisting
@@ -92,13 +172,29 @@ enum _facts {
 	fact_perm
 };
 
+// Passed to the listing formatters. Everything depending on the current time
+// and the time zone is determined once per listing instead of for every entry.
+struct t_listingContext
+{
+	t_listingContext(std::string const& dirToDisplay, bool *enabledFacts);
+
+	std::string dirToDisplay;
+	bool *enabledFacts;
+
+	// Current local time and the bias of local time to UTC, in 100ns intervals
+	int64_t now{};
+	int64_t tzOffset{};
+};
+
+class CDirectoryListing;
+
 class CPermissions final
 {
 public:
 	CPermissions(std::function<void()> const& updateCallback);
 	~CPermissions();
 
-	typedef void (*addFunc_t)(std::list<t_dirlisting> &result, bool isDir, std::string const& name, const t_directory& directory, __int64 size, FILETIME* pTime, std::string const& dirToDisplay, bool *enabledFacts);
+	typedef void (*addFunc_t)(std::list<t_dirlisting> &result, bool isDir, std::string const& name, const t_directory& directory, __int64 size, FILETIME* pTime, t_listingContext const& context);
 protected:
 	/*
 	 * CanonifyPath takes the current and the new server dir as parameter,
@@ -114,20 +210,23 @@ public:
 	int ChangeCurrentDir(CUser const& user, std::wstring& currentdir, std::wstring &dir);
 
 	// Retrieve a directory listing. Pass the actual formatting function as last parameter.
+	// Only the permissions are checked up front, the returned listing enumerates
+	// and formats the entries as they are requested. If a cache is passed,
+	// complete listings are taken from and put into it.
 	int GetDirectoryListing(CUser const& user, std::wstring currentDir, std::wstring dirToDisplay,
-							 std::list<t_dirlisting> &result, std::wstring& physicalDir,
+							 std::unique_ptr<CDirectoryListing> &result, std::wstring& physicalDir,
 							 std::wstring& logicalDir,
 							 addFunc_t addFunc,
-							 bool *enabledFacts = 0);
+							 bool *enabledFacts = 0, CListingCache* cache = 0);
 
 	// Full directory listing with all details. Used by LIST command
-	static void AddLongListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, t_directory const& directory, __int64 size, FILETIME* pTime, std::string const& dirToDisplay, bool *);
+	static void AddLongListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, t_directory const& directory, __int64 size, FILETIME* pTime, t_listingContext const& context);
 
 	// Directory listing with just the filenames. Used by NLST command
-	static void AddShortListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, t_directory const& directory, __int64 size, FILETIME* pTime, std::string const& dirToDisplay, bool *);
+	static void AddShortListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, t_directory const& directory, __int64 size, FILETIME* pTime, t_listingContext const& context);
 
 	// Directory listing format used by MLSD
-	static void AddFactsListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, t_directory const& directory, __int64 size, FILETIME* pTime, std::string const& dirToDisplay, bool *enabledFacts);
+	static void AddFactsListingEntry(std::list<t_dirlisting> &result, bool isDir, std::string const& name, t_directory const& directory, __int64 size, FILETIME* pTime, t_listingContext const& context);
 
 	int CheckDirectoryPermissions(CUser const& user, std::wstring dirname, std::wstring currentdir, int op, std::wstring &physicalDir, std::wstring &logicalDir);
 	int CheckFilePermissions(CUser const& user, std::wstring filename, std::wstring currentdir, int op, std::wstring &physicalDir, std::wstring &logicalDir);
@@ -173,4 +272,68 @@ protected:
 	std::function<void()> const updateCallback_;
 };
 
+// Pull-based directory listing returned by CPermissions::GetDirectoryListing.
+//
+// Holds the open find handle and formats the next few entries only when the
+// transfer socket has drained the previous ones, so memory use is bounded and
+// the first byte goes out right away, no matter how large the directory is.
+//
+// References the user of the owning session which has to outlive the listing.
+// Must only be used on the owning server thread.
+class CDirectoryListing final
+{
+public:
+	~CDirectoryListing();
+
+	CDirectoryListing(CDirectoryListing const&) = delete;
+	CDirectoryListing& operator=(CDirectoryListing const&) = delete;
+
+	// Puts formatted entries into the empty result until it holds at least
+	// maxChunks chunks. Returns false once all entries have been formatted.
+	bool Fill(std::list<t_dirlisting> &result, size_t maxChunks);
+
+private:
+	friend CPermissions;
+
+	CDirectoryListing(CUser const& user, t_directory const& directory,
+		std::string const& dirToDisplay, CPermissions::addFunc_t addFunc, bool *enabledFacts);
+
+	// Formats the current find data unless the entry is hidden from the user
+	void AddEntry(std::list<t_dirlisting> &result);
+
+	// Node of the directory in the permission trie of the user
+	size_t PermissionNode();
+
+	CUser const& user_;
+
+	// Physical directory being listed and its permission
+	t_directory const directory_;
+
+	size_t permissionNode_{};
+	unsigned int permissionsRevision_{};
+
+	t_listingContext const context_;
+	CPermissions::addFunc_t const addFunc_;
+
+	// Reused for the UTF-8 names of the entries
+	std::string name_;
+
+	// Entries formatted up front, i.e. virtual aliases
+	std::list<t_dirlisting> pending_;
+
+	HANDLE hFind_{INVALID_HANDLE_VALUE};
+	WIN32_FIND_DATA findData_;
+
+	CListingCache* cache_{};
+	CListingCache::key cacheKey_;
+	uint64_t generation_{};
+
+	// Listing being served from the cache
+	std::shared_ptr<CListingCache::listing const> cached_;
+	size_t cachedPos_{};
+
+	// Copy of everything formatted so far, put into the cache once complete
+	std::shared_ptr<CListingCache::listing> recorded_;
+};
+
 #endif
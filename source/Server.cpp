@@ -97,6 +97,7 @@ bool CServer::Create()
 	m_pOptions = new COptions;
 	m_pFileLogger = new CFileLogger(m_pOptions);
 	m_pAutoBanManager = new CAutoBanManager(m_pOptions);
+	UpdateStatusListeners();
 
 	//Create the threads
 	int num = (int)m_pOptions->GetOptionVal(OPTION_THREADNUM);
@@ -202,6 +203,18 @@ LRESULT CALLBACK CServer::WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPA
 		if (pThread) {
 			std::list<CServerThread::t_Notification> notifications;
 			pThread->GetNotifications(notifications);
+
+			CStatusQueue & statusQueue = pThread->GetStatusQueue();
+			statusQueue.Drain([pServer](std::string_view const& record) {
+				pServer->ShowStatus(record);
+			});
+			uint64_t const dropped = statusQueue.TakeDropped();
+			if (dropped) {
+				CStdString str;
+				str.Format(_T("%I64u status messages have been dropped, the server is too busy to process them."), dropped);
+				pServer->ShowStatus(str, 1);
+			}
+
 			for (std::list<CServerThread::t_Notification>::const_iterator iter = notifications.begin(); iter != notifications.end(); iter++)
 				if (pServer->OnServerMessage(pThread, iter->wParam, iter->lParam) != 0)
 					break;
@@ -214,23 +227,7 @@ LRESULT CALLBACK CServer::WindowProc(HWND hWnd, UINT message, WPARAM wParam, LPA
 
 LRESULT CServer::OnServerMessage(CServerThread* pThread, WPARAM wParam, LPARAM lParam)
 {
-	if (wParam == FSM_STATUSMESSAGE) {
-		t_statusmsg *msg = reinterpret_cast<t_statusmsg *>(lParam);
-		if (!msg)
-			return 0;
-
-		CStdString str;
-
-		FILETIME fFileTime;
-		SystemTimeToFileTime(&msg->time, &fFileTime);
-
-		str.Format(_T("(%06d)- %s (%s)> %s"), msg->userid, (LPCTSTR)msg->user, (LPCTSTR)msg->ip, (LPCTSTR)msg->status);
-		ShowStatus(fFileTime.dwHighDateTime, fFileTime.dwLowDateTime, str, msg->type);
-		delete [] msg->status;
-		delete [] msg->user;
-		delete msg;
-	}
-	else if (wParam == FSM_CONNECTIONDATA) {
+	if (wParam == FSM_CONNECTIONDATA) {
 		t_connop *pConnOp = reinterpret_cast<t_connop*>(lParam);
 		if (!pConnOp)
 			return 0;
@@ -598,22 +595,8 @@ BOOL CServer::ProcessCommand(CAdminSocket *pAdminSocket, int nID, unsigned char
 				std::map<int, t_connectiondata>::iterator iter = m_UsersList.find(nUserID);
 				if (iter!=m_UsersList.end()) {
 					if (*pData == USERCONTROL_BAN) {
-						// Get the list of IP filter rules.
-						CStdString ips = m_pOptions->GetOption(OPTION_IPFILTER_DISALLOWED);
-						if (ips != _T(""))
-							ips += _T(" ");
-
-						int pos = ips.Find(' ');
-						while (pos != -1) {
-							CStdString blockedIP = ips.Left(pos);
-							ips = ips.Mid(pos + 1);
-							pos = ips.Find(' ');
-
-							if (MatchesFilter(blockedIP, iter->second.ip))
-								break;
-						}
-						if (pos == -1) {
-							ips = m_pOptions->GetOption(OPTION_IPFILTER_DISALLOWED);
+						if (!m_pOptions->GetIpFilter(OPTION_IPFILTER_DISALLOWED)->Matches(CIpAddress::Parse(iter->second.ip))) {
+							CStdString ips = m_pOptions->GetOption(OPTION_IPFILTER_DISALLOWED);
 							if (ips != _T(""))
 								ips += _T(" ");
 							ips += iter->second.ip;
@@ -886,66 +869,80 @@ void CServer::ShowStatus(LPCTSTR msg, int nType, CAdminSocket* pAdminSocket)
 		m_pFileLogger->Log(msg);
 }
 
-void CServer::ShowStatus(DWORD eventDateHigh, DWORD eventDateLow, LPCTSTR msg, int nType)
+void CServer::ShowStatus(std::string_view const& record)
 {
-	auto utf8 = fz::to_utf8(msg);
-	if (utf8.empty())
-		return;
-
-	char *pBuffer = new char[utf8.size() + 1 + 8];
-	*pBuffer = nType;
-	memcpy(pBuffer + 1, &eventDateHigh, 4);
-	memcpy(pBuffer + 5, &eventDateLow, 4);
-	memcpy(pBuffer + 1 + 8, utf8.c_str(), utf8.size());
 	if (m_pAdminInterface)
-		m_pAdminInterface->SendCommand(2, 4, pBuffer, utf8.size() + 1 + 8);
-	delete [] pBuffer;
+		m_pAdminInterface->SendCommand(2, 4, record.data(), static_cast<int>(record.size()));
 
 	//Log string
-	if (m_pFileLogger) {
+	if (m_pFileLogger && m_pFileLogger->IsEnabled()) {
 		FILETIME fFileTime;
-		SYSTEMTIME sFileTime;
-		fFileTime.dwHighDateTime = eventDateHigh;
-		fFileTime.dwLowDateTime = eventDateLow;
-		if (!FileTimeToSystemTime(&fFileTime, &sFileTime)) {
-			return;
+		memcpy(&fFileTime.dwHighDateTime, record.data() + CStatusQueue::timeOffset, 4);
+		memcpy(&fFileTime.dwLowDateTime, record.data() + CStatusQueue::timeOffset + 4, 4);
+
+		// Messages tend to come in bursts, only format the time once per second
+		uint64_t const second = ((static_cast<uint64_t>(fFileTime.dwHighDateTime) << 32) + fFileTime.dwLowDateTime) / 10000000;
+		if (m_logTime.empty() || second != m_logTimeSecond) {
+			SYSTEMTIME sFileTime;
+			if (!FileTimeToSystemTime(&fFileTime, &sFileTime)) {
+				return;
+			}
+			TCHAR text[80];
+			if (!GetDateFormat(
+				LOCALE_USER_DEFAULT,			// locale for which date is to be formatted
+				DATE_SHORTDATE,					// flags specifying function options
+				&sFileTime,						// date to be formatted
+				0,								// date format string
+				text,							// buffer for storing formatted string
+				80								// size of buffer
+				))
+				return;
+
+			CStdString text2 = _T(" ");
+			text2 += text;
+
+			if (!GetTimeFormat(
+				LOCALE_USER_DEFAULT,			// locale for which date is to be formatted
+				TIME_FORCE24HOURFORMAT,			// flags specifying function options
+				&sFileTime,						// date to be formatted
+				0,								// date format string
+				text,							// buffer for storing formatted string
+				80								// size of buffer
+				))
+				return;
+
+			text2 += _T(" ");
+			text2 += text;
+			text2 += _T(" ");
+
+			m_logTime = fz::to_utf8(text2);
+			m_logTimeSecond = second;
 		}
-		TCHAR text[80];
-		if (!GetDateFormat(
-			LOCALE_USER_DEFAULT,			// locale for which date is to be formatted
-			DATE_SHORTDATE,					// flags specifying function options
-			&sFileTime,						// date to be formatted
-			0,								// date format string
-			text,							// buffer for storing formatted string
-			80								// size of buffer
-			))
-			return;
-
-		CStdString text2 = _T(" ");
-		text2 += text;
-
-		if (!GetTimeFormat(
-			LOCALE_USER_DEFAULT,			// locale for which date is to be formatted
-			TIME_FORCE24HOURFORMAT,			// flags specifying function options
-			&sFileTime,						// date to be formatted
-			0,								// date format string
-			text,							// buffer for storing formatted string
-			80								// size of buffer
-			))
-			return;
-
-		text2 += _T(" ");
-		text2 += text;
-		CStdString str = msg;
-		int pos = str.Find(_T("-"));
-		if (pos!=-1)
-		{
-			str.Insert(pos, text2 + _T(" "));
+
+		std::string_view const msg = record.substr(CStatusQueue::textOffset);
+		size_t const pos = msg.find('-');
+		if (pos == std::string_view::npos) {
+			m_pFileLogger->Log(msg);
+		}
+		else {
+			std::string str;
+			str.reserve(msg.size() + m_logTime.size());
+			str.append(msg.substr(0, pos));
+			str += m_logTime;
+			str.append(msg.substr(pos));
+			m_pFileLogger->Log(str);
 		}
-		m_pFileLogger->Log(str);
 	}
 }
 
+void CServer::UpdateStatusListeners()
+{
+	// Server threads only need to produce status messages if they end up
+	// somewhere
+	bool const listeners = (m_pFileLogger && m_pFileLogger->IsEnabled()) || (m_pAdminInterface && m_pAdminInterface->HasAdmins());
+	CStatusQueue::SetEnabled(listeners);
+}
+
 void CServer::OnTimer(UINT nIDEvent)
 {
 	if (nIDEvent == m_nBanTimerID) {
@@ -957,6 +954,7 @@ void CServer::OnTimer(UINT nIDEvent)
 
 	m_pAdminInterface->CheckForTimeout();
 	m_pFileLogger->CheckLogFile();
+	UpdateStatusListeners();
 }
 
 int CServer::DoCreateAdminListenSocket(UINT port, std::wstring const& addr, int family)
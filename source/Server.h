@@ -19,7 +19,13 @@ class CServer final
 {
 public:
 	void ShowStatus(LPCTSTR msg, int nType, CAdminSocket* pAdminSocket = 0);
-	void ShowStatus(DWORD eventDateHigh, DWORD eventDateLow, LPCTSTR msg, int nType);
+
+	// Takes a status message record of a server thread, see CStatusQueue
+	void ShowStatus(std::string_view const& record);
+
+	// To be called when the file logger or the set of admin connections change
+	void UpdateStatusListeners();
+
 	BOOL ProcessCommand(CAdminSocket *pAdminSocket, int nID, unsigned char *pData, int nDataLength);
 	void OnClose();
 	bool Create();
@@ -66,6 +72,11 @@ protected:
 	int64_t m_nRecvCount{};
 	int64_t m_nSendCount{};
 
+	// Date and time of the last logged status message, in the format used in
+	// the log file
+	uint64_t m_logTimeSecond{};
+	std::string m_logTime;
+
 	LRESULT OnServerMessage(CServerThread *pThread, WPARAM wParam, LPARAM lParam);
 
 	std::unique_ptr<CAsyncSslSocketLayer> m_sslLoader;
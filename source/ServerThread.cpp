@@ -27,15 +27,20 @@
 #include "ExternalIpCheck.h"
 #include "autobanmanager.h"
 #include "hash_thread.h"
+#include "file_io.h"
+#include "listing_cache.h"
+#include "connection_counters.h"
 
 #include <algorithm>
 
-std::map<int, t_socketdata> CServerThread::m_userids;
+CUserIdAllocator CServerThread::m_userIds;
+CPeerCounters CServerThread::m_peerCounters;
 std::recursive_mutex CServerThread::m_global_mutex;
-std::map<CStdString, int> CServerThread::m_userIPs;
 std::vector<CServerThread*> CServerThread::m_sInstanceList;
-std::map<CStdString, int> CServerThread::m_antiHammerInfo;
 CHashThread* CServerThread::m_hashThread = 0;
+CFileIoPool* CServerThread::m_fileIoPool = 0;
+CListingCache* CServerThread::m_listingCache = 0;
+CBandwidthScheduler CServerThread::m_bandwidthSchedulers[2];
 
 /////////////////////////////////////////////////////////////////////////////
 // CServerThread
@@ -43,8 +48,6 @@ CHashThread* CServerThread::m_hashThread = 0;
 CServerThread::CServerThread(int nNotificationMessageId)
 	: m_nNotificationMessageId(nNotificationMessageId)
 {
-	m_lastLimits[0] = m_lastLimits[1] = 0;
-	m_carryover[0] = m_carryover[1] = 0;
 }
 
 CServerThread::~CServerThread()
@@ -69,10 +72,9 @@ BOOL CServerThread::InitInstance()
 	threadSocketData_->InitAsyncSocketExInstance();
 
 	m_timerid = SetTimer(0, 0, 1000, 0);
-	m_nRateTimer = SetTimer(0, 0, 100, 0);
+	m_nRateTimer = SetTimer(0, 0, 50, 0);
 
-	// Reduce anti hammer value twice an hour
-	m_antiHammerTimer = SetTimer(0, 0, 1800 * 1000, 0);
+	m_statisticsTimer = SetTimer(0, 0, 1800 * 1000, 0);
 
 	m_nRecvCount = 0;
 	m_nSendCount = 0;
@@ -91,14 +93,15 @@ BOOL CServerThread::InitInstance()
 		m_sInstanceList.push_back(this);
 	}
 
-	m_nLoopCount = 0;
-
 	simple_lock lock(m_mutex);
 	if (!m_bIsMaster)
 		m_pExternalIpCheck = NULL;
 	else {
 		m_pExternalIpCheck = new CExternalIpCheck(this);
-		m_hashThread = new CHashThread();
+		int const workers = static_cast<int>(m_pOptions->GetOptionVal(OPTION_THREADNUM));
+		m_hashThread = new CHashThread(workers);
+		m_fileIoPool = new CFileIoPool(workers);
+		m_listingCache = new CListingCache;
 	}
 
 	m_throttled = 0;
@@ -139,6 +142,10 @@ DWORD CServerThread::ExitInstance()
 	else {
 		delete m_hashThread;
 		m_hashThread = 0;
+		delete m_fileIoPool;
+		m_fileIoPool = 0;
+		delete m_listingCache;
+		m_listingCache = 0;
 	}
 
 	return 0;
@@ -159,24 +166,6 @@ void CServerThread::AddSocket(SOCKET sockethandle, bool ssl)
 	PostThreadMessage(WM_FILEZILLA_THREADMSG, ssl ? FTM_NEWSOCKET_SSL : FTM_NEWSOCKET, (LPARAM)sockethandle);
 }
 
-#define IDMAX 1000000000
-int CServerThread::CalcUserID()
-{
-	if (m_userids.size() >= IDMAX)
-		return -1;
-	static int curid=0;
-	curid++;
-	if (curid==IDMAX)
-		curid=1;
-	while (m_userids.find(curid) != m_userids.end())
-	{
-		curid++;
-		if (curid == IDMAX)
-			curid=1;
-	}
-	return curid;
-}
-
 void CServerThread::AddNewSocket(SOCKET sockethandle, bool ssl)
 {
 	CControlSocket *socket = new CControlSocket(*this);
@@ -188,24 +177,15 @@ void CServerThread::AddNewSocket(SOCKET sockethandle, bool ssl)
 		return;
 	}
 
-	std::wstring ip;
 	UINT port = 0;
-	if (socket->GetPeerName(ip, port)) {
-		if (socket->GetFamily() == AF_INET6)
-			ip = GetIPV6ShortForm(ip);
-		socket->m_RemoteIP = ip;
-	}
-	else {
-		socket->m_RemoteIP = _T("ip unknown");
+	if (!socket->GetPeerName(socket->m_RemoteIP, port)) {
 		socket->SendStatus(_T("Can't get remote IP, disconnected"), 1);
 		socket->Close();
 		delete socket;
 		return;
 	}
-	scoped_lock glock(m_global_mutex);
-	int userid = CalcUserID();
+	int userid = m_userIds.Allocate();
 	if (userid == -1) {
-		glock.unlock();
 		socket->SendStatus(_T("Refusing connection, server too busy!"), 1);
 		socket->Send(_T("421 Server too busy, closing connection. Please retry later!"));
 		socket->Close();
@@ -213,16 +193,10 @@ void CServerThread::AddNewSocket(SOCKET sockethandle, bool ssl)
 		return;
 	}
 	socket->m_userid = userid;
-	t_socketdata data;
-	data.pSocket = socket;
-	data.pThread = this;
-	m_userids[userid] = data;
 
 	// Check if remote IP is blocked due to hammering
-	std::map<CStdString, int>::const_iterator iter = m_antiHammerInfo.find(ip);
-	if (iter != m_antiHammerInfo.end() && iter->second > 10)
+	if (m_peerCounters.GetHammerValue(socket->m_RemoteIP) > 10)
 		socket->AntiHammerIncrease(25); // ~6 secs delay
-	glock.unlock();
 	{
 		simple_lock lock(m_mutex);
 		m_LocalUserIDs[userid] = socket;
@@ -236,7 +210,7 @@ void CServerThread::AddNewSocket(SOCKET sockethandle, bool ssl)
 	conndata->pThread = this;
 
 	conndata->port = port;
-	_tcsncpy(conndata->ip, socket->m_RemoteIP, t_connectiondata_add::ip_size);
+	_tcsncpy(conndata->ip, socket->m_RemoteIP.ToString().c_str(), t_connectiondata_add::ip_size);
 
 	SendNotification(FSM_CONNECTIONDATA, (LPARAM)op);
 
@@ -317,9 +291,7 @@ int CServerThread::OnThreadMessage(UINT Msg, WPARAM wParam, LPARAM lParam)
 			}
 			if (socket) {
 				socket->Close();
-				simple_lock lock(m_global_mutex);
-				if (m_userids.find(lParam) != m_userids.end())
-					m_userids.erase(m_userids.find(lParam));
+				m_userIds.Release(static_cast<int>(lParam));
 				delete socket;
 			}
 			simple_lock lock(m_mutex);
@@ -376,6 +348,12 @@ int CServerThread::OnThreadMessage(UINT Msg, WPARAM wParam, LPARAM lParam)
 				it.second->ProcessHashResult(lParam, hash_res, alg, hash, file);
 			}
 		}
+		else if (wParam == FTM_FILEIO) {
+			CControlSocket *socket = GetControlSocket(lParam);
+			if (socket && socket->GetTransferSocket()) {
+				socket->GetTransferSocket()->OnFileIo();
+			}
+		}
 	}
 	else if (Msg == WM_TIMER)
 		OnTimer(wParam, lParam);
@@ -437,131 +415,61 @@ void CServerThread::OnTimer(WPARAM wParam,LPARAM lParam)
 		}
 	}
 	else if (wParam == m_nRateTimer) {
-		if (m_nSendCount) {
-			SendNotification(FSM_SEND, m_nSendCount);
-			m_nSendCount = 0;
-		}
-		if (m_nRecvCount) {
-			SendNotification(FSM_RECV, m_nRecvCount);
-			m_nRecvCount = 0;
-		}
-
-		if (m_bIsMaster) {
-			simple_lock glock(m_global_mutex);
-
-			// Only update the speed limits from the rule set every 2 seconds to improve performance
-			if (!m_nLoopCount) {
-				m_lastLimits[download] = m_pOptions->GetCurrentSpeedLimit(download);
-				m_lastLimits[upload] = m_pOptions->GetCurrentSpeedLimit(upload);
+		// Transfer statistics only every other tick
+		if (++m_nRateTicks % 2) {
+			// Moving average over roughly the last second
+			int64_t const rate = m_transferRate;
+			int64_t delta = static_cast<int64_t>(m_nSendCount) + m_nRecvCount - rate;
+			if (delta < 0) {
+				// Round away from zero, otherwise the average never decays
+				// back to zero once traffic stops
+				delta -= 7;
 			}
-			++m_nLoopCount %= 20;
+			m_transferRate = rate + delta / 8;
 
-			// Gather transfer statistics if a speed limit is set
-			if (m_lastLimits[download] != -1 || m_lastLimits[upload] != -1) {
-				for (auto & pThread : m_sInstanceList) {
-					pThread->GatherTransferedBytes();
-				}
+			if (m_nSendCount) {
+				SendNotification(FSM_SEND, m_nSendCount);
+				m_nSendCount = 0;
+			}
+			if (m_nRecvCount) {
+				SendNotification(FSM_RECV, m_nRecvCount);
+				m_nRecvCount = 0;
 			}
+		}
 
+		if (m_bIsMaster) {
+			// The rule set only gets evaluated once the current limit expires
+			// or the options have changed
+			unsigned int const revision = m_pOptions->GetRevision();
 			for (int i = 0; i < 2; ++i) {
-				long long limit = m_lastLimits[i];
-
-				if (limit == -1) {
-					for (auto & pThread : m_sInstanceList) {
-						simple_lock lock(pThread->m_mutex);
-						pThread->m_SlQuotas[i].nBytesAllowedToTransfer = -1;
-						pThread->m_SlQuotas[i].nTransferred = 0;
-					}
-					m_carryover[i] = 0;
-					continue;
-				}
-
-				limit *= 100;
-
-				long long nRemaining = limit + m_carryover[i];
-				long long nThreadLimit = limit / m_sInstanceList.size();
-
-				std::vector<CServerThread *> fullUsageList;
-
-				for (auto & pThread : m_sInstanceList) {
-					pThread->m_mutex.lock();
-					long long r = pThread->m_SlQuotas[i].nBytesAllowedToTransfer - pThread->m_SlQuotas[i].nTransferred;
-					if ( r > 0 && pThread->m_SlQuotas[i].nBytesAllowedToTransfer <= nThreadLimit) {
-						pThread->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-						nRemaining -= pThread->m_SlQuotas[i].nTransferred;
-						pThread->m_SlQuotas[i].nTransferred = 0;
-					}
-					else if (r > 0 && pThread->m_SlQuotas[i].nTransferred < nThreadLimit) {
-						pThread->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-						nRemaining -= pThread->m_SlQuotas[i].nTransferred;
-						pThread->m_SlQuotas[i].nTransferred = 0;
-					}
-					else {
-						fullUsageList.push_back(pThread);
-						// Don't unlock thread here, do it later
-						continue;
-					}
-					pThread->m_mutex.unlock();
-				}
-
-				// fullUsageList now contains all threads which did use up their assigned quota
-				if (!fullUsageList.empty()) {
-					std::vector<CServerThread *> fullUsageList2;
-					nThreadLimit = nRemaining / fullUsageList.size();
-					for (auto & pThread : fullUsageList) {
-						// Thread has already been locked
-						long long r = pThread->m_SlQuotas[i].nBytesAllowedToTransfer - pThread->m_SlQuotas[i].nTransferred;
-						if (r > 0) {
-							if (pThread->m_SlQuotas[i].nTransferred > nThreadLimit)
-								pThread->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-							else
-								pThread->m_SlQuotas[i].nBytesAllowedToTransfer = pThread->m_SlQuotas[i].nTransferred;
-							pThread->m_SlQuotas[i].nTransferred = 0;
-							nRemaining -= pThread->m_SlQuotas[i].nBytesAllowedToTransfer;
-						}
-						else {
-							fullUsageList2.push_back(pThread);
-							// Don't unlock thread here either, do it later
-							continue;
-						}
-						pThread->m_mutex.unlock();
-					}
-
-					if (!fullUsageList2.empty()) {
-						nThreadLimit = nRemaining / fullUsageList2.size();
-						for (auto & pThread : fullUsageList2) {
-							pThread->m_SlQuotas[i].nTransferred = 0;
-							pThread->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-
-							// Finally unlock threads
-							pThread->m_mutex.unlock();
-						}
-						nRemaining = 0;
-					}
-				}
-				if (nRemaining < limit) {
-					m_carryover[i] = nRemaining;
-				}
-				else {
-					m_carryover[i] = limit;
+				int limit;
+				if (!m_speedLimitSchedules[i].Get(limit, revision)) {
+					SYSTEMTIME st;
+					GetLocalTime(&st);
+					int validFor = CSpeedLimitSchedule::maxValidity;
+					limit = m_pOptions->GetCurrentSpeedLimit(i, st, validFor);
+					m_speedLimitSchedules[i].Set(limit, validFor, revision);
+					m_bandwidthSchedulers[i].SetRate(limit > -1 ? limit * 1000ll : -1);
 				}
+				m_bandwidthSchedulers[i].Distribute();
 			}
 		}
-		ProcessNewSlQuota();
+
+		// The buckets refill on their own, only wake up the transfers which ran dry
+		ContinueTransfers();
 	}
 	else if (m_pExternalIpCheck && wParam == m_pExternalIpCheck->GetTimerID()) {
 		simple_lock lock(m_mutex);
 		m_pExternalIpCheck->OnTimer();
 	}
-	else if (wParam == m_antiHammerTimer && m_bIsMaster) {
-		AntiHammerDecay();
+	else if (wParam == m_statisticsTimer && m_bIsMaster) {
+		ReportListingCacheStatistics();
 	}
 }
 
 const int CServerThread::GetGlobalNumConnections()
 {
-	simple_lock lock(m_global_mutex);
-	return m_userids.size();
+	return m_userIds.GetCount();
 }
 
 CControlSocket * CServerThread::GetControlSocket(int userid)
@@ -589,39 +497,19 @@ bool CServerThread::IsReady()
 	return !m_bQuit;
 }
 
-int CServerThread::GetIpCount(const CStdString &ip) const
+int CServerThread::GetIpCount(CIpAddress const& ip) const
 {
-	int count = 0;
-	simple_lock lock(m_global_mutex);
-	std::map<CStdString, int>::iterator iter = m_userIPs.find(ip);
-	if (iter != m_userIPs.end())
-		count = iter->second;
-	return count;
+	return m_peerCounters.GetConnections(ip);
 }
 
-void CServerThread::IncIpCount(const CStdString &ip)
+void CServerThread::IncIpCount(CIpAddress const& ip)
 {
-	simple_lock lock(m_global_mutex);
-	std::map<CStdString, int>::iterator iter=m_userIPs.find(ip);
-	if (iter != m_userIPs.end())
-		++iter->second;
-	else
-		m_userIPs[ip] = 1;
+	m_peerCounters.IncConnections(ip);
 }
 
-void CServerThread::DecIpCount(const CStdString &ip)
+void CServerThread::DecIpCount(CIpAddress const& ip)
 {
-	simple_lock lock(m_global_mutex);
-	std::map<CStdString, int>::iterator iter=m_userIPs.find(ip);
-	ASSERT(iter != m_userIPs.end());
-	if (iter != m_userIPs.end()) {
-		ASSERT(iter->second > 0);
-		if (iter->second > 1)
-			--iter->second;
-		else {
-			m_userIPs.erase(iter);
-		}
-	}
+	m_peerCounters.DecConnections(ip);
 }
 
 void CServerThread::IncSendCount(int count)
@@ -634,107 +522,14 @@ void CServerThread::IncRecvCount(int count)
 	m_nRecvCount += count;
 }
 
-void CServerThread::ProcessNewSlQuota()
+void CServerThread::ContinueTransfers()
 {
 	simple_lock lock(m_mutex);
-
-	for (int i = 0; i < 2; ++i) {
-		if (m_SlQuotas[i].nBytesAllowedToTransfer == -1) {
-			for (auto & it : m_LocalUserIDs ) {
-				CControlSocket *pControlSocket = it.second;
-				pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer = -1;
-				pControlSocket->m_SlQuotas[i].nTransferred = 0;
-			}
-			m_SlQuotas[i].carryover = 0;
-			continue;
-		}
-
-		long long nRemaining = m_SlQuotas[i].nBytesAllowedToTransfer + m_SlQuotas[i].carryover;
-		long long nThreadLimit = nRemaining / m_sInstanceList.size();
-
-		std::vector<CControlSocket *> fullUsageList;
-
-		for (auto & it : m_LocalUserIDs ) {
-			CControlSocket *pControlSocket = it.second;
-			long long r = pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer - pControlSocket->m_SlQuotas[i].nTransferred;
-			if (pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer == -1) {
-				pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-				pControlSocket->m_SlQuotas[i].nTransferred = 0;
-			}
-			else if (r > 0 && pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer <= nThreadLimit) {
-				pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-				nRemaining -= pControlSocket->m_SlQuotas[i].nTransferred;
-				pControlSocket->m_SlQuotas[i].nTransferred = 0;
-			}
-			else if (r > 0 && pControlSocket->m_SlQuotas[i].nTransferred < nThreadLimit) {
-				pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-				nRemaining -= pControlSocket->m_SlQuotas[i].nTransferred;
-				pControlSocket->m_SlQuotas[i].nTransferred = 0;
-			}
-			else {
-				fullUsageList.push_back(pControlSocket);
-				continue;
-			}
-		}
-
-		if (!fullUsageList.empty()) {
-			std::vector<CControlSocket *> fullUsageList2;
-
-			nThreadLimit = nRemaining / fullUsageList.size();
-			for (auto & pControlSocket : fullUsageList ) {
-				long long r = pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer - pControlSocket->m_SlQuotas[i].nTransferred;
-				if (r) {
-					if (pControlSocket->m_SlQuotas[i].nTransferred > nThreadLimit)
-						pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-					else
-						pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer = pControlSocket->m_SlQuotas[i].nTransferred;
-					pControlSocket->m_SlQuotas[i].nTransferred = 0;
-					nRemaining -= pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer;
-				}
-				else {
-					fullUsageList2.push_back(pControlSocket);
-					continue;
-				}
-			}
-
-			if (!fullUsageList2.empty()) {
-				nThreadLimit = nRemaining / fullUsageList2.size();
-				for (auto & pControlSocket : fullUsageList2 ) {
-					pControlSocket->m_SlQuotas[i].nTransferred = 0;
-					pControlSocket->m_SlQuotas[i].nBytesAllowedToTransfer = nThreadLimit;
-				}
-				nRemaining = 0;
-			}
-		}
-		if (nRemaining < m_SlQuotas[i].nBytesAllowedToTransfer) {
-			m_SlQuotas[i].carryover = nRemaining;
-		}
-		else {
-			m_SlQuotas[i].carryover = m_SlQuotas[i].nBytesAllowedToTransfer;
-		}
-	}
-
 	for (auto & it : m_LocalUserIDs) {
 		it.second->Continue();
 	}
 }
 
-void CServerThread::GatherTransferedBytes()
-{
-	simple_lock lock(m_mutex);
-	for (auto & it : m_LocalUserIDs) {
-		for (int i = 0; i < 2; ++i) {
-			if (it.second->m_SlQuotas[i].nBytesAllowedToTransfer > -1) {
-				if (it.second->m_SlQuotas[i].bBypassed)
-					it.second->m_SlQuotas[i].nTransferred = 0;
-				else
-					m_SlQuotas[i].nTransferred += it.second->m_SlQuotas[i].nTransferred;
-			}
-			it.second->m_SlQuotas[i].bBypassed = false;
-		}
-	}
-}
-
 CStdString CServerThread::GetExternalIP(const CStdString& localIP)
 {
 	{
@@ -787,82 +582,65 @@ void CServerThread::SendNotification(WPARAM wParam, LPARAM lParam)
 	m_pendingNotifications.push_back(notification);
 
 	// Check if main thread can't handle number of notifications fast enough, throttle thread if neccessary
-	if (m_pendingNotifications.size() > 200 && m_throttled < 3) {
-		SetPriority(THREAD_PRIORITY_IDLE);
-		m_throttled = 3;
-	}
-	else if (m_pendingNotifications.size() > 150 && m_throttled < 2) {
-		SetPriority(THREAD_PRIORITY_LOWEST);
-		m_throttled = 2;
-	}
-	else if (m_pendingNotifications.size() > 100 && !m_throttled) {
-		SetPriority(THREAD_PRIORITY_BELOW_NORMAL);
-		m_throttled = 1;
-	}
+	size_t const pending = m_pendingNotifications.size();
+	Throttle((pending > 200) ? 3 : ((pending > 150) ? 2 : ((pending > 100) ? 1 : 0)));
 }
 
 void CServerThread::GetNotifications(std::list<CServerThread::t_Notification>& list)
 {
 	simple_lock lock(m_mutex);
 
+	// Messages queued from here on need a new notification
+	m_statusSignaled = false;
+
 	m_pendingNotifications.swap(list);
 
-	if (m_throttled)
+	if (m_throttled) {
 		SetPriority(THREAD_PRIORITY_NORMAL);
+		m_throttled = 0;
+	}
 }
 
-void CServerThread::AntiHammerIncrease(CStdString const& ip)
+void CServerThread::Throttle(int level)
 {
-	simple_lock lock(m_global_mutex);
-
-	std::map<CStdString, int>::iterator iter = m_antiHammerInfo.find(ip);
-	if (iter != m_antiHammerInfo.end()) {
-		if (iter->second < 20)
-			iter->second++;
-		return;
-	}
-	else {
-		if (m_antiHammerInfo.size() >= 1000) {
-			std::map<CStdString, int>::iterator best = m_antiHammerInfo.begin();
-			for (iter = m_antiHammerInfo.begin(); iter != m_antiHammerInfo.end(); ++iter) {
-				if (iter->second < best->second)
-					best = iter;
-			}
-			m_antiHammerInfo.erase(best);
-		}
-		
-		m_antiHammerInfo.insert(std::make_pair(ip, 1));
+	static int const priorities[] = { THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_BELOW_NORMAL, THREAD_PRIORITY_LOWEST, THREAD_PRIORITY_IDLE };
+	if (level > m_throttled) {
+		SetPriority(priorities[level]);
+		m_throttled = level;
 	}
 }
 
-void CServerThread::AntiHammerDecrease(CStdString const& ip)
+void CServerThread::SendStatus(int userid, LPCTSTR user, CIpAddress const& ip, LPCTSTR status, int type)
 {
-	simple_lock lock(m_global_mutex);
+	if (!CStatusQueue::IsEnabled()) {
+		return;
+	}
 
-	auto iter = m_antiHammerInfo.find(ip);
-	if (iter != m_antiHammerInfo.end()) {
-		if (iter->second > 1) {
-			--(iter->second);
-			++iter;
-		}
-		else
-			m_antiHammerInfo.erase(iter++);
+	// Same as for the other notifications, back off if the main thread falls
+	// behind. A dropped message means it did by quite a margin.
+	int level = 3;
+	if (m_statusQueue.Push(userid, user, ip, status, type)) {
+		int const load = m_statusQueue.GetLoad();
+		level = (load > 75) ? 3 : ((load > 50) ? 2 : ((load > 25) ? 1 : 0));
+	}
+	if (level > m_throttled) {
+		simple_lock lock(m_mutex);
+		Throttle(level);
+	}
+
+	if (!m_statusSignaled.exchange(true)) {
+		PostMessage(hMainWnd, m_nNotificationMessageId, 0, 0);
 	}
 }
 
-void CServerThread::AntiHammerDecay()
+void CServerThread::AntiHammerIncrease(CIpAddress const& ip)
 {
-	simple_lock lock(m_global_mutex);
+	m_peerCounters.IncHammerValue(ip);
+}
 
-	std::map<CStdString, int>::iterator iter = m_antiHammerInfo.begin();
-	while (iter != m_antiHammerInfo.end()) {
-		if (iter->second > 1) {
-			--(iter->second);
-			++iter;
-		}
-		else
-			m_antiHammerInfo.erase(iter++);
-	}
+void CServerThread::AntiHammerDecrease(CIpAddress const& ip)
+{
+	m_peerCounters.DecHammerValue(ip);
 }
 
 CHashThread& CServerThread::GetHashThread()
@@ -870,6 +648,37 @@ CHashThread& CServerThread::GetHashThread()
 	return *m_hashThread;
 }
 
+CFileIoPool& CServerThread::GetFileIoPool()
+{
+	return *m_fileIoPool;
+}
+
+CListingCache& CServerThread::GetListingCache()
+{
+	return *m_listingCache;
+}
+
+void CServerThread::InvalidateCaches(std::wstring const& path)
+{
+	m_hashThread->Invalidate(path);
+	m_listingCache->Invalidate(path);
+}
+
+void CServerThread::ReportListingCacheStatistics()
+{
+	uint64_t const hits = m_listingCache->GetHits();
+	uint64_t const misses = m_listingCache->GetMisses();
+	if (hits + misses == m_reportedListingLookups) {
+		return;
+	}
+	m_reportedListingLookups = hits + misses;
+
+	CStdString status;
+	status.Format(_T("Directory listing cache: %I64u hits, %I64u misses"), hits, misses);
+
+	SendStatus(0, _T(""), CIpAddress(), status, 0);
+}
+
 void CServerThread::OnPermissionsUpdated()
 {
 	simple_lock lock(m_mutex);
@@ -880,13 +689,7 @@ void CServerThread::OnPermissionsUpdated()
 	}
 }
 
-long long CServerThread::GetInitialSpeedLimit(int mode)
+CBandwidthScheduler& CServerThread::GetBandwidthScheduler(int mode)
 {
-	long long ret;
-	simple_lock lock(m_mutex);
-	ret = m_SlQuotas[mode].nBytesAllowedToTransfer;
-	if( ret > -1 ) {
-		ret /= m_LocalUserIDs.size() + 1;
-	}
-	return ret;
+	return m_bandwidthSchedulers[mode];
 }
\ No newline at end of file
@@ -21,6 +21,11 @@
 
 #include "Thread.h"
 
+#include "speed_limiter.h"
+#include "status_queue.h"
+
+#include <atomic>
+
 class CControlSocket;
 class CServerThread;
 class COptions;
@@ -29,12 +34,10 @@ class t_user;
 class CExternalIpCheck;
 class CAutoBanManager;
 class CHashThread;
-
-struct t_socketdata
-{
-	CControlSocket *pSocket{};
-	CServerThread *pThread{};
-};
+class CFileIoPool;
+class CListingCache;
+class CUserIdAllocator;
+class CPeerCounters;
 
 /////////////////////////////////////////////////////////////////////////////
 // Thread CServerThread
@@ -52,14 +55,18 @@ public:
 
 	void IncRecvCount(int count);
 	void IncSendCount(int count);
-	void IncIpCount(const CStdString &ip);
-	void DecIpCount(const CStdString &ip);
-	int GetIpCount(const CStdString &ip) const;
+	void IncIpCount(CIpAddress const& ip);
+	void DecIpCount(CIpAddress const& ip);
+	int GetIpCount(CIpAddress const& ip) const;
 	bool IsReady();
 	static const int GetGlobalNumConnections();
 	void AddSocket(SOCKET sockethandle, bool ssl);
 	const int GetNumConnections();
 
+	// Smoothed number of bytes sent and received per 100ms, used to place new
+	// connections on the least loaded thread.
+	int64_t GetTransferRate() const { return m_transferRate; }
+
 	struct t_Notification
 	{
 		WPARAM wParam{};
@@ -74,18 +81,31 @@ public:
 	 */
 	void GetNotifications(std::list<CServerThread::t_Notification>& list);
 
-	void AntiHammerIncrease(CStdString const& ip);
-	void AntiHammerDecrease(CStdString const& ip);
+	// Queues a status message for the main thread, to be called by the thread
+	// itself only. Does nothing if nobody is interested in status messages.
+	void SendStatus(int userid, LPCTSTR user, CIpAddress const& ip, LPCTSTR status, int type);
+
+	// Drained by the main thread after calling GetNotifications
+	CStatusQueue& GetStatusQueue() { return m_statusQueue; }
+
+	void AntiHammerIncrease(CIpAddress const& ip);
+	void AntiHammerDecrease(CIpAddress const& ip);
 
 	CHashThread& GetHashThread();
+	CFileIoPool& GetFileIoPool();
+	CListingCache& GetListingCache();
 
-	long long GetInitialSpeedLimit(int mode);
+	// To be called whenever a file or directory gets created, modified, renamed
+	// or deleted. Takes the physical path.
+	void InvalidateCaches(std::wstring const& path);
+
+	// Server-wide speed limit, shared by all threads
+	static CBandwidthScheduler& GetBandwidthScheduler(int mode);
 
 protected:
 	virtual ~CServerThread();
 
-	void GatherTransferedBytes();
-	void ProcessNewSlQuota();
+	void ContinueTransfers();
 	virtual BOOL InitInstance();
 	virtual DWORD ExitInstance();
 
@@ -98,14 +118,18 @@ protected:
 	CControlSocket * GetControlSocket(int userid);
 	std::map<int, CControlSocket *> m_LocalUserIDs;
 	void AddNewSocket(SOCKET sockethandle, bool ssl);
-	static int CalcUserID();
-	static std::map<int, t_socketdata> m_userids;
-	static std::map<CStdString, int> m_userIPs;
-	void AntiHammerDecay();
+
+	// Shared by all threads
+	static CUserIdAllocator m_userIds;
+	static CPeerCounters m_peerCounters;
+
+	void ReportListingCacheStatistics();
 
 	int m_nRecvCount{};
 	int m_nSendCount{};
+	std::atomic<int64_t> m_transferRate{};
 	UINT m_nRateTimer{};
+	unsigned int m_nRateTicks{};
 	bool m_bQuit{};
 
 	std::recursive_mutex m_mutex;
@@ -115,30 +139,37 @@ protected:
 	//Speed limit code
 	static std::vector<CServerThread *> m_sInstanceList; //First instance is the SL master
 	BOOL m_bIsMaster{};
-	int m_nLoopCount{};
-
-	int m_lastLimits[2];
-	long long m_carryover[2];
-	struct t_Quota {
-		long long nBytesAllowedToTransfer{-1};
-		long long nTransferred{};
-		long long carryover{};
-	};
-	t_Quota m_SlQuotas[2];
+
+	// Only used by the master, recompiled when the rules change or the
+	// current limit expires
+	CSpeedLimitSchedule m_speedLimitSchedules[2];
+	static CBandwidthScheduler m_bandwidthSchedulers[2];
 
 	CStdString m_RawWelcomeMessage;
 	std::vector<CStdString> m_ParsedWelcomeMessage;
 	CExternalIpCheck *m_pExternalIpCheck{};
 
 	std::list<t_Notification> m_pendingNotifications;
-	int m_throttled{};
+
+	// Lowers the priority of the thread to the given level if not already
+	// lower. Requires m_mutex.
+	void Throttle(int level);
+	std::atomic<int> m_throttled{};
+
+	CStatusQueue m_statusQueue;
+
+	// Set while the main thread has been notified but did not yet drain the
+	// status queue
+	std::atomic<bool> m_statusSignaled{};
 
 	int m_nNotificationMessageId{};
 
-	static std::map<CStdString, int> m_antiHammerInfo;
-	int m_antiHammerTimer{};
+	int m_statisticsTimer{};
 
 	static CHashThread* m_hashThread;
+	static CFileIoPool* m_fileIoPool;
+	static CListingCache* m_listingCache;
+	uint64_t m_reportedListingLookups{};
 
 	CAsyncSocketEx* threadSocketData_{};
 };
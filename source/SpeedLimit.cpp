@@ -92,6 +92,36 @@ bool CSpeedLimit::IsItActive(const SYSTEMTIME &time) const
 	return true;
 }
 
+int CSpeedLimit::GetSecondsToChange(SYSTEMTIME const& time) const
+{
+	int const curTime = time.wHour * 60 * 60 +
+	                    time.wMinute * 60 +
+	                    time.wSecond;
+
+	// Date and weekday only change at midnight
+	int next = 24 * 60 * 60;
+
+	if (m_FromCheck) {
+		int const fromTime = m_FromTime.h * 60 * 60 +
+		                     m_FromTime.m * 60 +
+		                     m_FromTime.s;
+		if (fromTime > curTime && fromTime < next) {
+			next = fromTime;
+		}
+	}
+	if (m_ToCheck) {
+		// The end time is inclusive
+		int const toTime = m_ToTime.h * 60 * 60 +
+		                   m_ToTime.m * 60 +
+		                   m_ToTime.s + 1;
+		if (toTime > curTime && toTime < next) {
+			next = toTime;
+		}
+	}
+
+	return next - curTime;
+}
+
 int CSpeedLimit::GetRequiredBufferLen() const
 {
 	return	4 + //Speed
@@ -28,6 +28,10 @@ class CSpeedLimit final
 public:
 	bool IsItActive(const SYSTEMTIME &time) const;
 
+	// Returns the number of seconds until IsItActive may return a different
+	// result, at most until midnight.
+	int GetSecondsToChange(SYSTEMTIME const& time) const;
+
 	int GetRequiredBufferLen() const;
 	unsigned char * FillBuffer(unsigned char *p) const;
 	unsigned char * ParseBuffer(unsigned char *pBuffer, int length);
@@ -50,6 +50,7 @@ using namespace std::literals::string_literals;
 
 #include "misc/StdString.h"
 #include "AsyncSocketEx.h"
+#include "iputils.h"
 
 #define FILEZILLA_SERVER_MESSAGE L"FileZilla Server Message"
 #define FILEZILLA_THREAD_MESSAGE L"FileZilla Thread Message"
@@ -58,7 +59,6 @@ const UINT WM_FILEZILLA_RELOADCONFIG = WM_APP;
 const UINT WM_FILEZILLA_SERVERMSG = (WM_APP + 1);
 const UINT WM_FILEZILLA_THREADMSG = ::RegisterWindowMessage(FILEZILLA_THREAD_MESSAGE);
 
-#define FSM_STATUSMESSAGE 0
 #define FSM_CONNECTIONDATA 1
 #define FSM_THREADCANQUIT 2
 #define FSM_SEND 3
@@ -72,6 +72,7 @@ const UINT WM_FILEZILLA_THREADMSG = ::RegisterWindowMessage(FILEZILLA_THREAD_MES
 #define FTM_CONTROL 5
 #define FTM_NEWSOCKET_SSL 6
 #define FTM_HASHRESULT 7
+#define FTM_FILEIO 8
 
 #define USERCONTROL_GETLIST 0
 #define USERCONTROL_CONNOP 1
@@ -90,16 +91,6 @@ struct t_controlmessage
 	int socketid;
 };
 
-struct t_statusmsg
-{
-	TCHAR ip[40];
-	LPTSTR user;
-	SYSTEMTIME time;
-	UINT userid;
-	int type;
-	LPTSTR status;
-};
-
 class CServerThread;
 struct t_connectiondata
 {
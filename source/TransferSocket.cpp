@@ -24,6 +24,128 @@
 #include "AsyncSslSocketLayer.h"
 #include "Permissions.h"
 #include "iputils.h"
+#include "file_io.h"
+
+#include <VersionHelpers.h>
+
+namespace {
+// Uploads are written in blocks of this many times the transfer buffer size
+unsigned int const uploadBlockFactor = 8;
+
+// Number of blocks that may wait to be written before no further data is received
+unsigned int const uploadMaxBlocks = 4;
+
+// Bytes a transfer may send per FD_WRITE before the other sockets of the thread get their turn
+int const sendBudgetPerEvent = 256 * 1024;
+
+// Directory listings are formatted this many 8 KiB chunks at a time
+size_t const dirListingChunks = 4;
+}
+
+// An overlapped TransmitFile call. Its completion is posted to the server thread
+// as FTM_FILEIO. If the transfer ends while the call is still in progress, the
+// operation takes over the file and cleans up after itself once the call is done.
+class CTransferSocket::transmit_op final
+{
+public:
+	transmit_op(CServerThread & owner, int userid)
+		: owner_(owner)
+		, userid_(userid)
+	{
+		ov.hEvent = CreateEvent(0, FALSE, FALSE, 0);
+		if (ov.hEvent && !RegisterWaitForSingleObject(&wait_, ov.hEvent, &transmit_op::OnCompletion, this, INFINITE, WT_EXECUTEDEFAULT)) {
+			wait_ = 0;
+		}
+	}
+
+	~transmit_op()
+	{
+		if (wait_) {
+			// Also waits for a callback still running
+			UnregisterWaitEx(wait_, INVALID_HANDLE_VALUE);
+		}
+		if (ov.hEvent) {
+			CloseHandle(ov.hEvent);
+		}
+		if (file_ != INVALID_HANDLE_VALUE) {
+			CloseHandle(file_);
+		}
+	}
+
+	bool Valid() const { return wait_ != 0; }
+
+	// Prepares the next call, which starts at the given file offset
+	OVERLAPPED* Start(__int64 offset)
+	{
+		fz::scoped_lock lock(mutex_);
+
+		HANDLE const event = ov.hEvent;
+		ov = OVERLAPPED();
+		ov.hEvent = event;
+		ov.Offset = static_cast<DWORD>(offset & 0xffffffff);
+		ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		return &ov;
+	}
+
+	// Called if the transfer ends while a call is in progress, before the socket
+	// gets closed. Returns true if the operation took over the file, it then
+	// deletes itself once done.
+	static bool Abandon(std::unique_ptr<transmit_op> & op, SOCKET s, HANDLE file)
+	{
+		if (s != INVALID_SOCKET) {
+			CancelIoEx(reinterpret_cast<HANDLE>(s), &op->ov);
+		}
+
+		// Only the state of the current call counts. The event is auto-reset,
+		// the callback for an earlier call may still arrive late.
+		fz::scoped_lock lock(op->mutex_);
+		if (HasOverlappedIoCompleted(&op->ov)) {
+			return false;
+		}
+		op->file_ = file;
+		op->abandoned_ = true;
+		op.release();
+		return true;
+	}
+
+	OVERLAPPED ov{};
+
+private:
+	static void CALLBACK OnCompletion(PVOID param, BOOLEAN)
+	{
+		transmit_op* op = static_cast<transmit_op*>(param);
+		{
+			fz::scoped_lock lock(op->mutex_);
+			if (!op->abandoned_) {
+				// A late callback of an earlier call merely causes a
+				// spurious check of the current one
+				op->owner_.PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_FILEIO, op->userid_);
+				return;
+			}
+			if (!HasOverlappedIoCompleted(&op->ov)) {
+				// Late callback of an earlier call, the current one signals
+				// the event again once done
+				return;
+			}
+		}
+
+		// Nothing references the operation anymore. Can't wait for the
+		// callback to return from within the callback.
+		UnregisterWait(op->wait_);
+		op->wait_ = 0;
+		delete op;
+	}
+
+	fz::mutex mutex_{false};
+
+	CServerThread & owner_;
+	int const userid_;
+
+	HANDLE wait_{};
+	HANDLE file_{INVALID_HANDLE_VALUE};
+
+	bool abandoned_{};
+};
 
 /////////////////////////////////////////////////////////////////////////////
 // CTransferSocket
@@ -62,7 +184,7 @@ CTransferSocket::CTransferSocket(CControlSocket *pOwner)
 	m_on_connect_called = false;
 }
 
-void CTransferSocket::Init(std::list<t_dirlisting> &dir, int nMode)
+void CTransferSocket::Init(std::unique_ptr<CDirectoryListing> && listing, int nMode)
 {
 	ASSERT(nMode == TRANSFERMODE_LIST);
 	m_bReady = true;
@@ -76,7 +198,8 @@ void CTransferSocket::Init(std::list<t_dirlisting> &dir, int nMode)
 	}
 	m_pBuffer2 = 0;
 
-	std::swap(directory_listing_, dir);
+	dirListing_ = std::move(listing);
+	directory_listing_.clear();
 
 	m_nMode = nMode;
 
@@ -125,6 +248,19 @@ CTransferSocket::~CTransferSocket()
 }
 
 
+bool CTransferSocket::FetchDirListing()
+{
+	if (!dirListing_) {
+		return false;
+	}
+
+	if (!dirListing_->Fill(directory_listing_, dirListingChunks)) {
+		dirListing_.reset();
+	}
+
+	return !directory_listing_.empty();
+}
+
 void CTransferSocket::OnSend(int nErrorCode)
 {
 	if (nErrorCode) {
@@ -132,6 +268,8 @@ void CTransferSocket::OnSend(int nErrorCode)
 		return;
 	}
 
+	int budget = sendBudgetPerEvent;
+
 	if (m_nMode == TRANSFERMODE_LIST) {
 		//Send directory listing
 		if (!m_bStarted) {
@@ -154,7 +292,7 @@ void CTransferSocket::OnSend(int nErrorCode)
 			while (true) {
 				int numsend;
 				if (!m_zlibStream.avail_in) {
-					if (!directory_listing_.empty()) {
+					if (!directory_listing_.empty() || FetchDirListing()) {
 						m_zlibStream.next_in = (Bytef *)directory_listing_.front().buffer;
 						m_zlibStream.avail_in = directory_listing_.front().len;
 					}
@@ -171,12 +309,12 @@ void CTransferSocket::OnSend(int nErrorCode)
 				if (m_zlibStream.avail_out) {
 					m_zlibStream.total_in = 0;
 					m_zlibStream.total_out = 0;
-					res = deflate(&m_zlibStream, directory_listing_.size() > 1 ? 0 : Z_FINISH);
+					res = deflate(&m_zlibStream, (directory_listing_.size() > 1 || dirListing_) ? 0 : Z_FINISH);
 					m_currentFileOffset += m_zlibStream.total_in;
 					m_zlibBytesIn += m_zlibStream.total_in;
 					m_zlibBytesOut += m_zlibStream.total_out;
 					if (res == Z_STREAM_END) {
-						if (directory_listing_.size() > 1 ) {
+						if (directory_listing_.size() > 1 || dirListing_) {
 							ShutDown();
 							EndTransfer(transfer_status_t::zlib);
 							return;
@@ -223,7 +361,7 @@ void CTransferSocket::OnSend(int nErrorCode)
 				}
 
 				if (nLimit > -1 && GetState() != aborted) {
-					m_pOwner->m_SlQuotas[download].nTransferred += numsent;
+					m_pOwner->ConsumeSpeedLimit(download, numsent);
 				}
 
 				m_pOwner->m_owner.IncSendCount(numsent);
@@ -236,16 +374,13 @@ void CTransferSocket::OnSend(int nErrorCode)
 					break;
 				}
 
-				//Check if there are other commands in the command queue.
-				MSG msg;
-				if (PeekMessage(&msg,0, 0, 0, PM_NOREMOVE)) {
-					TriggerEvent(FD_WRITE);
+				if (SendBudgetExhausted(budget, numsent)) {
 					return;
 				}
 			}
 		}
 		else {
-			while (!directory_listing_.empty()) {
+			while (!directory_listing_.empty() || FetchDirListing()) {
 				int numsend = m_nBufSize;
 				if ((directory_listing_.front().len - m_nBufferPos) < m_nBufSize) {
 					numsend = directory_listing_.front().len - m_nBufferPos;
@@ -270,7 +405,7 @@ void CTransferSocket::OnSend(int nErrorCode)
 				}
 
 				if (nLimit > -1 && GetState() != aborted) {
-					m_pOwner->m_SlQuotas[download].nTransferred += numsent;
+					m_pOwner->ConsumeSpeedLimit(download, numsent);
 				}
 
 				m_pOwner->m_owner.IncSendCount(numsent);
@@ -289,15 +424,12 @@ void CTransferSocket::OnSend(int nErrorCode)
 					directory_listing_.pop_front();
 					m_nBufferPos = 0;
 
-					if (directory_listing_.empty()) {
+					if (directory_listing_.empty() && !FetchDirListing()) {
 						break;
 					}
 				}
 
-				//Check if there are other commands in the command queue.
-				MSG msg;
-				if (PeekMessage(&msg,0, 0, 0, PM_NOREMOVE)) {
-					TriggerEvent(FD_WRITE);
+				if (SendBudgetExhausted(budget, numsent)) {
 					return;
 				}
 			}
@@ -326,33 +458,39 @@ void CTransferSocket::OnSend(int nErrorCode)
 			}
 		}
 		if (m_useZlib) {
-			if (!m_pBuffer2) {
-				m_pBuffer2 = new char[m_nBufSize];
-
-				m_zlibStream.next_in = (Bytef *)m_pBuffer2;
-			}
-
 			while (true) {
 				int numsend;
-				if (!m_zlibStream.avail_in) {
-					if (m_hFile != INVALID_HANDLE_VALUE) {
-						DWORD numread;
-						if (!ReadFile(m_hFile, m_pBuffer2, m_nBufSize, &numread, 0)) {
-							EndTransfer(transfer_status_t::err_file_read);
+				bool waitingForData = false;
+				if (!m_zlibStream.avail_in && m_pFileReader) {
+					if (m_readerHeld) {
+						m_pFileReader->Consume(m_readerHeld);
+						m_readerHeld = 0;
+					}
+
+					char const* data{};
+					unsigned int numread{};
+					auto const status = m_pFileReader->Get(data, numread);
+					if (status == CFileReader::status::error) {
+						EndTransfer(transfer_status_t::err_file_read);
+						return;
+					}
+					else if (status == CFileReader::status::pending) {
+						// Still send what has already been compressed
+						waitingForData = true;
+					}
+					else if (status == CFileReader::status::eof) {
+						CloseFile();
+
+						if (m_waitingForSslHandshake) {
 							return;
 						}
+					}
+					else {
 						m_currentFileOffset += numread;
 
-						m_zlibStream.next_in = (Bytef *)m_pBuffer2;
+						m_zlibStream.next_in = (Bytef *)const_cast<char *>(data);
 						m_zlibStream.avail_in = numread;
-
-						if (numread < m_nBufSize) {
-							CloseFile();
-
-							if (m_waitingForSslHandshake) {
-								return;
-							}
-						}
+						m_readerHeld = numread;
 					}
 				}
 				if (!m_zlibStream.avail_out) {
@@ -364,14 +502,14 @@ void CTransferSocket::OnSend(int nErrorCode)
 				}
 
 				int res = Z_OK;
-				if (m_zlibStream.avail_out) {
+				if (m_zlibStream.avail_out && !waitingForData) {
 					m_zlibStream.total_in = 0;
 					m_zlibStream.total_out = 0;
-					res = deflate(&m_zlibStream, (m_hFile != INVALID_HANDLE_VALUE) ? 0 : Z_FINISH);
+					res = deflate(&m_zlibStream, m_pFileReader ? 0 : Z_FINISH);
 					m_zlibBytesIn += m_zlibStream.total_in;
 					m_zlibBytesOut += m_zlibStream.total_out;
 					if (res == Z_STREAM_END) {
-						if (m_hFile != INVALID_HANDLE_VALUE) {
+						if (m_pFileReader) {
 							EndTransfer(transfer_status_t::zlib);
 							return;
 						}
@@ -388,6 +526,10 @@ void CTransferSocket::OnSend(int nErrorCode)
 				numsend = m_nBufSize;
 				unsigned int len = m_nBufSize - m_nBufferPos - m_zlibStream.avail_out;
 				if (!len) {
+					if (waitingForData) {
+						// Continued on FTM_FILEIO
+						return;
+					}
 					continue;
 				}
 
@@ -413,67 +555,44 @@ void CTransferSocket::OnSend(int nErrorCode)
 				}
 
 				if (nLimit > -1 && GetState() != aborted) {
-					m_pOwner->m_SlQuotas[download].nTransferred += numsent;
+					m_pOwner->ConsumeSpeedLimit(download, numsent);
 				}
 
 				m_pOwner->m_owner.IncSendCount(numsent);
 				m_LastActiveTime = fz::monotonic_clock::now();
 				m_nBufferPos += numsent;
 
-				if (!m_zlibStream.avail_in && m_hFile == INVALID_HANDLE_VALUE && m_zlibStream.avail_out &&
+				if (!m_zlibStream.avail_in && !m_pFileReader && m_zlibStream.avail_out &&
 					m_zlibStream.avail_out + m_nBufferPos == m_nBufSize && res == Z_STREAM_END)
 				{
 					break;
 				}
 
-				//Check if there are other commands in the command queue.
-				MSG msg;
-				if (PeekMessage(&msg,0, 0, 0, PM_NOREMOVE)) {
-					TriggerEvent(FD_WRITE);
+				if (SendBudgetExhausted(budget, numsent)) {
 					return;
 				}
 			}
 		}
 		else {
-			while (m_hFile != INVALID_HANDLE_VALUE || m_nBufferPos) {
-				DWORD numread;
-				if (m_nBufSize - m_nBufferPos && m_hFile != INVALID_HANDLE_VALUE) {
-					if (!ReadFile(m_hFile, m_pBuffer+m_nBufferPos, m_nBufSize-m_nBufferPos, &numread, 0)) {
-						EndTransfer(transfer_status_t::err_file_read);
-						return;
-					}
-
-					if (!numread) {
-						CloseFile();
-
-						if (!m_nBufferPos) {
-							if (m_waitingForSslHandshake) {
-								return;
-							}
-
-							if (m_pSslLayer) {
-								if (!ShutDown() && GetLastError() == WSAEWOULDBLOCK) {
-									return;
-								}
-							}
-							EndTransfer(transfer_status_t::success);
-							return;
-						}
-					}
-					else {
-						m_currentFileOffset += numread;
-					}
+			if (m_pTransmitFile && !TransmitFileData(budget)) {
+				return;
+			}
 
-					numread += m_nBufferPos;
-					m_nBufferPos = 0;
+			while (m_pFileReader) {
+				char const* data{};
+				unsigned int numread{};
+				auto const status = m_pFileReader->Get(data, numread);
+				if (status == CFileReader::status::pending) {
+					// Continued on FTM_FILEIO
+					return;
 				}
-				else {
-					numread = m_nBufferPos;
+				else if (status == CFileReader::status::error) {
+					EndTransfer(transfer_status_t::err_file_read);
+					return;
 				}
-				m_nBufferPos = 0;
-
-				if (numread < m_nBufSize) {
+				else if (status == CFileReader::status::eof) {
 					CloseFile();
+					break;
 				}
 
 				int numsend = numread;
@@ -483,35 +602,28 @@ void CTransferSocket::OnSend(int nErrorCode)
 				}
 
 				if (!numsend) {
-					m_nBufferPos = numread;
 					return;
 				}
 
-				int	numsent = Send(m_pBuffer, numsend);
+				int numsent = Send(data, numsend);
 				if (numsent == SOCKET_ERROR) {
 					if (GetLastError() != WSAEWOULDBLOCK) {
 						EndTransfer(transfer_status_t::closed_aborted);
-						return;
 					}
-					m_nBufferPos=numread;
 					return;
 				}
-				else if ((unsigned int)numsent < numread) {
-					memmove(m_pBuffer, m_pBuffer + numsent, numread - numsent);
-					m_nBufferPos=numread-numsent;
-				}
+
+				m_pFileReader->Consume(numsent);
+				m_currentFileOffset += numsent;
 
 				if (nLimit > -1 && GetState() != aborted) {
-					m_pOwner->m_SlQuotas[download].nTransferred += numsent;
+					m_pOwner->ConsumeSpeedLimit(download, numsent);
 				}
 
 				m_pOwner->m_owner.IncSendCount(numsent);
 				m_LastActiveTime = fz::monotonic_clock::now();
 
-				//Check if there are other commands in the command queue.
-				MSG msg;
-				if (PeekMessage(&msg,0, 0, 0, PM_NOREMOVE)) {
-					TriggerEvent(FD_WRITE);
+				if (SendBudgetExhausted(budget, numsent)) {
 					return;
 				}
 			}
@@ -591,20 +703,7 @@ void CTransferSocket::OnClose(int nErrorCode)
 	}
 	if (m_bReady) {
 		if (m_nMode == TRANSFERMODE_RECEIVE) {
-			//Receive all data still waiting to be recieve
-			_int64 pos=0;
-			do {
-				if (m_hFile != INVALID_HANDLE_VALUE) {
-					pos = GetPosition64(m_hFile);
-				}
-				OnReceive(0);
-				if (m_hFile != INVALID_HANDLE_VALUE) {
-					if (pos == GetPosition64(m_hFile)) {
-						break; //Leave loop when no data was written to file
-					}
-				}
-			} while (m_hFile != INVALID_HANDLE_VALUE); //Or file was closed
-			EndTransfer(transfer_status_t::success);
+			ReceiveRemaining();
 		}
 		else {
 			EndTransfer((m_nMode == TRANSFERMODE_RECEIVE) ? transfer_status_t::success : transfer_status_t::closed_aborted);
@@ -692,7 +791,40 @@ void CTransferSocket::OnReceive(int nErrorCode)
 
 		m_LastActiveTime = fz::monotonic_clock::now();
 
+		if (!m_pFileWriter) {
+			return;
+		}
+
+		m_waitingForWriter = false;
+
+		if (m_useZlib && m_zlibStream.avail_in) {
+			// Inflate what is left over from last time before receiving more
+			if (!InflateToFile() || m_zlibStream.avail_in) {
+				return;
+			}
+		}
+
+		char *buffer = m_pBuffer;
 		int len = m_nBufSize;
+		if (!m_useZlib) {
+			// Receive directly into the writer's block
+			unsigned int space{};
+			buffer = m_pFileWriter->GetBuffer(space);
+			if (!buffer) {
+				if (m_pFileWriter->Error()) {
+					EndTransfer(transfer_status_t::err_file_write);
+				}
+				else {
+					// Continued on FTM_FILEIO once a block has been written
+					m_waitingForWriter = true;
+				}
+				return;
+			}
+			if (space < static_cast<unsigned int>(len)) {
+				len = static_cast<int>(space);
+			}
+		}
+
 		long long nLimit = -1;
 		if (obeySpeedLimit) {
 			nLimit = m_pOwner->GetSpeedLimit(upload);
@@ -705,7 +837,7 @@ void CTransferSocket::OnReceive(int nErrorCode)
 			return;
 		}
 
-		int numread = Receive(m_pBuffer, len);
+		int numread = Receive(buffer, len);
 
 		if (numread == SOCKET_ERROR) {
 			const int error = GetLastError();
@@ -719,65 +851,111 @@ void CTransferSocket::OnReceive(int nErrorCode)
 			return;
 		}
 		if (!numread) {
-			EndTransfer(transfer_status_t::success);
+			FinishUpload();
 			return;
 		}
 		m_pOwner->m_owner.IncRecvCount(numread);
 
 		if (nLimit != -1 && GetState() != aborted) {
-			m_pOwner->m_SlQuotas[upload].nTransferred += numread;
+			m_pOwner->ConsumeSpeedLimit(upload, numread);
 		}
 
 		if (m_useZlib) {
-			if (!m_pBuffer2) {
-				m_pBuffer2 = new char[m_nBufSize];
-			}
-
 			m_zlibStream.next_in = (Bytef *)m_pBuffer;
 			m_zlibStream.avail_in = numread;
-			m_zlibStream.next_out = (Bytef *)m_pBuffer2;
-			m_zlibStream.avail_out = m_nBufSize;
-
-			m_zlibStream.total_in = 0;
-			m_zlibStream.total_out = 0;
-			int res = inflate(&m_zlibStream, 0);
-			m_zlibBytesIn += m_zlibStream.total_in;
-			m_zlibBytesOut += m_zlibStream.total_out;
 
-			while (res == Z_OK) {
-				DWORD numwritten;
-				if (!WriteFile(m_hFile, m_pBuffer2, m_nBufSize - m_zlibStream.avail_out, &numwritten, 0) || numwritten != m_nBufSize - m_zlibStream.avail_out) {
-					EndTransfer(transfer_status_t::err_file_write);
-					return;
-				}
-				m_currentFileOffset += numwritten;
-
-				m_zlibStream.next_out = (Bytef *)m_pBuffer2;
-				m_zlibStream.avail_out = m_nBufSize;
-				res = inflate(&m_zlibStream, 0);
-			}
-			if (res == Z_STREAM_END) {
-				DWORD numwritten;
-				if (!WriteFile(m_hFile, m_pBuffer2, m_nBufSize - m_zlibStream.avail_out, &numwritten, 0) || numwritten != m_nBufSize - m_zlibStream.avail_out) {
-					EndTransfer(transfer_status_t::err_file_write);
-					return;
-				}
-				m_currentFileOffset += numwritten;
-			}
-			else if (res != Z_OK && res != Z_BUF_ERROR) {
-				EndTransfer(transfer_status_t::zlib);
-				return;
-			}
+			InflateToFile();
 		}
 		else {
-			DWORD numwritten;
-			if (!WriteFile(m_hFile, m_pBuffer, numread, &numwritten, 0) || numwritten!=(unsigned int)numread) {
+			m_pFileWriter->Commit(numread);
+			m_currentFileOffset += numread;
+		}
+	}
+}
+
+bool CTransferSocket::InflateToFile()
+{
+	while (true) {
+		unsigned int space{};
+		char *out = m_pFileWriter->GetBuffer(space);
+		if (!out) {
+			if (m_pFileWriter->Error()) {
 				EndTransfer(transfer_status_t::err_file_write);
-				return;
+				return false;
 			}
-			m_currentFileOffset += numwritten;
+			// Remaining input stays in m_zlibStream, continued on FTM_FILEIO
+			m_waitingForWriter = true;
+			return true;
+		}
+
+		m_zlibStream.next_out = (Bytef *)out;
+		m_zlibStream.avail_out = space;
+
+		m_zlibStream.total_in = 0;
+		m_zlibStream.total_out = 0;
+		int res = inflate(&m_zlibStream, 0);
+		m_zlibBytesIn += m_zlibStream.total_in;
+		m_zlibBytesOut += m_zlibStream.total_out;
+
+		unsigned int const written = space - m_zlibStream.avail_out;
+		m_pFileWriter->Commit(written);
+		m_currentFileOffset += written;
+
+		if (res == Z_STREAM_END) {
+			// Ignore anything following the end of the stream
+			m_zlibStream.avail_in = 0;
+			return true;
+		}
+		else if (res == Z_BUF_ERROR) {
+			// Needs more input
+			return true;
+		}
+		else if (res != Z_OK) {
+			EndTransfer(transfer_status_t::zlib);
+			return false;
+		}
+
+		if (!m_zlibStream.avail_in && m_zlibStream.avail_out) {
+			return true;
+		}
+	}
+}
+
+void CTransferSocket::ReceiveRemaining()
+{
+	while (m_pFileWriter && !m_finishingUpload) { //Or file was closed
+		__int64 const pos = m_currentFileOffset;
+		OnReceive(0);
+		if (m_waitingForWriter) {
+			// Continued on FTM_FILEIO
+			return;
+		}
+		if (pos == m_currentFileOffset) {
+			break; //Leave loop when no data was written to file
 		}
 	}
+
+	if (!m_finishingUpload) {
+		FinishUpload();
+	}
+}
+
+void CTransferSocket::FinishUpload()
+{
+	if (m_pFileWriter) {
+		m_pFileWriter->Finish();
+		if (m_pFileWriter->Error()) {
+			EndTransfer(transfer_status_t::err_file_write);
+			return;
+		}
+		if (!m_pFileWriter->Done()) {
+			// Only report success once everything has been written, continued on FTM_FILEIO
+			m_finishingUpload = true;
+			return;
+		}
+	}
+
+	EndTransfer(transfer_status_t::success);
 }
 
 void CTransferSocket::PasvTransfer()
@@ -793,34 +971,16 @@ void CTransferSocket::PasvTransfer()
 	}
 }
 
-bool CTransferSocket::IsAllowedDataConnectionIP(CStdString controlIP, CStdString dataIP, int family, COptions & options)
+bool CTransferSocket::IsAllowedDataConnectionIP(CIpAddress const& controlIP, CIpAddress const& dataIP, COptions & options)
 {
 	auto const checkDataIP = options.GetOptionVal(OPTION_CHECK_DATA_CONNECTION_IP);
-	if (checkDataIP) {
-		//Check if the IP of the remote machine is valid
-		UINT port = 0;
-
-		if (family == AF_INET6) {
-			controlIP = GetIPV6LongForm(controlIP);
-			dataIP = GetIPV6LongForm(dataIP);
-		}
-
-		if (checkDataIP == 1) {
-			if (family == AF_INET6) {
-				// Assume a /64
-				controlIP = controlIP.Left(20);
-				dataIP = dataIP.Left(20);
-			}
-			else {
-				// Assume a /24
-				controlIP = controlIP.Left(controlIP.ReverseFind('.'));
-				dataIP = dataIP.Left(dataIP.ReverseFind('.'));
-			}
-		}
-
-		if (controlIP != dataIP) {
-			return false;
-		}
+	if (checkDataIP == 1) {
+		// Assume a /24 or a /64
+		int const bits = (controlIP.GetFamily() == CIpAddress::ipv6) ? 64 : 24;
+		return controlIP.GetPrefix(bits) == dataIP.GetPrefix(bits);
+	}
+	else if (checkDataIP) {
+		return controlIP == dataIP;
 	}
 
 	return true;
@@ -829,17 +989,13 @@ bool CTransferSocket::IsAllowedDataConnectionIP(CStdString controlIP, CStdString
 BOOL CTransferSocket::InitTransfer(BOOL bCalledFromSend)
 {
 	//Check if the IP of the remote machine is valid
-	std::wstring OwnerIP, TransferIP;
+	CIpAddress TransferIP;
 	UINT port = 0;
-	if (!m_pOwner->GetPeerName(OwnerIP, port)) {
-		EndTransfer(transfer_status_t::ip_mismatch);
-		return FALSE;
-	}
 	if (!GetPeerName(TransferIP, port)) {
 		EndTransfer(transfer_status_t::ip_mismatch);
 		return FALSE;
 	}
-	if (!IsAllowedDataConnectionIP(OwnerIP, TransferIP, GetFamily(), *m_pOwner->m_owner.m_pOptions)) {
+	if (!IsAllowedDataConnectionIP(m_pOwner->m_RemoteIP, TransferIP, *m_pOwner->m_owner.m_pOptions)) {
 		EndTransfer(transfer_status_t::ip_mismatch);
 		return FALSE;
 	}
@@ -880,14 +1036,42 @@ BOOL CTransferSocket::InitTransfer(BOOL bCalledFromSend)
 		}
 		m_currentFileOffset = (((__int64)high) << 32) + low;
 
-		if (!m_pBuffer) {
+		// Plaintext uncompressed downloads can be sent straight from the file cache.
+		// Client editions of Windows only run two TransmitFile operations at a time
+		// and queue the rest, so only use it on server editions.
+		m_pTransmitFile = 0;
+		if (!m_useZlib && !m_use_tls && !m_pSslLayer && IsWindowsServer()) {
+			LARGE_INTEGER size;
+			if (GetFileSizeEx(m_hFile, &size)) {
+				m_fileSize = size.QuadPart;
+
+				GUID guid = WSAID_TRANSMITFILE;
+				DWORD outlen{};
+				if (WSAIoctl(GetSocketHandle(), SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid), &m_pTransmitFile, sizeof(m_pTransmitFile), &outlen, 0, 0)) {
+					m_pTransmitFile = 0;
+				}
+				else {
+					m_transmit = make_unique<transmit_op>(m_pOwner->m_owner, m_pOwner->m_userid);
+					if (!m_transmit->Valid()) {
+						m_transmit.reset();
+						m_pTransmitFile = 0;
+					}
+				}
+			}
+		}
+
+		if (!m_pTransmitFile) {
+			// Start reading ahead right away
+			CreateFileReader();
+		}
+
+		// Uncompressed data is sent straight from the file reader's buffers
+		if (m_useZlib && !m_pBuffer) {
 			m_pBuffer = new char[m_nBufSize];
 			m_nBufferPos = 0;
 
-			if (m_useZlib) {
-				m_zlibStream.next_out = (Bytef *)m_pBuffer;
-				m_zlibStream.avail_out = m_nBufSize;
-			}
+			m_zlibStream.next_out = (Bytef *)m_pBuffer;
+			m_zlibStream.avail_out = m_nBufSize;
 		}
 	}
 	else if (m_nMode == TRANSFERMODE_RECEIVE) {
@@ -900,7 +1084,7 @@ BOOL CTransferSocket::InitTransfer(BOOL bCalledFromSend)
 			}
 		}
 
-		if (m_hFile == INVALID_HANDLE_VALUE) {
+		if (!m_pFileWriter) {
 			ASSERT(!m_Filename.empty());
 			int shareMode = FILE_SHARE_READ;
 			if (m_pOwner->m_owner.m_pOptions->GetOptionVal(OPTION_SHAREDWRITE)) {
@@ -920,9 +1104,15 @@ BOOL CTransferSocket::InitTransfer(BOOL bCalledFromSend)
 			}
 			SetEndOfFile(m_hFile);
 			m_currentFileOffset = (((__int64)high) << 32) + low;
+
+			// Gather received data into larger blocks, written on the file I/O pool
+			m_pFileWriter = std::make_shared<CFileWriter>(m_pOwner->m_owner.GetFileIoPool(), m_hFile, m_currentFileOffset,
+				m_nBufSize * uploadBlockFactor, uploadMaxBlocks, &m_pOwner->m_owner, m_pOwner->m_userid);
+			m_hFile = INVALID_HANDLE_VALUE;
 		}
 
-		if (!m_pBuffer) {
+		// Uncompressed data is received straight into the writer's blocks
+		if (m_useZlib && !m_pBuffer) {
 			m_pBuffer = new char[m_nBufSize];
 		}
 	}
@@ -940,6 +1130,11 @@ bool CTransferSocket::CheckForTimeout(fz::monotonic_clock const& now)
 	// CheckForTimeout is called once per second. Misuse it to also trigger updating of the send buffer size.
 	UpdateSendBufferSize();
 
+	// Don't keep partial blocks of stalled uploads in memory for long
+	if (m_pFileWriter && fz::monotonic_clock::now() - m_LastActiveTime > fz::duration::from_seconds(1)) {
+		m_pFileWriter->Flush();
+	}
+
 	int64_t timeout = m_pOwner->m_owner.m_pOptions->GetOptionVal(OPTION_TIMEOUT);
 	fz::duration elapsed = fz::monotonic_clock::now() - m_LastActiveTime;
 	
@@ -1054,6 +1249,9 @@ bool CTransferSocket::GetZlibStats(_int64 &bytesIn, _int64 &bytesOut) const
 
 void CTransferSocket::EndTransfer(transfer_status_t status)
 {
+	// Cancelling a TransmitFile call needs the socket
+	AbandonTransmit();
+
 	Close();
 
 	CloseFile();
@@ -1069,6 +1267,25 @@ void CTransferSocket::EndTransfer(transfer_status_t status)
 
 void CTransferSocket::CloseFile()
 {
+	if (m_nMode == TRANSFERMODE_RECEIVE && (m_pFileWriter || m_hFile != INVALID_HANDLE_VALUE)) {
+		// Hashes computed while the upload was in progress are stale
+		m_pOwner->m_owner.InvalidateCaches(m_Filename);
+	}
+
+	if (m_pFileReader) {
+		m_pFileReader->Close();
+		m_pFileReader.reset();
+		m_readerHeld = 0;
+	}
+
+	if (m_pFileWriter) {
+		// Remaining data still gets written
+		m_pFileWriter->Close();
+		m_pFileWriter.reset();
+	}
+
+	AbandonTransmit();
+
 	if (m_hFile != INVALID_HANDLE_VALUE) {
 		if (m_nMode == TRANSFERMODE_RECEIVE) {
 			FlushFileBuffers(m_hFile);
@@ -1079,6 +1296,71 @@ void CTransferSocket::CloseFile()
 	}
 }
 
+void CTransferSocket::AbandonTransmit()
+{
+	if (m_transmit) {
+		if (m_transmitPending && transmit_op::Abandon(m_transmit, GetSocketHandle(), m_hFile)) {
+			// Still in use by the TransmitFile call, closed once it is done
+			m_hFile = INVALID_HANDLE_VALUE;
+		}
+		m_transmit.reset();
+		m_transmitPending = false;
+	}
+}
+
+bool CTransferSocket::SendBudgetExhausted(int & budget, int sent)
+{
+	budget -= sent;
+	if (budget > 0) {
+		return false;
+	}
+
+	// Requeue ourselves behind the events already pending for this thread
+	TriggerEvent(FD_WRITE);
+	return true;
+}
+
+void CTransferSocket::CreateFileReader()
+{
+	ASSERT(m_hFile != INVALID_HANDLE_VALUE);
+
+	m_pFileReader = std::make_shared<CFileReader>(m_pOwner->m_owner.GetFileIoPool(), m_hFile, m_nBufSize, &m_pOwner->m_owner, m_pOwner->m_userid);
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_readerHeld = 0;
+	m_pFileReader->Start();
+}
+
+void CTransferSocket::OnFileIo()
+{
+	if (!m_bStarted) {
+		return;
+	}
+
+	if (m_nMode == TRANSFERMODE_SEND) {
+		TriggerEvent(FD_WRITE);
+	}
+	else if (m_nMode == TRANSFERMODE_RECEIVE && m_pFileWriter) {
+		m_LastActiveTime = fz::monotonic_clock::now();
+		if (m_pFileWriter->Error()) {
+			EndTransfer(transfer_status_t::err_file_write);
+		}
+		else if (m_finishingUpload) {
+			if (m_pFileWriter->Done()) {
+				EndTransfer(transfer_status_t::success);
+			}
+		}
+		else if (GetState() == closed) {
+			// No more read notifications after the connection got closed
+			if (m_waitingForWriter) {
+				ReceiveRemaining();
+			}
+		}
+		else {
+			TriggerEvent(FD_READ);
+		}
+	}
+}
+
 bool CTransferSocket::CreateListenSocket(PortLease&& port, int family)
 {
 	portLease_ = std::move(port);
@@ -1099,3 +1381,81 @@ void CTransferSocket::UpdateSendBufferSize()
 		}
 	}
 }
+
+bool CTransferSocket::TransmitFileData(int & budget)
+{
+	while (m_hFile != INVALID_HANDLE_VALUE) {
+		if (m_transmitPending) {
+			DWORD numsent{};
+			DWORD flags{};
+			if (!WSAGetOverlappedResult(GetSocketHandle(), &m_transmit->ov, &numsent, FALSE, &flags)) {
+				if (WSAGetLastError() == WSA_IO_INCOMPLETE) {
+					// Continued on FTM_FILEIO
+					return false;
+				}
+				EndTransfer(transfer_status_t::closed_aborted);
+				return false;
+			}
+			m_transmitPending = false;
+
+			m_currentFileOffset += numsent;
+
+			long long const nLimit = m_pOwner->GetSpeedLimit(download);
+			if (nLimit > -1 && GetState() != aborted) {
+				m_pOwner->ConsumeSpeedLimit(download, numsent);
+			}
+
+			m_pOwner->m_owner.IncSendCount(numsent);
+			m_LastActiveTime = fz::monotonic_clock::now();
+
+			if (SendBudgetExhausted(budget, static_cast<int>(numsent))) {
+				return false;
+			}
+		}
+
+		__int64 remaining = m_fileSize - m_currentFileOffset;
+		if (remaining <= 0) {
+			// The file may have grown in the meantime if opened with shared write access
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(m_hFile, &size)) {
+				EndTransfer(transfer_status_t::err_file_read);
+				return false;
+			}
+			m_fileSize = size.QuadPart;
+			remaining = m_fileSize - m_currentFileOffset;
+			if (remaining <= 0) {
+				CloseFile();
+				break;
+			}
+		}
+
+		// One call per send budget. The call completes once everything has
+		// been queued, the exact number of bytes sent is known only then.
+		int numsend = budget;
+		if (numsend > remaining) {
+			numsend = static_cast<int>(remaining);
+		}
+
+		long long nLimit = m_pOwner->GetSpeedLimit(download);
+		if (nLimit > -1 && GetState() != aborted && numsend > nLimit) {
+			numsend = static_cast<int>(nLimit);
+		}
+
+		if (!numsend) {
+			return false;
+		}
+
+		// The offset is passed explicitly, the file pointer is not used
+		if (!m_pTransmitFile(GetSocketHandle(), m_hFile, numsend, 0, m_transmit->Start(m_currentFileOffset), 0, 0)) {
+			if (WSAGetLastError() != WSA_IO_PENDING) {
+				EndTransfer(transfer_status_t::closed_aborted);
+				return false;
+			}
+		}
+
+		// Even if the call completed right away, its result is collected above
+		m_transmitPending = true;
+	}
+
+	return true;
+}
@@ -29,8 +29,10 @@ class CControlSocket;
 #define TRANSFERMODE_SEND 3
 
 struct t_dirlisting;
+class CDirectoryListing;
 
 #include <zlib.h>
+#include <mswsock.h>
 
 #include <libfilezilla/time.hpp>
 
@@ -51,11 +53,13 @@ enum class transfer_status_t
 };
 
 class CAsyncSslSocketLayer;
+class CFileReader;
+class CFileWriter;
 class CTransferSocket final : public CAsyncSocketEx
 {
 public:
 	CTransferSocket(CControlSocket *pOwner);
-	void Init(std::list<t_dirlisting> &dir, int nMode);
+	void Init(std::unique_ptr<CDirectoryListing> && listing, int nMode);
 	void Init(std::wstring const& filename, int nMode, _int64 rest);
 	inline bool InitCalled() { return m_bReady; }
 	bool UseSSL(bool use);
@@ -75,10 +79,13 @@ public:
 
 	bool CreateListenSocket(PortLease&& port, int family);
 
-	static bool IsAllowedDataConnectionIP(CStdString controlIP, CStdString dataIP, int family, COptions& options);
+	static bool IsAllowedDataConnectionIP(CIpAddress const& controlIP, CIpAddress const& dataIP, COptions& options);
 
 	fz::monotonic_clock lastActive() const { return m_LastActiveTime; }
 
+	// Called by the server thread on FTM_FILEIO
+	void OnFileIo();
+
 protected:
 	virtual void OnSend(int nErrorCode);
 	virtual void OnConnect(int nErrorCode);
@@ -88,10 +95,41 @@ protected:
 
 	void UpdateSendBufferSize();
 
+	// Sends the file using overlapped TransmitFile calls, avoiding the copy through
+	// m_pBuffer. Returns false if OnSend has to return, true once the whole file has
+	// been sent.
+	bool TransmitFileData(int & budget);
+
+	// Ends use of m_transmit. A call still in progress gets cancelled and
+	// takes over m_hFile. Has to be called before the socket gets closed.
+	void AbandonTransmit();
+
+	// Deducts sent bytes from the budget of the current OnSend call. Once
+	// exhausted, re-triggers FD_WRITE and returns true, OnSend must then return.
+	bool SendBudgetExhausted(int & budget, int sent);
+
+	// Hands m_hFile over to a CFileReader which reads ahead on the file I/O pool
+	void CreateFileReader();
+
+	// Inflates m_zlibStream's input into m_pFileWriter. Returns false if the transfer got ended.
+	bool InflateToFile();
+
+	// Receives the data left after the connection got closed, then finishes the upload.
+	// Continued on FTM_FILEIO whenever the writer has no room left.
+	void ReceiveRemaining();
+
+	// Ends the upload once the writer has written everything
+	void FinishUpload();
+
+	// Refills the drained directory_listing_ with the next entries of the listing.
+	// Returns false if there is nothing left to send.
+	bool FetchDirListing();
+
 	virtual int OnLayerCallback(std::list<t_callbackMsg> const& callbacks);
 
 	void EndTransfer(transfer_status_t status);
 
+	std::unique_ptr<CDirectoryListing> dirListing_;
 	std::list<t_dirlisting> directory_listing_;
 	t_dirlisting *m_pDirListing;
 	bool m_bSentClose{};
@@ -121,6 +159,20 @@ protected:
 
 	__int64 m_currentFileOffset;
 
+	// Zero-copy sending of plaintext, uncompressed downloads
+	class transmit_op;
+	LPFN_TRANSMITFILE m_pTransmitFile{};
+	std::unique_ptr<transmit_op> m_transmit;
+	bool m_transmitPending{};
+	__int64 m_fileSize{};
+
+	std::shared_ptr<CFileReader> m_pFileReader;
+	unsigned int m_readerHeld{}; // Bytes from m_pFileReader fed into zlib but not yet consumed
+
+	std::shared_ptr<CFileWriter> m_pFileWriter;
+	bool m_waitingForWriter{};
+	bool m_finishingUpload{};
+
 	bool m_waitingForSslHandshake;
 
 	bool m_premature_send;
@@ -20,9 +20,16 @@
 #include "autobanmanager.h"
 #include "Options.h"
 
+#include <libfilezilla/time.hpp>
+
+namespace {
+// A subnet gets banned once its addresses failed this many times as often as
+// a single address may.
+int const subnetAttemptFactor = 5;
+}
+
 int CAutoBanManager::m_refCount = 0;
-std::map<CStdString, time_t> CAutoBanManager::m_banMap;
-std::map<CStdString, CAutoBanManager::t_attemptInfo> CAutoBanManager::m_attemptMap;
+CAutoBanManager::t_shard CAutoBanManager::m_shards[shardCount];
 
 std::recursive_mutex CAutoBanManager::m_mutex;
 
@@ -38,55 +45,131 @@ CAutoBanManager::~CAutoBanManager()
 	simple_lock lock(m_mutex);
 	m_refCount--;
 	if (!m_refCount) {
-		m_banMap.clear();
-		m_attemptMap.clear();
+		for (auto & shard : m_shards) {
+			std::lock_guard<std::mutex> shardLock(shard.mutex);
+			shard.entries.clear();
+			for (auto & slot : shard.wheel) {
+				slot.clear();
+			}
+		}
 	}
 }
 
-bool CAutoBanManager::IsBanned(const CStdString& ip)
+int64_t CAutoBanManager::Now()
+{
+	static fz::monotonic_clock const start = fz::monotonic_clock::now();
+	return (fz::monotonic_clock::now() - start).get_seconds();
+}
+
+CAutoBanManager::t_shard& CAutoBanManager::GetShard(t_key const& key)
+{
+	// The hash tables use the low bits, select the shard by the high ones
+	return m_shards[(t_keyHash()(key) >> (sizeof(size_t) * 8 - 8)) % shardCount];
+}
+
+CAutoBanManager::t_key CAutoBanManager::GetSubnet(CIpAddress const& address)
+{
+	t_key key;
+	key.prefix = (address.GetFamily() == CIpAddress::ipv4) ? 24 : 64;
+	key.address = address.GetPrefix(key.prefix);
+	return key;
+}
+
+void CAutoBanManager::Schedule(t_shard & shard, t_key const& key, int64_t expiry)
+{
+	// Never in the slot currently being processed or an already processed one
+	int64_t tick = expiry / 60 + 1;
+	tick = std::max(tick, shard.lastTick + 1);
+	tick = std::min(tick, shard.lastTick + wheelSize);
+	shard.wheel[tick % wheelSize].push_back(key);
+}
+
+bool CAutoBanManager::IsBanned(CIpAddress const& ip)
 {
 	bool enabled = m_pOptions->GetOptionVal(OPTION_AUTOBAN_ENABLE) != 0;
 	if (!enabled)
 		return false;
 
-	simple_lock lock(m_mutex);
-	return m_banMap.find(ip) != m_banMap.end();
+	t_key key;
+	key.address = ip;
+	if (!key.address) {
+		return false;
+	}
+
+	int64_t const banTime = m_pOptions->GetOptionVal(OPTION_AUTOBAN_BANTIME) * 60 * 60;
+	int64_t const now = Now();
+
+	if (IsBanned(key, now, banTime)) {
+		return true;
+	}
+
+	return m_pOptions->GetOptionVal(OPTION_AUTOBAN_SUBNETS) && IsBanned(GetSubnet(key.address), now, banTime);
 }
 
-bool CAutoBanManager::RegisterAttempt(const CStdString& ip)
+bool CAutoBanManager::IsBanned(t_key const& key, int64_t now, int64_t banTime)
+{
+	t_shard & shard = GetShard(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto const it = shard.entries.find(key);
+	return it != shard.entries.end() && it->second.banned && now - it->second.time <= banTime;
+}
+
+bool CAutoBanManager::RegisterAttempt(CIpAddress const& ip)
 {
 	bool enabled = m_pOptions->GetOptionVal(OPTION_AUTOBAN_ENABLE) != 0;
 	if (!enabled)
 		return false;
 
+	t_key key;
+	key.address = ip;
+	if (!key.address) {
+		return false;
+	}
+
 	const int maxAttempts = (int)m_pOptions->GetOptionVal(OPTION_AUTOBAN_ATTEMPTS);
+	const int64_t banTime = m_pOptions->GetOptionVal(OPTION_AUTOBAN_BANTIME) * 60 * 60;
+	const int64_t now = Now();
+
+	bool banned = RegisterAttempt(key, maxAttempts, now, banTime);
+	if (m_pOptions->GetOptionVal(OPTION_AUTOBAN_SUBNETS)) {
+		banned |= RegisterAttempt(GetSubnet(key.address), maxAttempts * subnetAttemptFactor, now, banTime);
+	}
+
+	return banned;
+}
+
+bool CAutoBanManager::RegisterAttempt(t_key const& key, int maxAttempts, int64_t now, int64_t banTime)
+{
 	const int banType = (int)m_pOptions->GetOptionVal(OPTION_AUTOBAN_TYPE);
 
-	simple_lock lock(m_mutex);
-	if (m_banMap.find(ip) != m_banMap.end()) {
-		return true;
+	t_shard & shard = GetShard(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto it = shard.entries.find(key);
+	if (it == shard.entries.end()) {
+		it = shard.entries.emplace(key, t_attemptInfo()).first;
+		Schedule(shard, key, now + banTime);
+	}
+	else if (now - it->second.time > banTime) {
+		// Expired but not yet purged, start over. It remains queued in the wheel.
+		it->second = t_attemptInfo();
 	}
 
-	std::map<CStdString, t_attemptInfo>::iterator iter = m_attemptMap.find(ip);
-	if (iter == m_attemptMap.end()) {
-		t_attemptInfo info;
-		info.attempts = 1;
-		info.time = time(0);
-		m_attemptMap[ip] = info;
+	t_attemptInfo & info = it->second;
+	if (info.banned) {
+		return true;
 	}
-	else {
-		if (++iter->second.attempts >= maxAttempts) {
-			m_attemptMap.erase(iter);
-
-			if (!banType)
-				m_banMap[ip] = time(0);
-			else {
-				// TODO
-			}
-			return true;
+
+	info.time = now;
+	if (++info.attempts >= maxAttempts) {
+		if (!banType) {
+			info.banned = true;
+		}
+		else {
+			// TODO
 		}
-		else
-			iter->second.time = time(0);
+		return true;
 	}
 
 	return false;
@@ -94,32 +177,36 @@ bool CAutoBanManager::RegisterAttempt(const CStdString& ip)
 
 void CAutoBanManager::PurgeOutdated()
 {
-	const int banTime = (int)m_pOptions->GetOptionVal(OPTION_AUTOBAN_BANTIME) * 60 * 60;
-
-	time_t now = time(0);
-
-	simple_lock lock(m_mutex);
-	std::map<CStdString, time_t>::iterator iter = m_banMap.begin();
-	while (iter != m_banMap.end()) {
-		const time_t diff = now - iter->second;
-		if (diff > banTime) {
-			std::map<CStdString, time_t>::iterator remove = iter++;
-			m_banMap.erase(remove);
-		}
-		else
-			iter++;
-	}
-
-	{
-		std::map<CStdString, t_attemptInfo>::iterator iter = m_attemptMap.begin();
-		while (iter != m_attemptMap.end()) {
-			const time_t diff = now - iter->second.time;
-			if (diff > banTime) {
-				std::map<CStdString, t_attemptInfo>::iterator remove = iter++;
-				m_attemptMap.erase(remove);
+	const int64_t banTime = m_pOptions->GetOptionVal(OPTION_AUTOBAN_BANTIME) * 60 * 60;
+
+	const int64_t now = Now();
+	const int64_t tick = now / 60;
+
+	std::vector<t_key> due;
+	for (auto & shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		// After a long pause every slot is due once
+		int64_t first = std::max(shard.lastTick + 1, tick - wheelSize + 1);
+		for (int64_t t = first; t <= tick; ++t) {
+			shard.lastTick = t;
+
+			due.clear();
+			due.swap(shard.wheel[t % wheelSize]);
+			for (auto const& key : due) {
+				auto const it = shard.entries.find(key);
+				if (it == shard.entries.end()) {
+					continue;
+				}
+
+				int64_t const expiry = it->second.time + banTime;
+				if (expiry < now) {
+					shard.entries.erase(it);
+				}
+				else {
+					Schedule(shard, key, expiry);
+				}
 			}
-			else
-				iter++;
 		}
 	}
 }
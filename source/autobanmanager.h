@@ -19,6 +19,26 @@
 #ifndef __AUTOBANMANAGER_H__
 #define __AUTOBANMANAGER_H__
 
+#include "iputils.h"
+
+#include <unordered_map>
+
+/*
+Failed login attempts and bans are kept in hash tables keyed by the binary
+address. The tables are split into shards, each with its own lock, so that
+attempts from different addresses do not contend.
+
+Entries expire once the ban time has passed since the last attempt or since
+the ban. Expiry is driven by a timing wheel with a slot per minute: Each entry
+is queued in the slot of the minute it expires in and PurgeOutdated only
+looks at the slots whose time has come. Entries which got refreshed or whose
+expiry lies beyond the wheel are queued again.
+
+If enabled, attempts are also counted per subnet, /24 for IPv4 and /64 for
+IPv6, so that distributed attacks from many addresses of the same network get
+banned as a whole.
+*/
+
 class COptions;
 class CAutoBanManager final
 {
@@ -29,23 +49,67 @@ public:
 
 	void PurgeOutdated();
 
-	bool IsBanned(const CStdString& ip);
+	bool IsBanned(CIpAddress const& ip);
 
 	// Returns true if address got banned
-	bool RegisterAttempt(const CStdString& ip);
+	bool RegisterAttempt(CIpAddress const& ip);
 
 protected:
 
 	static int m_refCount;
 
+	struct t_key
+	{
+		CIpAddress address;
+
+		// 0 for single addresses
+		int prefix{};
+
+		bool operator==(t_key const& rhs) const { return prefix == rhs.prefix && address == rhs.address; }
+	};
+
+	struct t_keyHash
+	{
+		size_t operator()(t_key const& key) const { return key.address.Hash() + key.prefix; }
+	};
+
 	struct t_attemptInfo
 	{
-		int attempts;
-		time_t time;
+		int attempts{};
+		bool banned{};
+
+		// Of the last attempt or of the ban, in seconds
+		int64_t time{};
+	};
+
+	static int const wheelSize = 64;
+
+	struct t_shard
+	{
+		std::mutex mutex;
+		std::unordered_map<t_key, t_attemptInfo, t_keyHash> entries;
+
+		// Keys by the minute they expire in, modulo the wheel size
+		std::vector<t_key> wheel[wheelSize];
+		int64_t lastTick{};
 	};
 
-	static std::map<CStdString, time_t> m_banMap;
-	static std::map<CStdString, t_attemptInfo> m_attemptMap;
+	static int const shardCount = 64;
+	static t_shard m_shards[shardCount];
+
+	static t_shard& GetShard(t_key const& key);
+
+	bool IsBanned(t_key const& key, int64_t now, int64_t banTime);
+
+	// Returns true if the key got banned
+	bool RegisterAttempt(t_key const& key, int maxAttempts, int64_t now, int64_t banTime);
+
+	static void Schedule(t_shard & shard, t_key const& key, int64_t expiry);
+
+	static t_key GetSubnet(CIpAddress const& address);
+
+	// Seconds on the monotonic clock
+	static int64_t Now();
 
 	static std::recursive_mutex m_mutex;
 
@@ -0,0 +1,132 @@
+#include "StdAfx.h"
+#include "command_buffer.h"
+
+#include <algorithm>
+
+namespace {
+bool IsDelimiter(char c)
+{
+	return c == '\r' || c == '\n' || !c;
+}
+
+// Returns the position of the first CR, LF or NUL, or end if there is none.
+// Checks whole words first, using the trick for finding a zero byte in a word
+// on the word itself and on the word XORed with CR and LF.
+char const* FindDelimiter(char const* p, char const* end)
+{
+	uint64_t const ones = 0x0101010101010101ull;
+	uint64_t const highs = 0x8080808080808080ull;
+
+	while (end - p >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+
+		uint64_t const cr = word ^ (ones * '\r');
+		uint64_t const lf = word ^ (ones * '\n');
+		uint64_t const found = ((word - ones) & ~word) | ((cr - ones) & ~cr) | ((lf - ones) & ~lf);
+		if (found & highs) {
+			break;
+		}
+		p += 8;
+	}
+
+	while (p != end && !IsDelimiter(*p)) {
+		++p;
+	}
+	return p;
+}
+}
+
+char* CCommandBuffer::GetWritePos(size_t & len)
+{
+	if (end_ == capacity && begin_) {
+		memmove(buffer_, buffer_ + begin_, end_ - begin_);
+		end_ -= begin_;
+		begin_ = 0;
+	}
+
+	len = capacity - end_;
+	return buffer_ + end_;
+}
+
+void CCommandBuffer::Commit(size_t len)
+{
+	ASSERT(end_ + len <= capacity);
+	end_ += len;
+}
+
+void CCommandBuffer::SkipLineStart()
+{
+	if (scanned_) {
+		// Already inside a line
+		return;
+	}
+
+	while (begin_ != end_) {
+		unsigned char const c = static_cast<unsigned char>(buffer_[begin_]);
+		if (telnetSkip_) {
+			if (c >= 240) {
+				++begin_;
+				continue;
+			}
+			telnetSkip_ = false;
+		}
+		else if (c == 255) {
+			telnetSkip_ = true;
+			++begin_;
+			continue;
+		}
+
+		if (!IsDelimiter(c)) {
+			break;
+		}
+		++begin_;
+	}
+
+	if (begin_ == end_) {
+		begin_ = 0;
+		end_ = 0;
+	}
+}
+
+bool CCommandBuffer::HasLine()
+{
+	SkipLineStart();
+
+	char const* const line = buffer_ + begin_;
+	char const* const delimiter = FindDelimiter(line + scanned_, buffer_ + end_);
+	scanned_ = delimiter - line;
+	if (delimiter != buffer_ + end_) {
+		return true;
+	}
+
+	if (scanned_ > maxLineLength) {
+		// Only the start of the line is kept, the rest is dropped as it arrives
+		end_ = begin_ + maxLineLength;
+		scanned_ = maxLineLength;
+	}
+	return false;
+}
+
+bool CCommandBuffer::GetLine(std::string_view & line)
+{
+	if (!HasLine()) {
+		return false;
+	}
+
+	line = std::string_view(buffer_ + begin_, std::min(scanned_, maxLineLength));
+	begin_ += scanned_ + 1;
+	scanned_ = 0;
+
+	// Delimiters of the line itself, e.g. the LF of CRLF, are not left behind
+	// as unprocessed data. The view stays valid as nothing gets moved.
+	SkipLineStart();
+
+	return true;
+}
+
+bool CCommandBuffer::HasData()
+{
+	SkipLineStart();
+	return begin_ != end_;
+}
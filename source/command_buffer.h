@@ -0,0 +1,66 @@
+#ifndef FILEZILLA_SERVER_COMMAND_BUFFER_HEADER
+#define FILEZILLA_SERVER_COMMAND_BUFFER_HEADER
+
+#include <string_view>
+
+/*
+Input buffer of the control connection.
+
+Data gets received directly into a fixed buffer and commands are handed out
+as views into it, without copying them into separate strings first. The end
+of a line is searched for eight bytes at a time. Consumed data is only moved
+to the front of the buffer when space runs out at its end.
+
+Lines end at CR, LF or NUL, empty lines are skipped. Telnet commands at the
+start of a line are removed. Lines longer than maxLineLength get truncated.
+
+If the buffer fills up with commands that have not been executed yet, no more
+data should be received until there is room again. This leaves the data in
+the socket buffer and eventually makes the client stop sending.
+*/
+
+class CCommandBuffer final
+{
+public:
+	CCommandBuffer() = default;
+
+	CCommandBuffer(CCommandBuffer const&) = delete;
+	CCommandBuffer& operator=(CCommandBuffer const&) = delete;
+
+	// Returns where to receive data into and sets len to the available space,
+	// zero if the buffer is full.
+	char* GetWritePos(size_t & len);
+
+	// To be called after len bytes have been written at the write position
+	void Commit(size_t len);
+
+	// Returns true if there is a complete line
+	bool HasLine();
+
+	// Removes the next complete line from the buffer. The view remains valid
+	// until the next call of a non-const member.
+	bool GetLine(std::string_view & line);
+
+	// True if there is anything left besides delimiters and telnet commands
+	bool HasData();
+
+	bool full() const { return !begin_ && end_ == capacity; }
+
+	static size_t const capacity = 4096;
+	static size_t const maxLineLength = 2000;
+
+private:
+	// Removes delimiters and telnet commands in front of the next line
+	void SkipLineStart();
+
+	char buffer_[capacity];
+	size_t begin_{};
+	size_t end_{};
+
+	// Bytes of the current line known to contain no delimiter
+	size_t scanned_{};
+
+	bool telnetSkip_{};
+};
+
+#endif
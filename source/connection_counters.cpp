@@ -0,0 +1,177 @@
+#include "StdAfx.h"
+#include "connection_counters.h"
+
+#include <libfilezilla/time.hpp>
+
+#include <algorithm>
+
+namespace {
+// Ids wrap around to 1 when reaching this value
+uint64_t const idMax = 1000000000;
+
+// The anti-hammer value of an address drops by one every half hour, down to
+// zero, and is capped at this value
+int64_t const decayInterval = 1800;
+int const maxHammerValue = 20;
+}
+
+int CUserIdAllocator::Allocate()
+{
+	// Reserve a slot first, this guarantees that the search below finds a free one
+	if (count_.fetch_add(1) >= static_cast<int>(slotCount)) {
+		--count_;
+		return -1;
+	}
+
+	while (true) {
+		int const id = static_cast<int>(next_.fetch_add(1) % (idMax - 1) + 1);
+
+		size_t const slot = id % slotCount;
+		uint64_t const bit = uint64_t(1) << (slot % 64);
+		if (!(slots_[slot / 64].fetch_or(bit) & bit)) {
+			return id;
+		}
+	}
+}
+
+void CUserIdAllocator::Release(int id)
+{
+	size_t const slot = id % slotCount;
+	uint64_t const bit = uint64_t(1) << (slot % 64);
+
+	uint64_t const old = slots_[slot / 64].fetch_and(~bit);
+	ASSERT(old & bit);
+	if (old & bit) {
+		--count_;
+	}
+}
+
+int64_t CPeerCounters::Now()
+{
+	static fz::monotonic_clock const start = fz::monotonic_clock::now();
+	return (fz::monotonic_clock::now() - start).get_seconds();
+}
+
+CPeerCounters::t_shard& CPeerCounters::GetShard(CIpAddress const& ip)
+{
+	// The hash tables use the low bits, select the shard by the high ones
+	return shards_[(ip.Hash() >> (sizeof(size_t) * 8 - 8)) % shardCount];
+}
+
+std::unordered_map<CIpAddress, CPeerCounters::t_entry>::iterator CPeerCounters::Find(t_shard & shard, CIpAddress const& ip, int64_t now)
+{
+	auto it = shard.entries.find(ip);
+	if (it == shard.entries.end()) {
+		return it;
+	}
+
+	t_entry & entry = it->second;
+	int64_t const intervals = (now - entry.decayed) / decayInterval;
+	if (intervals) {
+		entry.hammer = static_cast<int>(std::max<int64_t>(entry.hammer - intervals, 0));
+		entry.decayed += intervals * decayInterval;
+	}
+	if (!entry.hammer) {
+		// Nothing to decay, the next increase starts a full interval
+		entry.decayed = now;
+	}
+
+	if (!entry.hammer && !entry.connections) {
+		shard.entries.erase(it);
+		return shard.entries.end();
+	}
+
+	return it;
+}
+
+CPeerCounters::t_entry& CPeerCounters::Insert(t_shard & shard, CIpAddress const& ip, int64_t now)
+{
+	if (shard.entries.size() >= maxShardEntries) {
+		// Forget the address with the lowest anti-hammer value. Addresses with
+		// connections have to stay.
+		auto victim = shard.entries.end();
+		for (auto it = shard.entries.begin(); it != shard.entries.end(); ++it) {
+			if (!it->second.connections && (victim == shard.entries.end() || it->second.hammer < victim->second.hammer)) {
+				victim = it;
+			}
+		}
+		if (victim != shard.entries.end()) {
+			shard.entries.erase(victim);
+		}
+	}
+
+	t_entry & entry = shard.entries[ip];
+	entry.decayed = now;
+	return entry;
+}
+
+int CPeerCounters::GetConnections(CIpAddress const& ip)
+{
+	t_shard & shard = GetShard(ip);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto const it = Find(shard, ip, Now());
+	return it != shard.entries.end() ? it->second.connections : 0;
+}
+
+void CPeerCounters::IncConnections(CIpAddress const& ip)
+{
+	t_shard & shard = GetShard(ip);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	int64_t const now = Now();
+	auto const it = Find(shard, ip, now);
+	t_entry & entry = (it != shard.entries.end()) ? it->second : Insert(shard, ip, now);
+	++entry.connections;
+}
+
+void CPeerCounters::DecConnections(CIpAddress const& ip)
+{
+	t_shard & shard = GetShard(ip);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto const it = shard.entries.find(ip);
+	ASSERT(it != shard.entries.end() && it->second.connections > 0);
+	if (it != shard.entries.end() && it->second.connections > 0) {
+		--it->second.connections;
+
+		// Drops the entry if nothing is left
+		Find(shard, ip, Now());
+	}
+}
+
+int CPeerCounters::GetHammerValue(CIpAddress const& ip)
+{
+	t_shard & shard = GetShard(ip);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto const it = Find(shard, ip, Now());
+	return it != shard.entries.end() ? it->second.hammer : 0;
+}
+
+void CPeerCounters::IncHammerValue(CIpAddress const& ip)
+{
+	t_shard & shard = GetShard(ip);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	int64_t const now = Now();
+	auto const it = Find(shard, ip, now);
+	t_entry & entry = (it != shard.entries.end()) ? it->second : Insert(shard, ip, now);
+	if (entry.hammer < maxHammerValue) {
+		++entry.hammer;
+	}
+}
+
+void CPeerCounters::DecHammerValue(CIpAddress const& ip)
+{
+	t_shard & shard = GetShard(ip);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto const it = Find(shard, ip, Now());
+	if (it != shard.entries.end() && it->second.hammer > 0) {
+		--it->second.hammer;
+
+		// Drops the entry if nothing is left
+		Find(shard, ip, Now());
+	}
+}
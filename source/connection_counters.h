@@ -0,0 +1,100 @@
+#ifndef FILEZILLA_SERVER_CONNECTION_COUNTERS_HEADER
+#define FILEZILLA_SERVER_CONNECTION_COUNTERS_HEADER
+
+#include "iputils.h"
+
+#include <atomic>
+#include <unordered_map>
+
+/*
+Bookkeeping shared by all server threads, kept such that accepting a
+connection on one thread does not serialize with the others.
+
+CUserIdAllocator hands out user ids from an ever increasing counter. Ids in
+use are tracked in a bitmap indexed by the id modulo its size: Claiming an id
+is a single atomic operation on its bit and ids whose bit is taken by a
+long-lived connection get skipped, so no two connections ever share an id.
+
+CPeerCounters keeps the number of logged on connections and the anti-hammer
+value per peer address in hash tables split into shards, each with its own
+lock. Instead of a periodic sweep over all addresses, anti-hammer values decay
+lazily whenever their entry gets accessed. Entries without connections whose
+value decayed to zero are dropped at that point.
+*/
+
+class CUserIdAllocator final
+{
+public:
+	CUserIdAllocator() = default;
+
+	CUserIdAllocator(CUserIdAllocator const&) = delete;
+	CUserIdAllocator& operator=(CUserIdAllocator const&) = delete;
+
+	// Returns -1 if there are no free ids left
+	int Allocate();
+	void Release(int id);
+
+	// Number of ids currently in use
+	int GetCount() const { return count_; }
+
+	// Upper bound for the number of connections
+	static size_t const slotCount = 1024 * 1024;
+
+private:
+	std::atomic<uint64_t> next_{};
+	std::atomic<int> count_{};
+	std::atomic<uint64_t> slots_[slotCount / 64]{};
+};
+
+class CPeerCounters final
+{
+public:
+	CPeerCounters() = default;
+
+	CPeerCounters(CPeerCounters const&) = delete;
+	CPeerCounters& operator=(CPeerCounters const&) = delete;
+
+	int GetConnections(CIpAddress const& ip);
+	void IncConnections(CIpAddress const& ip);
+	void DecConnections(CIpAddress const& ip);
+
+	int GetHammerValue(CIpAddress const& ip);
+	void IncHammerValue(CIpAddress const& ip);
+	void DecHammerValue(CIpAddress const& ip);
+
+private:
+	struct t_entry
+	{
+		int connections{};
+		int hammer{};
+
+		// Start of the current decay interval
+		int64_t decayed{};
+	};
+
+	struct t_shard
+	{
+		std::mutex mutex;
+		std::unordered_map<CIpAddress, t_entry> entries;
+	};
+
+	static int const shardCount = 64;
+
+	// Bounds the number of addresses tracked only for their anti-hammer value
+	static size_t const maxShardEntries = 64;
+
+	t_shard& GetShard(CIpAddress const& ip);
+
+	// Looks up the entry and applies pending decay. Returns entries.end() if
+	// there is no entry or if it got dropped.
+	static std::unordered_map<CIpAddress, t_entry>::iterator Find(t_shard & shard, CIpAddress const& ip, int64_t now);
+
+	static t_entry& Insert(t_shard & shard, CIpAddress const& ip, int64_t now);
+
+	// Seconds on the monotonic clock
+	static int64_t Now();
+
+	t_shard shards_[shardCount];
+};
+
+#endif
@@ -0,0 +1,378 @@
+#include "StdAfx.h"
+#include "file_io.h"
+#include "ServerThread.h"
+
+class CFileIoPool::worker final : protected fz::thread
+{
+public:
+	explicit worker(CFileIoPool& pool)
+		: pool_(pool)
+	{
+		run();
+	}
+
+	virtual ~worker()
+	{
+		join();
+	}
+
+private:
+	virtual void entry()
+	{
+		std::shared_ptr<CFileIoJob> job;
+		while (pool_.GetJob(job)) {
+			job->Process();
+			job.reset();
+		}
+	}
+
+	CFileIoPool& pool_;
+};
+
+CFileIoPool::CFileIoPool(int threads)
+{
+	if (threads < 1) {
+		threads = 1;
+	}
+	for (int i = 0; i < threads; ++i) {
+		workers_.push_back(make_unique<worker>(*this));
+	}
+}
+
+CFileIoPool::~CFileIoPool()
+{
+	{
+		fz::scoped_lock lock(mutex_);
+		quit_ = true;
+		cond_.signal(lock);
+	}
+
+	// Joins the workers
+	workers_.clear();
+	jobs_.clear();
+}
+
+void CFileIoPool::Queue(std::shared_ptr<CFileIoJob> const& job)
+{
+	fz::scoped_lock lock(mutex_);
+	jobs_.push_back(job);
+	cond_.signal(lock);
+}
+
+bool CFileIoPool::GetJob(std::shared_ptr<CFileIoJob>& job)
+{
+	fz::scoped_lock lock(mutex_);
+	while (!quit_ && jobs_.empty()) {
+		cond_.wait(lock);
+	}
+	if (quit_) {
+		// Wake up the next worker so that it can quit as well
+		cond_.signal(lock);
+		return false;
+	}
+
+	job = std::move(jobs_.front());
+	jobs_.pop_front();
+
+	if (!jobs_.empty()) {
+		cond_.signal(lock);
+	}
+
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CFileReader
+
+CFileReader::CFileReader(CFileIoPool& pool, HANDLE file, unsigned int bufferSize, CServerThread* owner, int userid)
+	: pool_(pool)
+	, file_(file)
+	, bufferSize_(bufferSize)
+	, owner_(owner)
+	, userid_(userid)
+{
+}
+
+CFileReader::~CFileReader()
+{
+	if (file_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(file_);
+	}
+}
+
+void CFileReader::Start()
+{
+	fz::scoped_lock lock(mutex_);
+	QueueIfNeeded();
+}
+
+void CFileReader::QueueIfNeeded()
+{
+	if (queued_ || !owner_ || eof_ || error_) {
+		return;
+	}
+	if (buffers_[fillIndex_].ready) {
+		return;
+	}
+
+	queued_ = true;
+	pool_.Queue(shared_from_this());
+}
+
+CFileReader::status CFileReader::Get(char const*& data, unsigned int& len)
+{
+	fz::scoped_lock lock(mutex_);
+
+	buffer const& b = buffers_[readIndex_];
+	if (b.ready) {
+		data = b.data.get() + b.pos;
+		len = b.len - b.pos;
+		return status::data;
+	}
+	if (error_) {
+		return status::error;
+	}
+	if (eof_) {
+		return status::eof;
+	}
+
+	waiting_ = true;
+	QueueIfNeeded();
+	return status::pending;
+}
+
+void CFileReader::Consume(unsigned int len)
+{
+	fz::scoped_lock lock(mutex_);
+
+	buffer& b = buffers_[readIndex_];
+	ASSERT(b.ready);
+	b.pos += len;
+	ASSERT(b.pos <= b.len);
+	if (b.pos >= b.len) {
+		b.ready = false;
+		readIndex_ = (readIndex_ + 1) % (sizeof(buffers_) / sizeof(buffers_[0]));
+		QueueIfNeeded();
+	}
+}
+
+void CFileReader::Close()
+{
+	fz::scoped_lock lock(mutex_);
+	owner_ = 0;
+}
+
+void CFileReader::Process()
+{
+	fz::scoped_lock lock(mutex_);
+
+	while (owner_ && !eof_ && !error_ && !buffers_[fillIndex_].ready) {
+		buffer& b = buffers_[fillIndex_];
+		if (!b.data) {
+			b.data.reset(new char[bufferSize_]);
+		}
+
+		// The socket does not touch buffers that are not ready, no need to hold the lock
+		lock.unlock();
+		DWORD numread = 0;
+		BOOL const res = ReadFile(file_, b.data.get(), bufferSize_, &numread, 0);
+		lock.lock();
+
+		if (!res) {
+			error_ = true;
+		}
+		else if (!numread) {
+			eof_ = true;
+		}
+		else {
+			b.len = numread;
+			b.pos = 0;
+			b.ready = true;
+			fillIndex_ = (fillIndex_ + 1) % (sizeof(buffers_) / sizeof(buffers_[0]));
+		}
+
+		if (waiting_ && owner_) {
+			waiting_ = false;
+			owner_->PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_FILEIO, userid_);
+		}
+	}
+
+	queued_ = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// CFileWriter
+
+CFileWriter::CFileWriter(CFileIoPool& pool, HANDLE file, __int64 offset, unsigned int blockSize, unsigned int maxBlocks, CServerThread* owner, int userid)
+	: pool_(pool)
+	, file_(file)
+	, blockSize_(blockSize)
+	, maxBlocks_(maxBlocks ? maxBlocks : 1)
+	, offset_(offset)
+	, owner_(owner)
+	, userid_(userid)
+{
+}
+
+CFileWriter::~CFileWriter()
+{
+	if (file_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(file_);
+	}
+}
+
+char* CFileWriter::GetBuffer(unsigned int& len)
+{
+	fz::scoped_lock lock(mutex_);
+
+	if (!current_.data) {
+		if (error_) {
+			return 0;
+		}
+		if (pending_.size() >= maxBlocks_) {
+			waiting_ = true;
+			return 0;
+		}
+
+		if (!free_.empty()) {
+			current_.data = std::move(free_.back());
+			free_.pop_back();
+		}
+		else {
+			current_.data.reset(new char[blockSize_]);
+		}
+
+		// Ends on the next block boundary
+		current_.capacity = blockSize_ - static_cast<unsigned int>(offset_ % blockSize_);
+		current_.len = 0;
+	}
+	else if (error_) {
+		return 0;
+	}
+
+	len = current_.capacity - current_.len;
+	return current_.data.get() + current_.len;
+}
+
+void CFileWriter::Commit(unsigned int len)
+{
+	fz::scoped_lock lock(mutex_);
+
+	ASSERT(current_.data);
+	current_.len += len;
+	offset_ += len;
+	ASSERT(current_.len <= current_.capacity);
+	if (current_.len >= current_.capacity) {
+		QueueCurrent();
+	}
+}
+
+void CFileWriter::Flush()
+{
+	fz::scoped_lock lock(mutex_);
+	if (current_.len) {
+		QueueCurrent();
+	}
+}
+
+void CFileWriter::Finish()
+{
+	fz::scoped_lock lock(mutex_);
+	if (current_.len) {
+		QueueCurrent();
+	}
+	finish_ = true;
+	QueueIfNeeded();
+}
+
+bool CFileWriter::Done()
+{
+	fz::scoped_lock lock(mutex_);
+	return done_;
+}
+
+bool CFileWriter::Error()
+{
+	fz::scoped_lock lock(mutex_);
+	return error_;
+}
+
+void CFileWriter::Close()
+{
+	fz::scoped_lock lock(mutex_);
+	owner_ = 0;
+	if (current_.len) {
+		QueueCurrent();
+	}
+	finish_ = true;
+	QueueIfNeeded();
+}
+
+void CFileWriter::QueueCurrent()
+{
+	pending_.push_back(std::move(current_));
+	current_ = block();
+	QueueIfNeeded();
+}
+
+void CFileWriter::QueueIfNeeded()
+{
+	if (queued_ || done_) {
+		return;
+	}
+	if (pending_.empty() && !finish_) {
+		return;
+	}
+
+	queued_ = true;
+	pool_.Queue(shared_from_this());
+}
+
+void CFileWriter::Process()
+{
+	fz::scoped_lock lock(mutex_);
+
+	bool notify = false;
+	while (!pending_.empty() && !error_) {
+		// Only the socket's current block and the end of the queue get touched
+		// by the socket, no need to hold the lock while writing.
+		block& b = pending_.front();
+		lock.unlock();
+		DWORD numwritten = 0;
+		bool const res = WriteFile(file_, b.data.get(), b.len, &numwritten, 0) && numwritten == b.len;
+		lock.lock();
+
+		if (!res) {
+			error_ = true;
+			notify = true;
+		}
+
+		free_.push_back(std::move(b.data));
+		pending_.pop_front();
+
+		if (waiting_) {
+			waiting_ = false;
+			notify = true;
+		}
+	}
+
+	if (error_) {
+		pending_.clear();
+	}
+
+	if (finish_ && pending_.empty() && !done_) {
+		if (!error_) {
+			FlushFileBuffers(file_);
+		}
+		CloseHandle(file_);
+		file_ = INVALID_HANDLE_VALUE;
+		done_ = true;
+		notify = true;
+	}
+
+	if (notify && owner_) {
+		owner_->PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_FILEIO, userid_);
+	}
+
+	queued_ = false;
+}
@@ -0,0 +1,187 @@
+#ifndef FILEZILLA_SERVER_FILE_IO_HEADER
+#define FILEZILLA_SERVER_FILE_IO_HEADER
+
+#include <libfilezilla/thread.hpp>
+#include <libfilezilla/mutex.hpp>
+
+#include <deque>
+
+/*
+Blocking file I/O, in particular on slow disks or network shares, must not
+happen on the server threads, otherwise all other sessions served by the same
+thread stall with it.
+
+CFileIoPool is a small pool of worker threads. Transfers hand their file to a
+job which is queued to the pool whenever it has work to do. Once a job made
+progress the server thread owning the transfer gets notified with FTM_FILEIO.
+*/
+
+class CServerThread;
+
+class CFileIoJob
+{
+public:
+	virtual ~CFileIoJob() = default;
+
+	// Called on one of the worker threads. A job is never processed by more
+	// than one worker at the same time as it is only queued once.
+	virtual void Process() = 0;
+};
+
+class CFileIoPool final
+{
+public:
+	explicit CFileIoPool(int threads);
+	~CFileIoPool();
+
+	void Queue(std::shared_ptr<CFileIoJob> const& job);
+
+private:
+	class worker;
+
+	// Blocks until a job is available. Returns false once the pool is shut down.
+	bool GetJob(std::shared_ptr<CFileIoJob>& job);
+
+	fz::mutex mutex_{false};
+	fz::condition cond_;
+
+	std::deque<std::shared_ptr<CFileIoJob>> jobs_;
+	std::vector<std::unique_ptr<worker>> workers_;
+
+	bool quit_{};
+};
+
+// Reads a file ahead of the transfer socket into a small ring of buffers.
+// Takes ownership of the file handle.
+class CFileReader final : public CFileIoJob, public std::enable_shared_from_this<CFileReader>
+{
+public:
+	enum class status
+	{
+		data,
+		pending,
+		eof,
+		error
+	};
+
+	CFileReader(CFileIoPool& pool, HANDLE file, unsigned int bufferSize, CServerThread* owner, int userid);
+	virtual ~CFileReader();
+
+	// Starts filling the buffers.
+	void Start();
+
+	// Returns the unconsumed data of the oldest filled buffer. Returns pending
+	// if no data has been read yet, FTM_FILEIO gets posted once there is.
+	// The data stays valid until it has been consumed.
+	status Get(char const*& data, unsigned int& len);
+
+	// Releases len bytes returned by Get.
+	void Consume(unsigned int len);
+
+	// Detaches the reader from its owner, no further notifications are sent.
+	void Close();
+
+	virtual void Process();
+
+private:
+	void QueueIfNeeded();
+
+	struct buffer
+	{
+		std::unique_ptr<char[]> data;
+		unsigned int len{};
+		unsigned int pos{};
+		bool ready{};
+	};
+
+	fz::mutex mutex_{false};
+
+	CFileIoPool& pool_;
+	HANDLE file_;
+	unsigned int const bufferSize_;
+
+	CServerThread* owner_;
+	int const userid_;
+
+	// Double-buffered: The worker fills one while the socket drains the other.
+	buffer buffers_[2];
+	unsigned int readIndex_{};
+	unsigned int fillIndex_{};
+
+	bool queued_{};
+	bool waiting_{};
+	bool eof_{};
+	bool error_{};
+};
+
+// Write-behind sink for uploads. Received data is gathered into large blocks
+// which are written on the pool. Takes ownership of the file handle.
+//
+// Blocks get written once they are full, on Flush and on Finish. Blocks end
+// on multiples of the block size relative to the start of the file, a block
+// following a partial one written by Flush is shortened accordingly.
+class CFileWriter final : public CFileIoJob, public std::enable_shared_from_this<CFileWriter>
+{
+public:
+	CFileWriter(CFileIoPool& pool, HANDLE file, __int64 offset, unsigned int blockSize, unsigned int maxBlocks, CServerThread* owner, int userid);
+	virtual ~CFileWriter();
+
+	// Returns the free space of the block currently being filled. If maxBlocks
+	// are already waiting to be written, returns 0 and posts FTM_FILEIO once
+	// there is room again. Also returns 0 after a write error.
+	char* GetBuffer(unsigned int& len);
+
+	// Appends len bytes written to the buffer returned by GetBuffer.
+	void Commit(unsigned int len);
+
+	// Queues the partially filled block for writing.
+	void Flush();
+
+	// Writes all remaining data, flushes and closes the file.
+	// FTM_FILEIO gets posted once done.
+	void Finish();
+
+	bool Done();
+	bool Error();
+
+	// Detaches the writer from its owner. Remaining data still gets written.
+	void Close();
+
+	virtual void Process();
+
+private:
+	struct block
+	{
+		std::unique_ptr<char[]> data;
+		unsigned int capacity{};
+		unsigned int len{};
+	};
+
+	void QueueCurrent();
+	void QueueIfNeeded();
+
+	fz::mutex mutex_{false};
+
+	CFileIoPool& pool_;
+	HANDLE file_;
+	unsigned int const blockSize_;
+	unsigned int const maxBlocks_;
+
+	// File offset following the committed data
+	__int64 offset_;
+
+	CServerThread* owner_;
+	int const userid_;
+
+	block current_;
+	std::deque<block> pending_;
+	std::vector<std::unique_ptr<char[]>> free_;
+
+	bool queued_{};
+	bool waiting_{};
+	bool finish_{};
+	bool done_{};
+	bool error_{};
+};
+
+#endif
@@ -17,6 +17,23 @@ typedef struct {
 
 #define BLKSIZE 128
 
+#ifdef SHA512_STANDALONE
+/*
+ * uint64 is a native 64-bit type in the standalone build, all
+ * operations map directly onto it.
+ */
+#define add(r,x,y) ( r = x + y )
+#define rorB(r,x,y) ( r = (x >> (y)) | (x << (64-(y))) )
+#define rorL(r,x,y) rorB(r,x,y)
+#define shrB(r,x,y) ( r = x >> (y) )
+#define shrL(r,x,y) shrB(r,x,y)
+#define putty_and(r,x,y) ( r = x & y )
+#define putty_xor(r,x,y) ( r = x ^ y )
+#define putty_not(r,x) ( r = ~x )
+#define INIT(h,l) ( ((uint64)(h) << 32) | (l) )
+#define BUILD(r,h,l) ( r = ((uint64)(h) << 32) | (l) )
+#define EXTRACT(h,l,r) ( h = (uint32)(r >> 32), l = (uint32)(r) )
+#else
 /*
  * Arithmetic implementations. Note that AND, XOR and NOT can
  * overlap destination with one source, but the others can't.
@@ -36,6 +53,7 @@ typedef struct {
 #define INIT(h,l) { h, l }
 #define BUILD(r,h,l) ( r.hi = h, r.lo = l )
 #define EXTRACT(h,l,r) ( h = r.hi, l = r.lo )
+#endif
 
 /* ----------------------------------------------------------------------
  * Core SHA512 algorithm: processes 16-doubleword blocks into a
@@ -184,9 +202,28 @@ void SHA512_Init(SHA512_State *s) {
 	s->len[i] = 0;
 }
 
+static void SHA512_Block_Bytes(SHA512_State *s, const unsigned char *p) {
+    uint64 wordblock[16];
+    int i;
+
+    /* Gather bytes big-endian into words */
+    for (i = 0; i < 16; i++) {
+	uint32 h, l;
+        h = ( ((uint32)p[i*8+0]) << 24 ) |
+            ( ((uint32)p[i*8+1]) << 16 ) |
+            ( ((uint32)p[i*8+2]) <<  8 ) |
+            ( ((uint32)p[i*8+3]) <<  0 );
+        l = ( ((uint32)p[i*8+4]) << 24 ) |
+            ( ((uint32)p[i*8+5]) << 16 ) |
+            ( ((uint32)p[i*8+6]) <<  8 ) |
+            ( ((uint32)p[i*8+7]) <<  0 );
+	BUILD(wordblock[i], h, l);
+    }
+    SHA512_Block(s, wordblock);
+}
+
 void SHA512_Bytes(SHA512_State *s, const void *p, int len) {
     unsigned char *q = (unsigned char *)p;
-    uint64 wordblock[16];
     uint32 lenw = len;
     int i;
 
@@ -208,26 +245,19 @@ void SHA512_Bytes(SHA512_State *s, const void *p, int len) {
         /*
          * We must complete and process at least one block.
          */
-        while (s->blkused + len >= BLKSIZE) {
+        if (s->blkused) {
             memcpy(s->block + s->blkused, q, BLKSIZE - s->blkused);
             q += BLKSIZE - s->blkused;
             len -= BLKSIZE - s->blkused;
-            /* Now process the block. Gather bytes big-endian into words */
-            for (i = 0; i < 16; i++) {
-		uint32 h, l;
-                h = ( ((uint32)s->block[i*8+0]) << 24 ) |
-                    ( ((uint32)s->block[i*8+1]) << 16 ) |
-                    ( ((uint32)s->block[i*8+2]) <<  8 ) |
-                    ( ((uint32)s->block[i*8+3]) <<  0 );
-                l = ( ((uint32)s->block[i*8+4]) << 24 ) |
-                    ( ((uint32)s->block[i*8+5]) << 16 ) |
-                    ( ((uint32)s->block[i*8+6]) <<  8 ) |
-                    ( ((uint32)s->block[i*8+7]) <<  0 );
-		BUILD(wordblock[i], h, l);
-            }
-            SHA512_Block(s, wordblock);
+            SHA512_Block_Bytes(s, s->block);
             s->blkused = 0;
         }
+        /* Full blocks are processed straight from the input */
+        while (len >= BLKSIZE) {
+            SHA512_Block_Bytes(s, q);
+            q += BLKSIZE;
+            len -= BLKSIZE;
+        }
         memcpy(s->block, q, len);
         s->blkused = len;
     }
@@ -95,6 +95,164 @@ void SHATransform(word32 * digest, word32 * block)
     digest[4] += e;
 }
 
+/* ----------------------------------------------------------------------
+ * SHA-1 using the x86 SHA extensions, if the CPU has them. The
+ * scalar transform above is used otherwise.
+ */
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SHA_NI_SUPPORTED
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA_NI_FUNC
+#else
+#include <cpuid.h>
+#define SHA_NI_FUNC __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+#include <immintrin.h>
+
+static int SHA_NI_Detect(void)
+{
+    unsigned int regs[4];
+#ifdef _MSC_VER
+    __cpuid((int *)regs, 0);
+    if (regs[0] < 7)
+	return 0;
+    __cpuid((int *)regs, 1);
+#else
+    if (__get_cpuid_max(0, 0) < 7)
+	return 0;
+    __cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    /* SSSE3 and SSE4.1 */
+    if (!(regs[2] & (1 << 9)) || !(regs[2] & (1 << 19)))
+	return 0;
+#ifdef _MSC_VER
+    __cpuidex((int *)regs, 7, 0);
+#else
+    __cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    /* SHA */
+    return (regs[1] & (1 << 29)) != 0;
+}
+
+static int SHA_NI_Available(void)
+{
+    static const int available = SHA_NI_Detect();
+    return available;
+}
+
+/*
+ * Four rounds with message schedule. m0 holds the words of the
+ * current rounds, m1 to m3 are the following ones in order.
+ */
+#define SHA_NI_ROUNDS(e, eo, m0, m1, m2, m3, f) \
+    e = _mm_sha1nexte_epu32(e, m0); \
+    eo = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0)
+
+SHA_NI_FUNC
+static void SHA_NI_Blocks(uint32 h[5], const unsigned char *p, int blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_loadu_si128((const __m128i *)h);
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    e0 = _mm_set_epi32((int)h[4], 0, 0, 0);
+
+    while (blocks--) {
+	abcd_save = abcd;
+	e0_save = e0;
+
+	/* Rounds 0-3 */
+	msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 0)), mask);
+	e0 = _mm_add_epi32(e0, msg0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+	/* Rounds 4-7 */
+	msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), mask);
+	e1 = _mm_sha1nexte_epu32(e1, msg1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+	/* Rounds 8-11 */
+	msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), mask);
+	e0 = _mm_sha1nexte_epu32(e0, msg2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+	msg0 = _mm_xor_si128(msg0, msg2);
+
+	/* Rounds 12-79 */
+	msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), mask);
+	SHA_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 0);
+	SHA_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 0);
+	SHA_NI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1);
+	SHA_NI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 1);
+	SHA_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 1);
+	SHA_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 1);
+	SHA_NI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1);
+	SHA_NI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2);
+	SHA_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 2);
+	SHA_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 2);
+	SHA_NI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 2);
+	SHA_NI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2);
+	SHA_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 3);
+	SHA_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 3);
+	SHA_NI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 3);
+	SHA_NI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 3);
+	SHA_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 3);
+
+	/* Combine state */
+	e0 = _mm_sha1nexte_epu32(e0, e0_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+
+	p += 64;
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i *)h, abcd);
+    h[4] = (uint32)_mm_extract_epi32(e0, 3);
+}
+#endif
+
+/*
+ * Processes complete 64-byte blocks straight from the input.
+ */
+static void SHA_Blocks(uint32 h[5], const unsigned char *p, int blocks)
+{
+    uint32 wordblock[16];
+    int i;
+
+#ifdef SHA_NI_SUPPORTED
+    if (SHA_NI_Available()) {
+	SHA_NI_Blocks(h, p, blocks);
+	return;
+    }
+#endif
+
+    while (blocks--) {
+	/* Gather bytes big-endian into words */
+	for (i = 0; i < 16; i++) {
+	    wordblock[i] =
+		(((uint32) p[i * 4 + 0]) << 24) |
+		(((uint32) p[i * 4 + 1]) << 16) |
+		(((uint32) p[i * 4 + 2]) << 8) |
+		(((uint32) p[i * 4 + 3]) << 0);
+	}
+	SHATransform(h, wordblock);
+	p += 64;
+    }
+}
+
 /* ----------------------------------------------------------------------
  * Outer SHA algorithm: take an arbitrary length byte string,
  * convert it into 16-word blocks with the prescribed padding at
@@ -111,9 +269,7 @@ void SHA_Init(SHA_State * s)
 void SHA_Bytes(SHA_State * s, void *p, int len)
 {
     unsigned char *q = (unsigned char *) p;
-    uint32 wordblock[16];
     uint32 lenw = len;
-    int i;
 
     /*
      * Update the length field.
@@ -131,21 +287,19 @@ void SHA_Bytes(SHA_State * s, void *p, int len)
 	/*
 	 * We must complete and process at least one block.
 	 */
-	while (s->blkused + len >= 64) {
+	if (s->blkused) {
 	    memcpy(s->block + s->blkused, q, 64 - s->blkused);
 	    q += 64 - s->blkused;
 	    len -= 64 - s->blkused;
-	    /* Now process the block. Gather bytes big-endian into words */
-	    for (i = 0; i < 16; i++) {
-		wordblock[i] =
-		    (((uint32) s->block[i * 4 + 0]) << 24) |
-		    (((uint32) s->block[i * 4 + 1]) << 16) |
-		    (((uint32) s->block[i * 4 + 2]) << 8) |
-		    (((uint32) s->block[i * 4 + 3]) << 0);
-	    }
-	    SHATransform(s->h, wordblock);
+	    SHA_Blocks(s->h, s->block, 1);
 	    s->blkused = 0;
 	}
+	/* Full blocks are processed straight from the input */
+	if (len >= 64) {
+	    SHA_Blocks(s->h, q, len / 64);
+	    q += len & ~63;
+	    len &= 63;
+	}
 	memcpy(s->block, q, len);
 	s->blkused = len;
     }
@@ -420,4 +574,65 @@ const struct ssh_mac ssh_hmac_sha1_96_buggy = {
     12,
     "bug-compatible HMAC-SHA1-96"
 };
-#endif
\ No newline at end of file
+#endif
+#ifdef TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+int main(void) {
+    unsigned char digest[20];
+    int i, j, errors;
+
+    struct {
+	const char *teststring;
+	unsigned char digest[20];
+    } tests[] = {
+	{ "abc", {
+	    0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+	    0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d,
+	} },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", {
+	    0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e, 0xba, 0xae,
+	    0x4a, 0xa1, 0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70, 0xf1,
+	} },
+	{ NULL, {
+	    0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+	    0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f,
+	} },
+    };
+
+    errors = 0;
+
+    for (i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+	if (tests[i].teststring) {
+	    SHA_Simple((void *)tests[i].teststring,
+		       strlen(tests[i].teststring), digest);
+	} else {
+	    SHA_State s;
+	    int n;
+	    SHA_Init(&s);
+	    for (n = 0; n < 1000000 / 40; n++)
+		SHA_Bytes(&s, (void *)"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+			  40);
+	    SHA_Final(&s, digest);
+	}
+	for (j = 0; j < 20; j++) {
+	    if (digest[j] != tests[i].digest[j]) {
+		fprintf(stderr,
+			"\"%s\" digest byte %d should be 0x%02x, is 0x%02x\n",
+			tests[i].teststring, j, tests[i].digest[j],
+			digest[j]);
+		errors++;
+	    }
+	}
+
+    }
+
+    printf("%d errors\n", errors);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,286 @@
+#include "StdAfx.h"
+#include "hash_cache.h"
+#include "file_io.h"
+
+#include <libfilezilla/string.hpp>
+
+namespace {
+// The least recently used entries get dropped once the cache grows beyond this
+size_t const maxEntries = 100000;
+
+bool NeedsCompaction(size_t records, size_t entries)
+{
+	return records > entries * 2 + 1000;
+}
+
+std::string FormatEntry(int algorithm, int64_t size, int64_t mtime, std::wstring const& hash, std::wstring const& path)
+{
+	char buf[64];
+	sprintf_s(buf, "+%d %I64d %I64d ", algorithm, size, mtime);
+	return buf + fz::to_utf8(hash) + " " + fz::to_utf8(path) + "\n";
+}
+}
+
+class CHashCache::writer final : public CFileIoJob
+{
+public:
+	explicit writer(CHashCache& cache)
+		: cache_(cache)
+	{}
+
+	virtual void Process()
+	{
+		cache_.Flush();
+	}
+
+private:
+	CHashCache& cache_;
+};
+
+CHashCache::CHashCache(std::wstring const& file, CFileIoPool& pool)
+	: pool_(pool)
+	, writer_(std::make_shared<writer>(*this))
+	, file_(file)
+{
+	Load();
+	if (NeedsCompaction(records_, entries_.size())) {
+		// Nothing else can use the cache yet
+		records_ = entries_.size();
+		Compact(Serialize());
+	}
+	else {
+		log_ = CreateFile(file_.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	}
+}
+
+CHashCache::~CHashCache()
+{
+	// The pool is gone already, write whatever it did not get to
+	Flush();
+
+	if (log_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(log_);
+	}
+}
+
+std::wstring CHashCache::Normalize(std::wstring const& path)
+{
+	std::wstring ret = path;
+	while (!ret.empty() && ret.back() == '\\') {
+		ret.pop_back();
+	}
+	if (!ret.empty()) {
+		CharLowerBuffW(&ret[0], static_cast<DWORD>(ret.size()));
+	}
+	return ret;
+}
+
+bool CHashCache::Lookup(std::wstring const& path, int algorithm, int64_t size, int64_t mtime, std::wstring & hash)
+{
+	fz::scoped_lock lock(mutex_);
+
+	auto const it = entries_.find(key(Normalize(path), algorithm));
+	if (it == entries_.end() || it->second.size != size || it->second.mtime != mtime) {
+		return false;
+	}
+
+	used_.splice(used_.end(), used_, it->second.used);
+	hash = it->second.hash;
+	return true;
+}
+
+void CHashCache::Store(std::wstring const& path, int algorithm, int64_t size, int64_t mtime, std::wstring const& hash)
+{
+	std::wstring const p = Normalize(path);
+
+	fz::scoped_lock lock(mutex_);
+
+	entry & e = Put(key(p, algorithm));
+	e.size = size;
+	e.mtime = mtime;
+	e.hash = hash;
+
+	Append(FormatEntry(algorithm, size, mtime, hash, p));
+}
+
+void CHashCache::Invalidate(std::wstring const& path)
+{
+	std::wstring const p = Normalize(path);
+
+	fz::scoped_lock lock(mutex_);
+	if (Erase(p)) {
+		Append("-" + fz::to_utf8(p) + "\n");
+	}
+}
+
+CHashCache::entry& CHashCache::Put(key const& k)
+{
+	auto it = entries_.find(k);
+	if (it != entries_.end()) {
+		used_.splice(used_.end(), used_, it->second.used);
+		return it->second;
+	}
+
+	while (entries_.size() >= maxEntries) {
+		entries_.erase(used_.front());
+		used_.pop_front();
+	}
+
+	it = entries_.emplace(k, entry()).first;
+	it->second.used = used_.insert(used_.end(), k);
+	return it->second;
+}
+
+bool CHashCache::Erase(std::wstring const& path)
+{
+	bool erased = false;
+
+	auto it = entries_.lower_bound(key(path, INT_MIN));
+	while (it != entries_.end() && it->first.first == path) {
+		used_.erase(it->second.used);
+		it = entries_.erase(it);
+		erased = true;
+	}
+
+	// Everything below the path in case it is a directory
+	std::wstring const prefix = path + L"\\";
+	it = entries_.lower_bound(key(prefix, INT_MIN));
+	while (it != entries_.end() && !it->first.first.compare(0, prefix.size(), prefix)) {
+		used_.erase(it->second.used);
+		it = entries_.erase(it);
+		erased = true;
+	}
+
+	return erased;
+}
+
+void CHashCache::Load()
+{
+	HANDLE file = CreateFile(file_.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (file == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	std::string data;
+	LARGE_INTEGER size{};
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart < 0x40000000) {
+		data.resize(static_cast<size_t>(size.QuadPart));
+		DWORD read = 0;
+		if (!ReadFile(file, &data[0], static_cast<DWORD>(data.size()), &read, 0)) {
+			read = 0;
+		}
+		data.resize(read);
+	}
+	CloseHandle(file);
+
+	size_t pos = 0;
+	while (pos < data.size()) {
+		size_t end = data.find('\n', pos);
+		if (end == std::string::npos) {
+			// Incomplete last record
+			break;
+		}
+
+		char const* line = data.c_str() + pos;
+		if (*line == '-') {
+			Erase(fz::to_wstring_from_utf8(std::string(line + 1, end - pos - 1)));
+		}
+		else if (*line == '+') {
+			// +<algorithm> <size> <mtime> <hash> <path>
+			char* p = 0;
+			int const algorithm = static_cast<int>(strtol(line + 1, &p, 10));
+			int64_t const fileSize = _strtoi64(p, &p, 10);
+			int64_t const mtime = _strtoi64(p, &p, 10);
+			char const* hash = p + 1;
+			char const* hashEnd = 0;
+			if (*p == ' ' && hash < data.c_str() + end) {
+				hashEnd = static_cast<char const*>(memchr(hash, ' ', data.c_str() + end - hash));
+			}
+			if (hashEnd) {
+				std::wstring path = fz::to_wstring_from_utf8(std::string(hashEnd + 1, data.c_str() + end));
+				entry & e = Put(key(path, algorithm));
+				e.size = fileSize;
+				e.mtime = mtime;
+				e.hash = fz::to_wstring_from_utf8(std::string(hash, hashEnd));
+			}
+		}
+		++records_;
+
+		pos = end + 1;
+	}
+}
+
+std::string CHashCache::Serialize() const
+{
+	// Least recently used first, so that loading restores the order
+	std::string data;
+	for (auto const& k : used_) {
+		auto const& e = entries_.find(k)->second;
+		data += FormatEntry(k.second, e.size, e.mtime, e.hash, k.first);
+	}
+	return data;
+}
+
+void CHashCache::Compact(std::string const& data)
+{
+	if (log_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(log_);
+		log_ = INVALID_HANDLE_VALUE;
+	}
+
+	std::wstring const tmp = file_ + L".tmp";
+	HANDLE file = CreateFile(tmp.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file != INVALID_HANDLE_VALUE) {
+		DWORD written = 0;
+		bool const success = data.empty() || WriteFile(file, data.c_str(), static_cast<DWORD>(data.size()), &written, 0);
+		CloseHandle(file);
+
+		if (!success || !MoveFileEx(tmp.c_str(), file_.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+			DeleteFile(tmp.c_str());
+		}
+	}
+
+	log_ = CreateFile(file_.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+}
+
+void CHashCache::Append(std::string const& record)
+{
+	pending_ += record;
+	++records_;
+
+	if (!flushQueued_) {
+		flushQueued_ = true;
+		pool_.Queue(writer_);
+	}
+}
+
+void CHashCache::Flush()
+{
+	// Taken first, mutex_ is only held while picking up the queued records
+	fz::scoped_lock ioLock(ioMutex_);
+
+	std::string records;
+	bool compact = false;
+	{
+		fz::scoped_lock lock(mutex_);
+		flushQueued_ = false;
+		if (NeedsCompaction(records_, entries_.size())) {
+			// The snapshot already reflects the queued records
+			records = Serialize();
+			records_ = entries_.size();
+			pending_.clear();
+			compact = true;
+		}
+		else {
+			records.swap(pending_);
+		}
+	}
+
+	if (compact) {
+		Compact(records);
+	}
+	else if (!records.empty() && log_ != INVALID_HANDLE_VALUE) {
+		DWORD written = 0;
+		WriteFile(log_, records.c_str(), static_cast<DWORD>(records.size()), &written, 0);
+	}
+}
@@ -0,0 +1,99 @@
+#ifndef FILEZILLA_SERVER_HASH_CACHE_HEADER
+#define FILEZILLA_SERVER_HASH_CACHE_HEADER
+
+#include <libfilezilla/mutex.hpp>
+
+#include <list>
+#include <map>
+
+/*
+Remembers file hashes so that repeated HASH requests for unchanged files need
+not read them again. Entries are keyed by physical path and algorithm and are
+only valid while size and modification time of the file still match.
+
+The cache is kept in an append-only log next to the settings file. The log
+gets rewritten if it contains too many stale records. Except when loading and
+on shutdown, all changes only update the entries in memory. Writing the log
+is left to a job on the file I/O pool, so that invalidations coming from the
+server threads never wait for the disk.
+
+Once the cache is full, the least recently used entry gets dropped.
+*/
+
+class CFileIoPool;
+class CHashCache final
+{
+public:
+	// The pool is only used once entries change, it does not need to be
+	// constructed yet. It has to be destroyed before the cache.
+	CHashCache(std::wstring const& file, CFileIoPool& pool);
+	~CHashCache();
+
+	bool Lookup(std::wstring const& path, int algorithm, int64_t size, int64_t mtime, std::wstring & hash);
+	void Store(std::wstring const& path, int algorithm, int64_t size, int64_t mtime, std::wstring const& hash);
+
+	// Forgets the hashes of the file, or of everything below it if it is a
+	// directory.
+	void Invalidate(std::wstring const& path);
+
+private:
+	typedef std::pair<std::wstring, int> key;
+
+	struct entry
+	{
+		int64_t size{};
+		int64_t mtime{};
+		std::wstring hash;
+
+		// Position in the recently used list
+		std::list<key>::iterator used;
+	};
+
+	class writer;
+
+	static std::wstring Normalize(std::wstring const& path);
+
+	void Load();
+
+	// Returns the entry for the key, creating it if needed. Marks it as the
+	// most recently used one.
+	entry& Put(key const& k);
+	bool Erase(std::wstring const& path);
+
+	// Queues a record for the log. Requires mutex_.
+	void Append(std::string const& record);
+
+	// Writes queued records to the log, or rewrites the log if needed.
+	// Called on the file I/O pool.
+	void Flush();
+
+	// Replaces the log with the given records. Requires ioMutex_ unless the
+	// cache is not in use yet.
+	void Compact(std::string const& data);
+
+	// All entries as records. Requires mutex_.
+	std::string Serialize() const;
+
+	fz::mutex mutex_{false};
+
+	std::map<key, entry> entries_;
+
+	// Least recently used first
+	std::list<key> used_;
+
+	// Number of records in the log, including queued ones
+	size_t records_{};
+
+	std::string pending_;
+	bool flushQueued_{};
+
+	CFileIoPool& pool_;
+	std::shared_ptr<writer> writer_;
+
+	// Serializes access to the log file, only held while writing
+	fz::mutex ioMutex_{false};
+	std::wstring const file_;
+	HANDLE log_{INVALID_HANDLE_VALUE};
+};
+
+#endif
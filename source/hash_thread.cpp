@@ -2,10 +2,11 @@
 #include "hash_thread.h"
 #include "misc\md5.h"
 #include "ServerThread.h"
+#include "Options.h"
 
 #define SHA512_STANDALONE
 typedef unsigned int uint32;
-#include "hash_algorithms/int64.h"
+typedef unsigned long long uint64;
 #include "hash_algorithms/sshsh512.c"
 #include "hash_algorithms/sshsha.c"
 
@@ -13,28 +14,52 @@ typedef unsigned int uint32;
 
 #include <array>
 
-CHashThread::CHashThread()
-{
-	m_result = OK;
-	m_algorithm = SHA512;
+namespace {
+// Upper limit of outstanding requests over all sessions
+size_t const maxQueued = 100;
 
-	run();
+DWORD const bufferSize = 262144;
 }
 
-CHashThread::~CHashThread()
+class CHashThread::job final : public CFileIoJob
 {
+public:
+	job(CHashThread& owner)
+		: owner_(owner)
+	{}
+
+	virtual void Process()
 	{
-		fz::scoped_lock lock(mutex_);
+		owner_.DoHash(*this);
+	}
 
-		// Cleanup
-		m_server_thread = 0;
+	CHashThread& owner_;
 
-		// And signal quit
-		m_quit = true;
-		cond_.signal(lock);
-	}
+	int id_{};
+	std::wstring filename_;
+	enum _algorithm algorithm_{SHA512};
+	int64_t offset_{};
+	int64_t length_{-1};
+	CServerThread* server_thread_{};
 
-	join();
+	enum _result result_{PENDING};
+	std::wstring hash_;
+	bool cancelled_{};
+};
+
+CHashThread::CHashThread(int workers)
+	: cache_(GetExecutableDirectory() + L"FileZilla Server hashes.dat", pool_)
+	, pool_(workers)
+{
+}
+
+CHashThread::~CHashThread()
+{
+	fz::scoped_lock lock(mutex_);
+	for (auto & j : jobs_) {
+		j.second->cancelled_ = true;
+	}
+	jobs_.clear();
 }
 
 namespace {
@@ -55,29 +80,72 @@ void FreeState(void* data, CHashThread::_algorithm alg)
 }
 }
 
-void CHashThread::DoHash(fz::scoped_lock & l)
+void CHashThread::DoHash(job & j)
 {
-	if (filename_.empty()) {
+	fz::scoped_lock l(mutex_);
+	if (j.cancelled_) {
 		return;
 	}
 
-	std::wstring file = filename_;
+	std::wstring const file = j.filename_;
+	enum _algorithm const alg = j.algorithm_;
+	int64_t const offset = j.offset_;
+	int64_t remaining = j.length_;
 
 	l.unlock();
 
+	auto finish = [&](enum _result result) {
+		// Lock is being held. Cancelled jobs have been accounted for already.
+		if (j.cancelled_) {
+			return;
+		}
+		j.result_ = result;
+		--queued_;
+		if (j.server_thread_) {
+			j.server_thread_->PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_HASHRESULT, j.id_);
+		}
+	};
+
 	int shareMode = FILE_SHARE_READ;
 	HANDLE hFile = CreateFile(file.c_str(), GENERIC_READ, shareMode, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
 
 	if (hFile == INVALID_HANDLE_VALUE) {
 		l.lock();
-		m_result = FAILURE_OPEN;
-		if (m_server_thread) {
-			m_server_thread->PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_HASHRESULT, m_active_id);
-		}
+		finish(FAILURE_OPEN);
 		return;
 	}
 
-	const enum _algorithm alg = m_algorithm;
+	// Only hashes of whole files are cached
+	bool const cacheable = !offset && remaining == -1;
+	int64_t fileSize = -1;
+	int64_t mtime = -1;
+	if (cacheable) {
+		BY_HANDLE_FILE_INFORMATION info;
+		if (GetFileInformationByHandle(hFile, &info)) {
+			fileSize = (static_cast<int64_t>(info.nFileSizeHigh) << 32) + info.nFileSizeLow;
+			mtime = (static_cast<int64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) + info.ftLastWriteTime.dwLowDateTime;
+
+			std::wstring hash;
+			if (cache_.Lookup(file, alg, fileSize, mtime, hash)) {
+				CloseHandle(hFile);
+				l.lock();
+				j.hash_ = std::move(hash);
+				finish(OK);
+				return;
+			}
+		}
+	}
+
+	if (offset) {
+		LARGE_INTEGER pos;
+		pos.QuadPart = offset;
+		if (!SetFilePointerEx(hFile, pos, 0, FILE_BEGIN)) {
+			CloseHandle(hFile);
+			l.lock();
+			finish(FAILURE_READ);
+			return;
+		}
+	}
 
 	void* data;
 	switch (alg)
@@ -95,25 +163,38 @@ void CHashThread::DoHash(fz::scoped_lock & l)
 		break;
 	}
 
-	unsigned char buffer[262144];
+	std::unique_ptr<unsigned char[]> buffer(new unsigned char[bufferSize]);
 	DWORD read = 0;
 	BOOL res = 0;
-	while ((res = ReadFile(hFile, buffer, 262144, &read, 0) != 0) && read > 0) {
+	while (remaining) {
+		DWORD toRead = bufferSize;
+		if (remaining > 0 && remaining < toRead) {
+			toRead = static_cast<DWORD>(remaining);
+		}
+		res = ReadFile(hFile, buffer.get(), toRead, &read, 0);
+		if (!res || !read) {
+			break;
+		}
+		if (remaining > 0) {
+			remaining -= read;
+		}
+
 		switch (alg)
 		{
 		case MD5:
-			((::MD5*)data)->update(buffer, read);
+			((::MD5*)data)->update(buffer.get(), read);
 			break;
 		case SHA512:
-			SHA512_Bytes((SHA512_State*)data, buffer, read);
+			SHA512_Bytes((SHA512_State*)data, buffer.get(), read);
 			break;
 		case SHA1:
-			SHA_Bytes((SHA_State*)data, buffer, read);
+			SHA_Bytes((SHA_State*)data, buffer.get(), read);
 			break;
 		}
 
 		l.lock();
-		if (!m_server_thread) {
+		if (j.cancelled_) {
+			l.unlock();
 			CloseHandle(hFile);
 			FreeState(data, alg);
 			return;
@@ -124,22 +205,21 @@ void CHashThread::DoHash(fz::scoped_lock & l)
 	CloseHandle(hFile);
 
 	l.lock();
-	if (!res) {
-		m_result = FAILURE_READ;
-		if (m_server_thread) {
-			m_server_thread->PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_HASHRESULT, m_active_id);
-		}
+	// A range extending past the end of the file is an error as well
+	if (!res || remaining > 0) {
+		finish(FAILURE_READ);
 		FreeState(data, alg);
 		return;
 	}
 
+	std::wstring hash;
 	switch (alg)
 	{
 	case MD5:
 		{
 			((::MD5*)data)->finalize();
 			auto digest = ((::MD5*)data)->hex_digest();
-			hash_ = fz::to_wstring(digest);
+			hash = fz::to_wstring(digest);
 			delete[] digest;
 		}
 		break;
@@ -147,61 +227,53 @@ void CHashThread::DoHash(fz::scoped_lock & l)
 		{
 			std::array<unsigned char, 64> digest;
 			SHA512_Final((SHA512_State*)data, digest.data());
-			hash_ = fz::hex_encode<std::wstring>(digest);
+			hash = fz::hex_encode<std::wstring>(digest);
 		}
 		break;
 	case SHA1:
 		{
 			std::array<unsigned char, 20> digest;
 			SHA_Final((SHA_State*)data, digest.data());
-			hash_ = fz::hex_encode<std::wstring>(digest);
+			hash = fz::hex_encode<std::wstring>(digest);
 		}
 		break;
 	}
-	m_result = hash_.empty() ? FAILURE_READ : OK;
-	if (m_server_thread) {
-		m_server_thread->PostThreadMessage(WM_FILEZILLA_THREADMSG, FTM_HASHRESULT, m_active_id);
+	if (cacheable && mtime != -1 && !hash.empty()) {
+		cache_.Store(file, alg, fileSize, mtime, hash);
 	}
+	j.hash_ = std::move(hash);
+	finish(j.hash_.empty() ? FAILURE_READ : OK);
 
 	FreeState(data, alg);
 }
 
-void CHashThread::entry()
-{
-	while (true) {
-		fz::scoped_lock lock(mutex_);
-		cond_.wait(lock);
-		if (m_quit) {
-			break;
-		}
-		DoHash(lock);
-	}
-}
-
-enum CHashThread::_result CHashThread::Hash(std::wstring const& filename, enum _algorithm algorithm, int& id, CServerThread* server_thread)
+enum CHashThread::_result CHashThread::Hash(std::wstring const& filename, enum _algorithm algorithm, int64_t offset, int64_t length, int& id, CServerThread* server_thread)
 {
 	fz::scoped_lock lock(mutex_);
-	if (m_active_id) {
+	if (queued_ >= maxQueued) {
 		return BUSY;
 	}
 
-	++m_id;
-	if (m_id > 1000000000) {
-		m_id = 1;
-	}
+	do {
+		++m_id;
+		if (m_id > 1000000000) {
+			m_id = 1;
+		}
+	} while (jobs_.find(m_id) != jobs_.end());
 	id = m_id;
-	m_active_id = id;
 
-	hash_.clear();
+	auto j = std::make_shared<job>(*this);
+	j->id_ = id;
+	j->filename_ = filename;
+	j->algorithm_ = algorithm;
+	j->offset_ = offset;
+	j->length_ = length;
+	j->server_thread_ = server_thread;
 
-	filename_ = filename;
+	jobs_[id] = j;
+	++queued_;
 
-	m_server_thread = server_thread;
-	m_algorithm = algorithm;
-
-	m_result = PENDING;
-
-	cond_.signal(lock);
+	pool_.Queue(j);
 
 	return PENDING;
 }
@@ -214,32 +286,67 @@ enum CHashThread::_result CHashThread::GetResult(int id, CHashThread::_algorithm
 
 	fz::scoped_lock lock(mutex_);
 
-	if (id != m_active_id) {
-		return BUSY;
+	auto it = jobs_.find(id);
+	if (it == jobs_.end()) {
+		return FAILURE_MASK;
 	}
 
-	if (m_result == PENDING) {
+	job & j = *it->second;
+	if (j.result_ == PENDING) {
 		return PENDING;
 	}
 
-	alg = m_algorithm;
-	file = filename_;
-	filename_.clear();
+	enum _result const result = j.result_;
+	alg = j.algorithm_;
+	file = std::move(j.filename_);
+	if (result == OK) {
+		hash = std::move(j.hash_);
+	}
+
+	jobs_.erase(it);
 
-	m_active_id = 0;
+	return result;
+}
+
+void CHashThread::Cancel(int id)
+{
+	fz::scoped_lock lock(mutex_);
 
-	if (m_result == OK) {
-		hash = std::move(hash_);
-		return OK;
+	auto it = jobs_.find(id);
+	if (it == jobs_.end()) {
+		return;
 	}
 
-	return m_result;
+	job & j = *it->second;
+	if (j.result_ == PENDING && !j.cancelled_) {
+		// The worker, if any, still holds a reference
+		j.cancelled_ = true;
+		j.result_ = FAILURE_MASK;
+		--queued_;
+	}
+	jobs_.erase(it);
 }
 
 void CHashThread::Stop(CServerThread* server_thread)
 {
 	fz::scoped_lock lock(mutex_);
-	if (m_server_thread == server_thread) {
-		m_server_thread = 0;
+	for (auto it = jobs_.begin(); it != jobs_.end(); ) {
+		job & j = *it->second;
+		if (j.server_thread_ == server_thread) {
+			if (j.result_ == PENDING && !j.cancelled_) {
+				j.cancelled_ = true;
+				j.result_ = FAILURE_MASK;
+				--queued_;
+			}
+			it = jobs_.erase(it);
+		}
+		else {
+			++it;
+		}
 	}
 }
+
+void CHashThread::Invalidate(std::wstring const& path)
+{
+	cache_.Invalidate(path);
+}
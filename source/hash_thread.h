@@ -1,11 +1,26 @@
 #ifndef FILEZILLA_SERVER_HASHTRHEAD_HEADER
 #define FILEZILLA_SERVER_HASHTRHEAD_HEADER
 
-#include <libfilezilla/thread.hpp>
 #include <libfilezilla/mutex.hpp>
 
+#include "file_io.h"
+#include "hash_cache.h"
+
+#include <map>
+
+/*
+Computes file hashes for the HASH command on a small pool of worker threads.
+
+Requests are queued in FIFO order and handed to the next idle worker. Each
+session has at most one hash request in flight, so one client cannot starve
+the others. Once a hash is done, FTM_HASHRESULT gets posted to the requesting
+server thread, the result is collected with GetResult.
+
+Hashes of whole files are remembered in a CHashCache.
+*/
+
 class CServerThread;
-class CHashThread final : protected fz::thread
+class CHashThread final
 {
 public:
 	enum _result
@@ -25,33 +40,41 @@ public:
 		SHA512
 	};
 
-	CHashThread();
-	virtual ~CHashThread();
+	explicit CHashThread(int workers);
+	~CHashThread();
 
-	enum _result Hash(std::wstring const& filename, enum _algorithm algorithm, int& id, CServerThread* server_thread);
+	// Hashes length bytes starting at offset. If length is -1, hashes up to the
+	// end of the file. Returns BUSY if too many requests are queued already.
+	enum _result Hash(std::wstring const& filename, enum _algorithm algorithm, int64_t offset, int64_t length, int& id, CServerThread* server_thread);
 
 	enum _result GetResult(int id, CHashThread::_algorithm& alg, std::wstring& hash, std::wstring & file);
 
+	// Discards the request, stops hashing if it is already in progress.
+	void Cancel(int id);
+
+	// Discards all requests of the given server thread.
 	void Stop(CServerThread* server_thread);
 
-private:
-	virtual void entry();
+	// To be called whenever a file or directory gets modified, renamed or deleted.
+	void Invalidate(std::wstring const& path);
 
-	void DoHash(fz::scoped_lock & lock);
+private:
+	class job;
 
-	std::wstring filename_;
-	CServerThread* m_server_thread{};
+	void DoHash(job & j);
 
 	fz::mutex mutex_{false};
-	fz::condition cond_;
-
-	bool m_quit{};
 
 	int m_id{};
-	int m_active_id{};
-	enum _result m_result;
-	std::wstring hash_;
-	enum _algorithm m_algorithm;
+
+	// All requests which have not been collected or cancelled yet
+	std::map<int, std::shared_ptr<job>> jobs_;
+	size_t queued_{};
+
+	CHashCache cache_;
+
+	// Declared last, it needs to be destroyed first as it joins the workers.
+	CFileIoPool pool_;
 };
 
 #endif
@@ -21,10 +21,225 @@
 
 #include <memory>
 #include <iphlpapi.h>
+#include <ws2tcpip.h>
 
 #include <libfilezilla/format.hpp>
 #include <libfilezilla/string.hpp>
 
+CIpAddress CIpAddress::Parse(std::wstring const& address)
+{
+	CIpAddress ret;
+
+	if (address.find(':') == std::wstring::npos) {
+		if (InetPtonW(AF_INET, address.c_str(), ret.bytes_) == 1) {
+			ret.family_ = ipv4;
+		}
+		return ret;
+	}
+
+	if (InetPtonW(AF_INET6, address.c_str(), ret.bytes_) != 1) {
+		return ret;
+	}
+
+	static unsigned char const mappedPrefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	if (!memcmp(ret.bytes_, mappedPrefix, sizeof(mappedPrefix))) {
+		memmove(ret.bytes_, ret.bytes_ + 12, 4);
+		memset(ret.bytes_ + 4, 0, 12);
+		ret.family_ = ipv4;
+	}
+	else {
+		ret.family_ = ipv6;
+	}
+
+	return ret;
+}
+
+CIpAddress CIpAddress::FromSockAddr(sockaddr const& address)
+{
+	CIpAddress ret;
+
+	if (address.sa_family == AF_INET) {
+		memcpy(ret.bytes_, &reinterpret_cast<sockaddr_in const&>(address).sin_addr, 4);
+		ret.family_ = ipv4;
+	}
+	else if (address.sa_family == AF_INET6) {
+		unsigned char const* bytes = reinterpret_cast<sockaddr_in6 const&>(address).sin6_addr.s6_addr;
+
+		static unsigned char const mappedPrefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+		if (!memcmp(bytes, mappedPrefix, sizeof(mappedPrefix))) {
+			memcpy(ret.bytes_, bytes + 12, 4);
+			ret.family_ = ipv4;
+		}
+		else {
+			memcpy(ret.bytes_, bytes, 16);
+			ret.family_ = ipv6;
+		}
+	}
+
+	return ret;
+}
+
+std::wstring CIpAddress::ToString() const
+{
+	if (family_ == none) {
+		return std::wstring();
+	}
+
+	wchar_t buffer[INET6_ADDRSTRLEN];
+	if (!InetNtopW(family_ == ipv4 ? AF_INET : AF_INET6, const_cast<unsigned char*>(bytes_), buffer, INET6_ADDRSTRLEN)) {
+		return std::wstring();
+	}
+	return buffer;
+}
+
+CIpAddress CIpAddress::GetPrefix(int bits) const
+{
+	CIpAddress ret = *this;
+
+	int const total = static_cast<int>(size()) * 8;
+	if (bits < 0) {
+		bits = 0;
+	}
+	for (int i = bits; i < total; i += 8 - i % 8) {
+		ret.bytes_[i / 8] &= static_cast<unsigned char>(0xff00u >> (i % 8));
+	}
+
+	return ret;
+}
+
+bool CIpAddress::operator==(CIpAddress const& rhs) const
+{
+	return family_ == rhs.family_ && !memcmp(bytes_, rhs.bytes_, sizeof(bytes_));
+}
+
+bool CIpAddress::operator<(CIpAddress const& rhs) const
+{
+	if (family_ != rhs.family_) {
+		return family_ < rhs.family_;
+	}
+	return memcmp(bytes_, rhs.bytes_, sizeof(bytes_)) < 0;
+}
+
+size_t CIpAddress::Hash() const
+{
+	uint64_t a, b;
+	memcpy(&a, bytes_, 8);
+	memcpy(&b, bytes_ + 8, 8);
+
+	// Mixing function of splitmix64
+	uint64_t h = a ^ (b * 0x9e3779b97f4a7c15ull) ^ family_;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+	return static_cast<size_t>(h ^ (h >> 31));
+}
+
+CIpFilter::CIpFilter(std::vector<std::wstring> const& filters)
+{
+	for (auto const& filter : filters) {
+		Add(filter);
+	}
+}
+
+CIpFilter::CIpFilter(std::wstring const& filters)
+{
+	for (auto const& filter : fz::strtok(filters, L" \r\n\t")) {
+		Add(filter);
+	}
+}
+
+bool CIpFilter::Add(std::wstring const& filter)
+{
+	if (filter == L"*") {
+		all_ = true;
+		return true;
+	}
+
+	auto const pos = filter.find('/');
+	CIpAddress const address = CIpAddress::Parse(filter.substr(0, pos));
+	if (!address) {
+		return false;
+	}
+
+	int prefixLength = static_cast<int>(address.size()) * 8;
+	if (pos != std::wstring::npos) {
+		prefixLength = fz::to_integral<int>(filter.substr(pos + 1), -1);
+		if (prefixLength < 0) {
+			return false;
+		}
+		if (address.GetFamily() == CIpAddress::ipv4 && filter.find(':') != std::wstring::npos) {
+			// IPv4-mapped IPv6 range
+			prefixLength = std::max(prefixLength - 96, 0);
+		}
+		prefixLength = std::min(prefixLength, static_cast<int>(address.size()) * 8);
+	}
+
+	Add(address, prefixLength);
+	return true;
+}
+
+void CIpFilter::Add(CIpAddress const& address, int prefixLength)
+{
+	auto & nodes = nodes_[address.GetFamily() == CIpAddress::ipv4 ? 0 : 1];
+	if (nodes.empty()) {
+		nodes.emplace_back();
+	}
+
+	unsigned char const* data = address.data();
+
+	unsigned int node = 0;
+	for (int i = 0; i < prefixLength; ++i) {
+		if (nodes[node].match) {
+			// Already covered by a shorter prefix
+			return;
+		}
+
+		int const bit = (data[i / 8] >> (7 - i % 8)) & 1;
+		if (!nodes[node].children[bit]) {
+			nodes[node].children[bit] = static_cast<unsigned int>(nodes.size());
+			nodes.emplace_back();
+		}
+		node = nodes[node].children[bit];
+	}
+
+	// Longer prefixes below are covered now, their nodes simply become
+	// unreachable.
+	nodes[node].match = true;
+	nodes[node].children[0] = 0;
+	nodes[node].children[1] = 0;
+}
+
+bool CIpFilter::Matches(CIpAddress const& address) const
+{
+	if (all_) {
+		return true;
+	}
+	if (!address) {
+		return false;
+	}
+
+	auto const& nodes = nodes_[address.GetFamily() == CIpAddress::ipv4 ? 0 : 1];
+	if (nodes.empty()) {
+		return false;
+	}
+
+	unsigned char const* data = address.data();
+	int const bits = static_cast<int>(address.size()) * 8;
+
+	unsigned int node = 0;
+	for (int i = 0; !nodes[node].match; ++i) {
+		if (i == bits) {
+			return false;
+		}
+
+		node = nodes[node].children[(data[i / 8] >> (7 - i % 8)) & 1];
+		if (!node) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool IsLocalhost(std::wstring const& ip)
 {
 	if (ip.substr(0, 4) == L"127.") {
@@ -83,132 +298,6 @@ int DigitHexToDecNum(TCHAR c)
 		return c - '0';
 }
 
-static unsigned long const prefixMasksV4[] = {
-	0x00000000u,
-	0x80000000u,
-	0xc0000000u,
-	0xe0000000u,
-	0xf0000000u,
-	0xf8000000u,
-	0xfc000000u,
-	0xfe000000u,
-	0xff000000u,
-	0xff800000u,
-	0xffc00000u,
-	0xffe00000u,
-	0xfff00000u,
-	0xfff80000u,
-	0xfffc0000u,
-	0xfffe0000u,
-	0xffff0000u,
-	0xffff8000u,
-	0xffffc000u,
-	0xffffe000u,
-	0xfffff000u,
-	0xfffff800u,
-	0xfffffc00u,
-	0xfffffe00u,
-	0xffffff00u,
-	0xffffff80u,
-	0xffffffc0u,
-	0xffffffe0u,
-	0xfffffff0u,
-	0xfffffff8u,
-	0xfffffffcu,
-	0xfffffffeu,
-	0xffffffffu
-};
-
-bool MatchesFilter(std::wstring const& filter, std::wstring ip)
-{
-	// A single asterix matches all IPs.
-	if (filter == L"*") {
-		return true;
-	}
-
-	// Check for IP range syntax.
-	size_t pos = filter.find('/');
-	if (pos != std::wstring::npos) {
-		// CIDR filter
-		int prefixLength = fz::to_integral<int>(filter.substr(pos + 1));
-
-		if (ip.find(':') != std::wstring::npos) {
-			// IPv6 address
-			std::wstring left = GetIPV6LongForm(filter.substr(0, pos));
-			if (left.find(':') == std::wstring::npos) {
-				return false;
-			}
-			ip = GetIPV6LongForm(ip);
-			wchar_t const* i = ip.c_str();
-			wchar_t const* f = left.c_str();
-			while (prefixLength >= 4) {
-				if (*i != *f) {
-					return false;
-				}
-
-				if (!*i) {
-					return true;
-				}
-
-				if (*i == ':') {
-					++i;
-					++f;
-				}
-				++i;
-				++f;
-
-				prefixLength -= 4;
-			}
-			if (!prefixLength) {
-				return true;
-			}
-
-			int mask;
-			if (prefixLength == 1) {
-				mask = 0x8;
-			}
-			else if (prefixLength == 2) {
-				mask = 0xc;
-			}
-			else {
-				mask = 0xe;
-			}
-
-			return (DigitHexToDecNum(*i) & mask) == (DigitHexToDecNum(*f) & mask);
-		}
-		else {
-			if (prefixLength < 0) {
-				prefixLength = 0;
-			}
-			else if (prefixLength > 32) {
-				prefixLength = 32;
-			}
-
-			// IPv4 address
-			std::wstring left = filter.substr(0, pos);
-			if (left.find(':') != std::wstring::npos) {
-				return false;
-			}
-
-			unsigned long i = ntohl(inet_addr(fz::to_string(ip).c_str()));
-			unsigned long f = ntohl(inet_addr(fz::to_string(left).c_str()));
-
-			i &= prefixMasksV4[prefixLength];
-			f &= prefixMasksV4[prefixLength];
-			return i == f;
-		}
-	}
-	else {
-		// Literal filter
-		if (filter.find(':') != std::wstring::npos) {
-			return filter == GetIPV6ShortForm(ip);
-		}
-		else {
-			return filter == ip;
-		}
-	}
-}
-
 bool ParseIPFilter(std::wstring const& in, std::vector<std::wstring>* output)
 {
 	bool valid = true;
@@ -19,9 +19,102 @@
 #ifndef FZS_IPUTILS_HEADER
 #define FZS_IPUTILS_HEADER
 
+#include <functional>
+
+// Binary IPv4 or IPv6 address, cheap to copy, compare and hash.
+// IPv4-mapped IPv6 addresses are stored as IPv4 addresses.
+class CIpAddress final
+{
+public:
+	enum family : unsigned char
+	{
+		none,
+		ipv4,
+		ipv6
+	};
+
+	CIpAddress() = default;
+
+	// Returns an address of family none if the string is not a valid address
+	static CIpAddress Parse(std::wstring const& address);
+
+	// Takes a sockaddr_in or sockaddr_in6
+	static CIpAddress FromSockAddr(sockaddr const& address);
+
+	std::wstring ToString() const;
+
+	family GetFamily() const { return family_; }
+	explicit operator bool() const { return family_ != none; }
+
+	// 4 or 16 bytes in network byte order
+	unsigned char const* data() const { return bytes_; }
+	size_t size() const { return family_ == ipv4 ? 4 : 16; }
+
+	// Returns the network of the given prefix length the address belongs to
+	CIpAddress GetPrefix(int bits) const;
+
+	bool operator==(CIpAddress const& rhs) const;
+	bool operator!=(CIpAddress const& rhs) const { return !(*this == rhs); }
+	bool operator<(CIpAddress const& rhs) const;
+
+	size_t Hash() const;
+
+private:
+	family family_{none};
+	unsigned char bytes_[16]{};
+};
+
+namespace std {
+template<>
+struct hash<CIpAddress>
+{
+	size_t operator()(CIpAddress const& address) const { return address.Hash(); }
+};
+}
+
+/*
+Compiled form of a list of address filters as accepted by
+IsValidAddressFilter: Single addresses, CIDR ranges and * for everything.
+
+The ranges are kept in a binary trie per address family. Matching an address
+walks at most one node per bit of the address and does not allocate, no
+matter how many filters there are.
+*/
+class CIpFilter final
+{
+public:
+	CIpFilter() = default;
+	explicit CIpFilter(std::vector<std::wstring> const& filters);
+
+	// Filters separated by whitespace, as stored in the options
+	explicit CIpFilter(std::wstring const& filters);
+
+	// Returns false if the filter is invalid
+	bool Add(std::wstring const& filter);
+
+	bool Matches(CIpAddress const& address) const;
+
+private:
+	struct t_node
+	{
+		// Indexes into the nodes of the family, 0 for none as the root is
+		// nobody's child
+		unsigned int children[2]{};
+
+		// Set if a filter ends here, everything below matches
+		bool match{};
+	};
+
+	void Add(CIpAddress const& address, int prefixLength);
+
+	// IPv4 and IPv6, root node first
+	std::vector<t_node> nodes_[2];
+
+	bool all_{};
+};
+
 bool IsLocalhost(std::wstring const& ip);
 bool IsValidAddressFilter(std::wstring& filter);
-bool MatchesFilter(std::wstring const& filter, std::wstring ip);
 bool IsIpAddress(std::wstring const& address, bool allowNull = false);
 
 // Also verifies that it is a correct IPv6 address
@@ -0,0 +1,363 @@
+#include "StdAfx.h"
+#include "listing_cache.h"
+#include "Permissions.h"
+
+#include <tuple>
+
+namespace {
+// Upper bounds for the number of listings and the memory they occupy
+size_t const maxEntries = 1000;
+size_t const maxTotalSize = 64 * 1024 * 1024;
+
+// Listings expire after this long
+fz::duration const entryLifetime = fz::duration::from_minutes(5);
+
+// Watches of directories without listings, which are still being enumerated,
+// are closed after this long
+fz::duration const watchLifetime = fz::duration::from_minutes(1);
+
+DWORD const notifyFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_ATTRIBUTES |
+	FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SECURITY;
+}
+
+bool CListingCache::key::operator<(key const& rhs) const
+{
+	return std::tie(physicalDir, fileSpec, logicalDir, dirToDisplay, format, permissions) <
+		std::tie(rhs.physicalDir, rhs.fileSpec, rhs.logicalDir, rhs.dirToDisplay, rhs.format, rhs.permissions);
+}
+
+struct CListingCache::watch
+{
+	OVERLAPPED ov{};
+	HANDLE dir{INVALID_HANDLE_VALUE};
+	std::wstring path;
+	uint64_t generation{};
+	fz::monotonic_clock created;
+	bool closed{};
+
+	// The contents are of no interest, any completion means something changed.
+	// If the buffer is too small the completion reports an overflow.
+	DWORD buffer[64];
+};
+
+class CListingCache::watcher final : protected fz::thread
+{
+public:
+	explicit watcher(CListingCache& cache)
+		: cache_(cache)
+	{
+		run();
+	}
+
+	virtual ~watcher()
+	{
+		join();
+	}
+
+private:
+	virtual void entry()
+	{
+		auto lastPrune = fz::monotonic_clock::now();
+		while (true) {
+			DWORD bytes = 0;
+			ULONG_PTR completionKey = 0;
+			OVERLAPPED* ov = 0;
+			GetQueuedCompletionStatus(cache_.port_, &bytes, &completionKey, &ov, 60 * 1000);
+			if (ov) {
+				cache_.OnChange(reinterpret_cast<watch*>(completionKey));
+			}
+
+			auto const now = fz::monotonic_clock::now();
+			if (now - lastPrune >= fz::duration::from_minutes(1)) {
+				cache_.Prune();
+				lastPrune = now;
+			}
+
+			if (cache_.Quit()) {
+				break;
+			}
+		}
+	}
+
+	CListingCache& cache_;
+};
+
+CListingCache::CListingCache()
+{
+	port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, 0, 0, 1);
+	if (port_) {
+		watcher_ = make_unique<watcher>(*this);
+	}
+}
+
+CListingCache::~CListingCache()
+{
+	if (!port_) {
+		return;
+	}
+
+	{
+		fz::scoped_lock lock(mutex_);
+		while (!watches_.empty()) {
+			Unwatch(watches_.begin()->first);
+		}
+		quit_ = true;
+	}
+
+	// The watcher exits once the completions of all closed watches have arrived
+	PostQueuedCompletionStatus(port_, 0, 0, 0);
+	watcher_.reset();
+
+	CloseHandle(port_);
+}
+
+std::wstring CListingCache::Normalize(std::wstring const& path)
+{
+	std::wstring ret = path;
+	while (!ret.empty() && ret.back() == '\\') {
+		ret.pop_back();
+	}
+	if (!ret.empty()) {
+		CharLowerBuffW(&ret[0], static_cast<DWORD>(ret.size()));
+	}
+	return ret;
+}
+
+std::shared_ptr<CListingCache::listing const> CListingCache::Lookup(key const& k, uint64_t & generation)
+{
+	generation = 0;
+
+	key nk = k;
+	nk.physicalDir = Normalize(k.physicalDir);
+
+	fz::scoped_lock lock(mutex_);
+
+	auto it = entries_.find(nk);
+	if (it != entries_.end()) {
+		if (it->second.expiry > fz::monotonic_clock::now()) {
+			++hits_;
+			return it->second.data;
+		}
+		Erase(it);
+	}
+	++misses_;
+
+	// Watch before the directory gets enumerated, so that no change can slip
+	// through in between.
+	if (port_ && !quit_) {
+		auto w = watches_.find(nk.physicalDir);
+		if (w != watches_.end()) {
+			generation = w->second->generation;
+		}
+		else if (Watch(nk.physicalDir, k.physicalDir)) {
+			generation = watches_[nk.physicalDir]->generation;
+		}
+	}
+
+	return std::shared_ptr<listing const>();
+}
+
+void CListingCache::Store(key const& k, std::shared_ptr<listing const> const& l, uint64_t generation)
+{
+	if (!l || !generation) {
+		return;
+	}
+
+	size_t const size = l->size() * sizeof(t_dirlisting);
+	if (size > maxListingSize) {
+		return;
+	}
+
+	key nk = k;
+	nk.physicalDir = Normalize(k.physicalDir);
+
+	fz::scoped_lock lock(mutex_);
+
+	auto const w = watches_.find(nk.physicalDir);
+	if (w == watches_.end() || w->second->generation != generation) {
+		return;
+	}
+
+	auto it = entries_.find(nk);
+	if (it == entries_.end()) {
+		// Evict arbitrary listings of other directories, ours must stay
+		// watched.
+		it = entries_.begin();
+		while (it != entries_.end() && (entries_.size() >= maxEntries || size_ + size > maxTotalSize)) {
+			if (it->first.physicalDir == nk.physicalDir) {
+				++it;
+			}
+			else {
+				auto next = std::next(it);
+				Erase(it);
+				it = next;
+			}
+		}
+		if (entries_.size() >= maxEntries || size_ + size > maxTotalSize) {
+			return;
+		}
+		it = entries_.emplace(nk, entry()).first;
+	}
+	else {
+		size_ -= it->second.size;
+	}
+
+	it->second.data = l;
+	it->second.size = size;
+	it->second.expiry = fz::monotonic_clock::now() + entryLifetime;
+	size_ += size;
+}
+
+void CListingCache::Invalidate(std::wstring const& path)
+{
+	std::wstring const p = Normalize(path);
+
+	fz::scoped_lock lock(mutex_);
+
+	EraseDir(p);
+
+	size_t const pos = p.rfind('\\');
+	if (pos != std::wstring::npos) {
+		EraseDir(p.substr(0, pos));
+	}
+
+	// Everything below the path in case it is a directory. Listings only exist
+	// for watched directories, this also covers directories which are still
+	// being enumerated.
+	std::wstring const prefix = p + L"\\";
+	auto it = watches_.lower_bound(prefix);
+	while (it != watches_.end() && !it->first.compare(0, prefix.size(), prefix)) {
+		EraseDir(std::wstring(it->first));
+		it = watches_.lower_bound(prefix);
+	}
+}
+
+void CListingCache::EraseDir(std::wstring const& dir)
+{
+	key k;
+	k.physicalDir = dir;
+	auto it = entries_.lower_bound(k);
+	while (it != entries_.end() && it->first.physicalDir == dir) {
+		size_ -= it->second.size;
+		it = entries_.erase(it);
+	}
+
+	Unwatch(dir);
+}
+
+void CListingCache::Erase(std::map<key, entry>::iterator it)
+{
+	std::wstring const dir = it->first.physicalDir;
+	size_ -= it->second.size;
+	it = entries_.erase(it);
+
+	bool const last = (it == entries_.end() || it->first.physicalDir != dir) &&
+		(it == entries_.begin() || std::prev(it)->first.physicalDir != dir);
+	if (last) {
+		Unwatch(dir);
+	}
+}
+
+bool CListingCache::Watch(std::wstring const& dir, std::wstring const& path)
+{
+	if (watches_.size() >= maxEntries) {
+		return false;
+	}
+
+	std::wstring name = path;
+	if (!name.empty() && name.back() == ':') {
+		name += L"\\";
+	}
+	HANDLE h = CreateFileW(name.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+	if (h == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	auto w = new watch;
+	w->dir = h;
+	w->path = dir;
+	w->generation = ++nextGeneration_;
+	w->created = fz::monotonic_clock::now();
+	if (!CreateIoCompletionPort(h, port_, reinterpret_cast<ULONG_PTR>(w), 0) ||
+		!ReadDirectoryChangesW(h, w->buffer, sizeof(w->buffer), FALSE, notifyFilter, 0, &w->ov, 0))
+	{
+		// Nothing got queued, there will be no completion
+		CloseHandle(h);
+		delete w;
+		return false;
+	}
+
+	++pendingWatches_;
+	watches_[dir] = w;
+	return true;
+}
+
+void CListingCache::Unwatch(std::wstring const& dir)
+{
+	auto it = watches_.find(dir);
+	if (it == watches_.end()) {
+		return;
+	}
+
+	// Changes are no longer noticed. Listings still being enumerated will not
+	// be stored, any new watch has a different generation.
+	// Completes the pending request, the watcher deletes the watch then
+	watch* w = it->second;
+	CancelIoEx(w->dir, &w->ov);
+	CloseHandle(w->dir);
+	w->dir = INVALID_HANDLE_VALUE;
+	w->closed = true;
+	watches_.erase(it);
+}
+
+void CListingCache::OnChange(watch* w)
+{
+	fz::scoped_lock lock(mutex_);
+
+	if (!w->closed) {
+		// Watches are one-shot, the directory gets watched again once it is
+		// listed the next time.
+		EraseDir(std::wstring(w->path));
+	}
+
+	delete w;
+	--pendingWatches_;
+}
+
+void CListingCache::Prune()
+{
+	fz::scoped_lock lock(mutex_);
+
+	auto const now = fz::monotonic_clock::now();
+	for (auto it = entries_.begin(); it != entries_.end(); ) {
+		if (it->second.expiry > now) {
+			++it;
+			continue;
+		}
+
+		auto next = std::next(it);
+		Erase(it);
+		it = next;
+	}
+
+	// Watches of directories whose enumeration never finished
+	for (auto it = watches_.begin(); it != watches_.end(); ) {
+		std::wstring const dir = it->first;
+		bool const old = now - it->second->created > watchLifetime;
+		++it;
+
+		key k;
+		k.physicalDir = dir;
+		auto const first = entries_.lower_bound(k);
+		if (old && (first == entries_.end() || first->first.physicalDir != dir)) {
+			Unwatch(dir);
+		}
+	}
+}
+
+bool CListingCache::Quit()
+{
+	fz::scoped_lock lock(mutex_);
+	return quit_ && !pendingWatches_;
+}
@@ -0,0 +1,118 @@
+#ifndef FILEZILLA_SERVER_LISTING_CACHE_HEADER
+#define FILEZILLA_SERVER_LISTING_CACHE_HEADER
+
+#include <libfilezilla/mutex.hpp>
+#include <libfilezilla/thread.hpp>
+#include <libfilezilla/time.hpp>
+
+#include <atomic>
+#include <map>
+
+/*
+Formatted directory listings shared by all server threads, so that clients
+polling the same directories do not cause the directory to be enumerated and
+every subdirectory's permissions to be evaluated again and again.
+
+Listings are keyed by the physical and logical directory, the listing format
+and the effective permissions of the user, see CUser::GetPermissionsKey.
+
+Each cached directory is watched with ReadDirectoryChangesW. Any change
+reported by the system drops all listings of the directory, as does Invalidate
+which the server calls for its own modifications. Directories which cannot be
+watched are not cached. In addition listings expire after a few minutes as the
+LIST format depends on the current time. Watches are closed as soon as their
+directory has no listings left, as an open handle prevents parent directories
+from being renamed.
+*/
+
+struct t_dirlisting;
+
+class CListingCache final
+{
+public:
+	struct key
+	{
+		std::wstring physicalDir;
+		std::wstring fileSpec;
+		std::wstring logicalDir;
+		std::string dirToDisplay;
+		int format{};
+		std::wstring permissions;
+
+		bool operator<(key const& rhs) const;
+	};
+
+	typedef std::vector<t_dirlisting> listing;
+
+	CListingCache();
+	~CListingCache();
+
+	// On a miss, starts watching the directory and sets generation which is to
+	// be passed to Store once the directory has been enumerated. The listing is
+	// then discarded if the directory got invalidated in the meantime.
+	std::shared_ptr<listing const> Lookup(key const& k, uint64_t & generation);
+
+	void Store(key const& k, std::shared_ptr<listing const> const& l, uint64_t generation);
+
+	// To be called whenever a file or directory gets created, modified, renamed
+	// or deleted. Drops the listings of the parent directory, of the path itself
+	// and of everything below it.
+	void Invalidate(std::wstring const& path);
+
+	uint64_t GetHits() const { return hits_; }
+	uint64_t GetMisses() const { return misses_; }
+
+	// Listings larger than this are not cached
+	static size_t const maxListingSize = 1024 * 1024;
+
+private:
+	class watcher;
+	struct watch;
+
+	struct entry
+	{
+		std::shared_ptr<listing const> data;
+		fz::monotonic_clock expiry;
+		size_t size{};
+	};
+
+	static std::wstring Normalize(std::wstring const& path);
+
+	// Take the normalized physical directory
+	bool Watch(std::wstring const& dir, std::wstring const& path);
+	void Unwatch(std::wstring const& dir);
+
+	// Called on the watcher thread
+	void OnChange(watch* w);
+	void Prune();
+	bool Quit();
+
+	void EraseDir(std::wstring const& dir);
+
+	// Also closes the watch of the directory if it was its last listing
+	void Erase(std::map<key, entry>::iterator it);
+
+	fz::mutex mutex_{false};
+
+	std::map<key, entry> entries_;
+	size_t size_{};
+
+	// Normalized physical directory to its watch
+	std::map<std::wstring, watch*> watches_;
+
+	HANDLE port_{};
+	std::unique_ptr<watcher> watcher_;
+
+	// Watches whose completion has not yet been processed
+	size_t pendingWatches_{};
+	bool quit_{};
+
+	// Each watch gets a new generation. Invalidating a directory always
+	// closes its watch, so a listing can be stored as long as the watch it
+	// was enumerated under is still open.
+	uint64_t nextGeneration_{};
+	std::atomic<uint64_t> hits_{};
+	std::atomic<uint64_t> misses_{};
+};
+
+#endif
@@ -63,14 +63,10 @@ MD5::MD5(){
 // context.
 
 void MD5::update (const uint1 *input, uint4 input_length) {
-  unsigned char *input2 = new uint1[input_length];
-  memcpy(input2, input, input_length);
-
   uint4 input_index, buffer_index;
   uint4 buffer_space;                // how much space is left in buffer
 
   if (finalized){  // so we can't update!
-	delete [] input2;
     cerr << "MD5::update:  Can't update a finalized digest!" << endl;
     return;
   }
@@ -90,23 +86,22 @@ void MD5::update (const uint1 *input, uint4 input_length) {
   // Transform as many times as possible.
   if (input_length >= buffer_space) { // ie. we have enough to fill the buffer
     // fill the rest of the buffer and transform
-    memcpy (buffer + buffer_index, input2, buffer_space);
+    memcpy (buffer + buffer_index, input, buffer_space);
     transform (buffer);
 
-    // now, transform each 64-byte piece of the input2, bypassing the buffer
+    // now, transform each 64-byte piece of the input, bypassing the buffer
     for (input_index = buffer_space; input_index + 63 < input_length; 
 	 input_index += 64)
-      transform (input2+input_index);
+      transform (input+input_index);
 
     buffer_index = 0;  // so we can buffer remaining
   }
   else
-    input_index=0;     // so we can buffer the whole input2
+    input_index=0;     // so we can buffer the whole input
 
 
   // and here we do the buffering:
   memcpy(buffer+buffer_index, input+input_index, input_length-input_index);
-  delete [] input2;
 }
 
 
@@ -340,7 +335,7 @@ void MD5::init(){
 
 
 // MD5 basic transformation. Transforms state based on block.
-void MD5::transform (uint1 block[64]){
+void MD5::transform (const uint1 block[64]){
 
   uint4 a = state[0], b = state[1], c = state[2], d = state[3], x[16];
 
@@ -451,13 +446,18 @@ void MD5::encode (uint1 *output, uint4 *input, uint4 len) {
 
 // Decodes input (unsigned char) into output (UINT4). Assumes len is
 // a multiple of 4.
-void MD5::decode (uint4 *output, uint1 *input, uint4 len){
+void MD5::decode (uint4 *output, const uint1 *input, uint4 len){
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+  // Little-endian, the words can be copied as they are
+  memcpy(output, input, len);
+#else
   unsigned int i, j;
 
   for (i = 0, j = 0; j < len; i++, j += 4)
     output[i] = ((uint4)input[j]) | (((uint4)input[j+1]) << 8) |
       (((uint4)input[j+2]) << 16) | (((uint4)input[j+3]) << 24);
+#endif
 }
 
 
@@ -489,7 +489,11 @@ void MD5::decode (uint4 *output, uint1 *input, uint4 len){
 // ROTATE_LEFT rotates x left n bits.
 
 inline unsigned int MD5::rotate_left  (uint4 x, uint4 n){
+#ifdef _MSC_VER
+  return _rotl(x, n);
+#else
   return (x << n) | (x >> (32-n))  ;
+#endif
 }
 
 
@@ -497,12 +501,13 @@ inline unsigned int MD5::rotate_left  (uint4 x, uint4 n){
 
 // F, G, H and I are basic MD5 functions.
 
+// F and G in their equivalent forms with one operation less
 inline unsigned int MD5::F            (uint4 x, uint4 y, uint4 z){
-  return (x & y) | (~x & z);
+  return z ^ (x & (y ^ z));
 }
 
 inline unsigned int MD5::G            (uint4 x, uint4 y, uint4 z){
-  return (x & z) | (y & ~z);
+  return y ^ (z & (x ^ y));
 }
 
 inline unsigned int MD5::H            (uint4 x, uint4 y, uint4 z){
@@ -4,7 +4,7 @@
 
 #include <random>
 
-PasvPortRandomizer::PasvPortRandomizer(PasvPortManager & manager, std::wstring const& peerIP, COptions& options)
+PasvPortRandomizer::PasvPortRandomizer(PasvPortManager & manager, CIpAddress const& peerIP, COptions& options)
 	: peerIP_(peerIP)
 	, manager_(manager)
 {
@@ -102,7 +102,7 @@ unsigned int PasvPortRandomizer::DoGetPort()
 }
 
 
-void PasvPortManager::Release(unsigned int p, std::wstring const& peer, bool connected)
+void PasvPortManager::Release(unsigned int p, CIpAddress const& peer, bool connected)
 {
 	if (p && p < 65536) {
 		{
@@ -123,7 +123,7 @@ void PasvPortManager::Release(unsigned int p, std::wstring const& peer, bool con
 }
 
 
-void PasvPortManager::SetConnected(unsigned int p, std::wstring const& peer)
+void PasvPortManager::SetConnected(unsigned int p, CIpAddress const& peer)
 {
 	if (p && p < 65536) {
 		connecting_[p] = 0;
@@ -168,7 +168,7 @@ PortLease::~PortLease()
 	portManager_->Release(port_, peerIP_, connected_);
 }
 
-PortLease::PortLease(unsigned int p, std::wstring const& peer, PasvPortManager & manager)
+PortLease::PortLease(unsigned int p, CIpAddress const& peer, PasvPortManager & manager)
 	: port_(p)
 	, peerIP_(peer)
 	, portManager_(&manager)
@@ -1,6 +1,8 @@
 #ifndef FZS_PASV_PORT_RANDOMIZER_HEADER
 #define FZS_PASV_PORT_RANDOMIZER_HEADER
 
+#include "iputils.h"
+
 #include <atomic>
 
 /*
@@ -39,10 +41,10 @@ private:
 	friend class PasvPortRandomizer;
 	friend class PasvPortManager;
 
-	PortLease(unsigned int p, std::wstring const& peer, PasvPortManager & manager);
+	PortLease(unsigned int p, CIpAddress const& peer, PasvPortManager & manager);
 
 	unsigned int port_{};
-	std::wstring peerIP_;
+	CIpAddress peerIP_;
 	PasvPortManager * portManager_{};
 	bool connected_{};
 };
@@ -52,7 +54,7 @@ class COptions;
 class PasvPortRandomizer final
 {
 public:
-	explicit PasvPortRandomizer(PasvPortManager & manager, std::wstring const& peerIP, COptions& options);
+	explicit PasvPortRandomizer(PasvPortManager & manager, CIpAddress const& peerIP, COptions& options);
 
 	PasvPortRandomizer(PasvPortRandomizer const&) = delete;
 	PasvPortRandomizer& operator=(PasvPortRandomizer const&) = delete;
@@ -71,7 +73,7 @@ private:
 	bool allow_reuse_other_{};
 	bool allow_reuse_same_{};
 
-	std::wstring const peerIP_;
+	CIpAddress const peerIP_;
 
 	PasvPortManager& manager_;
 };
@@ -89,14 +91,14 @@ private:
 	friend class PortLease;
 	friend class PasvPortRandomizer;
 
-	void Release(unsigned int p, std::wstring const& peer, bool connected);
-	void SetConnected(unsigned int p, std::wstring const& peer);
+	void Release(unsigned int p, CIpAddress const& peer, bool connected);
+	void SetConnected(unsigned int p, CIpAddress const& peer);
 
 	void Prune(unsigned int port, uint64_t now);
 
 	struct entry
 	{
-		std::wstring peer_;
+		CIpAddress peer_;
 		unsigned int leases_{};
 		uint64_t expiry_{};
 	};
@@ -0,0 +1,127 @@
+#include "StdAfx.h"
+#include "send_queue.h"
+
+#include <algorithm>
+
+namespace {
+// Upper bound for the number of idle blocks kept per thread
+size_t const maxPooledBlocks = 64;
+}
+
+struct CSendQueue::pool final
+{
+	~pool()
+	{
+		for (auto b : blocks) {
+			delete b;
+		}
+	}
+
+	std::vector<block*> blocks;
+};
+
+CSendQueue::pool& CSendQueue::GetPool()
+{
+	thread_local pool p;
+	return p;
+}
+
+CSendQueue::~CSendQueue()
+{
+	clear();
+}
+
+CSendQueue::block* CSendQueue::AllocateBlock()
+{
+	auto & blocks = GetPool().blocks;
+	if (blocks.empty()) {
+		return new block;
+	}
+
+	block* b = blocks.back();
+	blocks.pop_back();
+	return b;
+}
+
+void CSendQueue::ReleaseBlock(block* b)
+{
+	auto & blocks = GetPool().blocks;
+	if (blocks.size() >= maxPooledBlocks) {
+		delete b;
+		return;
+	}
+
+	b->next = 0;
+	b->begin = 0;
+	b->end = 0;
+	blocks.push_back(b);
+}
+
+void CSendQueue::Append(char const* data, size_t len)
+{
+	while (len) {
+		if (!tail_ || tail_->end == blockSize) {
+			block* b = AllocateBlock();
+			if (tail_) {
+				tail_->next = b;
+			}
+			else {
+				head_ = b;
+			}
+			tail_ = b;
+		}
+
+		size_t const chunk = std::min(len, blockSize - tail_->end);
+		memcpy(tail_->data + tail_->end, data, chunk);
+		tail_->end += chunk;
+		size_ += chunk;
+
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+DWORD CSendQueue::Gather(WSABUF* buffers, DWORD maxBuffers, size_t limit) const
+{
+	DWORD count = 0;
+	for (block* b = head_; b && limit && count < maxBuffers; b = b->next) {
+		size_t const chunk = std::min(limit, b->end - b->begin);
+		buffers[count].buf = b->data + b->begin;
+		buffers[count].len = static_cast<ULONG>(chunk);
+		++count;
+		limit -= chunk;
+	}
+
+	return count;
+}
+
+void CSendQueue::Consume(size_t len)
+{
+	ASSERT(len <= size_);
+	while (len && head_) {
+		size_t const chunk = std::min(len, head_->end - head_->begin);
+		head_->begin += chunk;
+		size_ -= chunk;
+		len -= chunk;
+
+		if (head_->begin == head_->end) {
+			block* next = head_->next;
+			ReleaseBlock(head_);
+			head_ = next;
+			if (!head_) {
+				tail_ = 0;
+			}
+		}
+	}
+}
+
+void CSendQueue::clear()
+{
+	while (head_) {
+		block* next = head_->next;
+		ReleaseBlock(head_);
+		head_ = next;
+	}
+	tail_ = 0;
+	size_ = 0;
+}
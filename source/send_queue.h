@@ -0,0 +1,64 @@
+#ifndef FILEZILLA_SERVER_SEND_QUEUE_HEADER
+#define FILEZILLA_SERVER_SEND_QUEUE_HEADER
+
+/*
+Output queue of the control connection.
+
+Replies are appended to a chain of fixed-size blocks, so queued data never
+gets moved or copied again no matter how large the backlog grows. Gather
+describes the queued data as a list of WSABUFs, which allows the whole
+backlog to be handed to the socket with a single call.
+
+Blocks of drained queues go into a small per-thread pool, as all control
+connections of a server thread keep queuing short replies.
+*/
+
+class CSendQueue final
+{
+public:
+	CSendQueue() = default;
+	~CSendQueue();
+
+	CSendQueue(CSendQueue const&) = delete;
+	CSendQueue& operator=(CSendQueue const&) = delete;
+
+	void Append(char const* data, size_t len);
+
+	size_t size() const { return size_; }
+	bool empty() const { return !size_; }
+
+	// Describes up to limit bytes from the front of the queue. Returns the
+	// number of buffers filled.
+	DWORD Gather(WSABUF* buffers, DWORD maxBuffers, size_t limit) const;
+
+	// Removes len bytes from the front of the queue
+	void Consume(size_t len);
+
+	void clear();
+
+	static size_t const blockSize = 4096;
+
+	// Enough for 64 KiB, the usual size of the socket send buffer
+	static DWORD const maxGather = 16;
+
+private:
+	struct block
+	{
+		block* next{};
+		size_t begin{};
+		size_t end{};
+		char data[blockSize];
+	};
+
+	struct pool;
+	static pool& GetPool();
+
+	static block* AllocateBlock();
+	static void ReleaseBlock(block* b);
+
+	block* head_{};
+	block* tail_{};
+	size_t size_{};
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include "StdAfx.h"
+#include "speed_limiter.h"
+
+#include <algorithm>
+
+int64_t CTokenBucket::Now()
+{
+	static fz::monotonic_clock const start = fz::monotonic_clock::now();
+	return (fz::monotonic_clock::now() - start).get_milliseconds();
+}
+
+int64_t CTokenBucket::Capacity(int64_t rate)
+{
+	return std::max<int64_t>(rate / 10, 1);
+}
+
+void CTokenBucket::SetRate(int64_t rate)
+{
+	if (rate < 0) {
+		rate = -1;
+	}
+	if (rate_ == rate) {
+		return;
+	}
+
+	int64_t const old = rate_.exchange(rate);
+	if (old == rate || rate < 0) {
+		return;
+	}
+
+	last_ = Now();
+	if (old < 0) {
+		// Start out with a full bucket
+		tokens_ = Capacity(rate);
+	}
+	else {
+		int64_t const capacity = Capacity(rate);
+		int64_t tokens = tokens_;
+		while (tokens > capacity && !tokens_.compare_exchange_weak(tokens, capacity)) {
+		}
+	}
+}
+
+void CTokenBucket::Refill(int64_t rate)
+{
+	int64_t const now = Now();
+	int64_t last = last_;
+	if (now <= last) {
+		return;
+	}
+
+	// Leave last_ untouched until enough time has passed for at least one
+	// token, otherwise slow rates would never refill if queried frequently.
+	int64_t const add = rate * (now - last) / 1000;
+	if (!add) {
+		return;
+	}
+
+	if (!last_.compare_exchange_strong(last, now)) {
+		// Another thread got there first
+		return;
+	}
+
+	int64_t const capacity = Capacity(rate);
+	int64_t tokens = tokens_;
+	int64_t refilled;
+	do {
+		refilled = std::min(tokens + add, capacity);
+	} while (!tokens_.compare_exchange_weak(tokens, refilled));
+}
+
+int64_t CTokenBucket::Available()
+{
+	int64_t const rate = rate_;
+	if (rate < 0) {
+		return -1;
+	}
+
+	Refill(rate);
+
+	return std::max<int64_t>(tokens_, 0);
+}
+
+void CTokenBucket::Consume(int64_t bytes)
+{
+	if (rate_ >= 0) {
+		tokens_ -= bytes;
+	}
+}
+
+namespace {
+// Longest interval between two rounds to distribute bandwidth for, also bounds
+// the bandwidth kept for later rounds. Like the capacity of the token buckets,
+// this limits bursts after stalls.
+int64_t const maxDistributionInterval = 200;
+}
+
+CBandwidthScheduler::flow::flow(CBandwidthScheduler & scheduler)
+	: scheduler_(scheduler)
+{
+	fz::scoped_lock lock(scheduler_.mutex_);
+	scheduler_.flows_.push_back(this);
+}
+
+CBandwidthScheduler::flow::~flow()
+{
+	fz::scoped_lock lock(scheduler_.mutex_);
+	auto & flows = scheduler_.flows_;
+	auto it = std::find(flows.begin(), flows.end(), this);
+	if (it != flows.end()) {
+		*it = flows.back();
+		flows.pop_back();
+	}
+}
+
+void CBandwidthScheduler::flow::SetShare(std::wstring const& account, int weight, int64_t minRate)
+{
+	fz::scoped_lock lock(scheduler_.mutex_);
+	account_ = account;
+	weight_ = std::max(weight, 1);
+	minRate_ = std::max<int64_t>(minRate, 0);
+}
+
+int64_t CBandwidthScheduler::flow::Available()
+{
+	if (scheduler_.rate_ < 0) {
+		return -1;
+	}
+
+	active_ = true;
+	return std::max<int64_t>(deficit_, 0);
+}
+
+void CBandwidthScheduler::flow::Consume(int64_t bytes)
+{
+	if (scheduler_.rate_ >= 0) {
+		deficit_ -= bytes;
+	}
+}
+
+void CBandwidthScheduler::SetRate(int64_t rate)
+{
+	rate_ = rate < 0 ? -1 : rate;
+}
+
+void CBandwidthScheduler::Distribute()
+{
+	auto const now = fz::monotonic_clock::now();
+
+	fz::scoped_lock lock(mutex_);
+
+	int64_t elapsed = last_ ? (now - last_).get_milliseconds() : 0;
+	last_ = now;
+
+	int64_t const rate = rate_;
+	if (rate < 0 || elapsed <= 0) {
+		return;
+	}
+	elapsed = std::min(elapsed, maxDistributionInterval);
+
+	carry_ += rate * elapsed;
+	int64_t budget = carry_ / 1000 + reserve_;
+	carry_ %= 1000;
+
+	hungry_.clear();
+	for (auto f : flows_) {
+		if (!f->active_.exchange(false)) {
+			// Idle flows keep their debt but do not hoard credit
+			int64_t deficit = f->deficit_;
+			while (deficit > 0 && !f->deficit_.compare_exchange_weak(deficit, 0)) {
+			}
+			f->quantum_ = 0;
+		}
+		else if (f->deficit_ <= f->quantum_ / 2) {
+			hungry_.push_back(f);
+		}
+	}
+	if (hungry_.empty()) {
+		reserve_ = std::min(budget, rate * maxDistributionInterval / 1000);
+		return;
+	}
+	reserve_ = 0;
+
+	// The flows of an account split its share. Flows without an account,
+	// of connections not yet logged in, each count on their own.
+	std::sort(hungry_.begin(), hungry_.end(), [](flow const* lhs, flow const* rhs) { return lhs->account_ < rhs->account_; });
+	for (size_t i = 0; i < hungry_.size(); ) {
+		size_t n = 1;
+		if (!hungry_[i]->account_.empty()) {
+			while (i + n < hungry_.size() && hungry_[i + n]->account_ == hungry_[i]->account_) {
+				++n;
+			}
+		}
+		for (size_t j = i; j < i + n; ++j) {
+			hungry_[j]->share_ = 1.0 / n;
+		}
+		i += n;
+	}
+
+	// Guaranteed minimums first
+	int64_t minimums = 0;
+	double weights = 0;
+	for (auto f : hungry_) {
+		f->grant_ = static_cast<int64_t>(f->minRate_ * f->share_ * elapsed / 1000);
+		minimums += f->grant_;
+		weights += f->weight_ * f->share_;
+	}
+	if (minimums > budget) {
+		double const scale = static_cast<double>(budget) / minimums;
+		for (auto f : hungry_) {
+			f->grant_ = static_cast<int64_t>(f->grant_ * scale);
+		}
+		budget = 0;
+	}
+	else {
+		budget -= minimums;
+	}
+
+	// The rest by weight
+	for (auto f : hungry_) {
+		f->grant_ += static_cast<int64_t>(budget * f->weight_ * f->share_ / weights);
+		f->quantum_ = f->grant_;
+		f->deficit_ += f->grant_;
+	}
+}
+
+bool CSpeedLimitSchedule::Get(int & limit, unsigned int revision) const
+{
+	if (!next_ || revision != revision_ || !(fz::monotonic_clock::now() < next_)) {
+		return false;
+	}
+
+	limit = limit_;
+	return true;
+}
+
+void CSpeedLimitSchedule::Set(int limit, int validFor, unsigned int revision)
+{
+	limit_ = limit;
+	revision_ = revision;
+	next_ = fz::monotonic_clock::now() + fz::duration::from_seconds(std::min(std::max(validFor, 1), maxValidity));
+}
+
+void CSpeedLimitSchedule::Invalidate()
+{
+	next_ = fz::monotonic_clock();
+}
@@ -0,0 +1,170 @@
+#ifndef FILEZILLA_SERVER_SPEED_LIMITER_HEADER
+#define FILEZILLA_SERVER_SPEED_LIMITER_HEADER
+
+#include <libfilezilla/mutex.hpp>
+#include <libfilezilla/time.hpp>
+
+#include <atomic>
+#include <string>
+
+/*
+Speed limits are enforced with token buckets. A bucket is refilled lazily
+from the monotonic clock whenever it is queried, so there is no need for a
+central thread handing out quotas. All state is kept in atomics, a bucket
+shared by all server threads can be used without taking any locks.
+
+The bucket holds at most 100ms worth of tokens. Transfers take what they
+need and get woken up by their server thread's rate timer once they ran dry.
+Concurrent consumers may overdraw a bucket slightly, the debt gets paid back
+from the next refill.
+*/
+
+class CTokenBucket final
+{
+public:
+	// Rate in bytes per second, -1 for unlimited.
+	void SetRate(int64_t rate);
+	int64_t GetRate() const { return rate_; }
+
+	// Returns the number of bytes that may be transferred right now,
+	// -1 if unlimited.
+	int64_t Available();
+
+	void Consume(int64_t bytes);
+
+private:
+	static int64_t Now();
+	static int64_t Capacity(int64_t rate);
+
+	void Refill(int64_t rate);
+
+	std::atomic<int64_t> rate_{-1};
+	std::atomic<int64_t> tokens_{};
+
+	// Time of last refill in milliseconds, relative to Now()
+	std::atomic<int64_t> last_{};
+};
+
+/*
+The server-wide limit is shared between the connections of all threads by
+deficit round robin. Every connection owns a flow per direction.
+
+Weights and guaranteed minimum rates belong to accounts, not to connections,
+see t_group::GetSpeedWeight and t_group::GetMinimumSpeed. The flows of all
+connections of the same user split the user's weight and minimum evenly, so
+opening more connections does not get an account a bigger share. A user
+without settings of its own inherits those of its group, every user of the
+group then gets the full share.
+
+The master thread calls Distribute on each tick of its rate timer. The
+bandwidth which accrued since the previous tick is handed out to the flows
+which asked for bandwidth and spent most of what they got the round before:
+First each account gets its minimum rate, if the minimums exceed the limit
+they are scaled down proportionally. The rest is split by weight. What a flow
+does not spend carries over as its deficit, which is dropped once the flow
+goes idle. Flows which do not use their share leave it to the others in the
+next round. Bandwidth no flow asked for is kept for the next rounds, up to
+what accrues in 200ms, so that the limit is reached even if demand
+fluctuates.
+
+Transfers draw from their flow's deficit without taking any locks, only
+adding and removing flows as well as distributing lock the scheduler.
+*/
+
+class CBandwidthScheduler final
+{
+public:
+	class flow final
+	{
+	public:
+		explicit flow(CBandwidthScheduler & scheduler);
+		~flow();
+
+		flow(flow const&) = delete;
+		flow& operator=(flow const&) = delete;
+
+		// The account is the name of the user. Weight of at least 1, minimum
+		// rate in bytes per second, both for all flows of the account together.
+		void SetShare(std::wstring const& account, int weight, int64_t minRate);
+
+		// Returns the number of bytes that may be transferred right now,
+		// -1 if unlimited.
+		int64_t Available();
+
+		void Consume(int64_t bytes);
+
+	private:
+		friend class CBandwidthScheduler;
+
+		CBandwidthScheduler & scheduler_;
+
+		std::atomic<int64_t> deficit_{};
+		std::atomic<bool> active_{};
+
+		// Only accessed with the scheduler locked
+		std::wstring account_;
+		int weight_{1};
+		int64_t minRate_{};
+
+		// What the flow got in the previous round, only used by Distribute
+		int64_t quantum_{};
+		int64_t grant_{};
+		double share_{};
+	};
+
+	// Rate in bytes per second, -1 for unlimited.
+	void SetRate(int64_t rate);
+	int64_t GetRate() const { return rate_; }
+
+	void Distribute();
+
+private:
+	fz::mutex mutex_{false};
+
+	std::vector<flow*> flows_;
+	std::vector<flow*> hungry_;
+
+	std::atomic<int64_t> rate_{-1};
+
+	fz::monotonic_clock last_;
+
+	// Fraction of a byte not yet handed out, scaled by 1000
+	int64_t carry_{};
+
+	// Bandwidth of previous rounds nobody asked for
+	int64_t reserve_{};
+};
+
+/*
+The limits themselves can depend on the time of day, see CSpeedLimit.
+Instead of evaluating the rules on every transfer, CSpeedLimitSchedule keeps
+the current limit together with the moment at which the rules can yield a
+different value. Until then, or until the schedule gets invalidated after a
+configuration change, looking up the limit is a single clock comparison.
+
+Validity is capped so that adjustments of the wall clock are picked up
+eventually.
+*/
+
+class CSpeedLimitSchedule final
+{
+public:
+	// In seconds
+	static constexpr int maxValidity = 60;
+
+	// Returns false if the limit needs to be evaluated again. Callers whose
+	// configuration is versioned pass its revision, a different one than
+	// given to Set invalidates the schedule.
+	bool Get(int & limit, unsigned int revision = 0) const;
+
+	void Set(int limit, int validFor, unsigned int revision = 0);
+
+	void Invalidate();
+
+private:
+	int limit_{};
+	unsigned int revision_{};
+	fz::monotonic_clock next_;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include "StdAfx.h"
+#include "status_queue.h"
+
+std::atomic<bool> CStatusQueue::enabled_{true};
+
+namespace {
+// Appends UTF-16 text as UTF-8, unpaired surrogates become U+FFFD
+void AppendUtf8(std::string & out, wchar_t const* in)
+{
+	while (*in) {
+		uint32_t c = static_cast<uint16_t>(*in++);
+		if (c < 0x80) {
+			out += static_cast<char>(c);
+			continue;
+		}
+
+		if (c >= 0xd800 && c <= 0xdfff) {
+			uint32_t const low = static_cast<uint16_t>(*in);
+			if (c <= 0xdbff && low >= 0xdc00 && low <= 0xdfff) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+				++in;
+			}
+			else {
+				c = 0xfffd;
+			}
+		}
+
+		if (c < 0x800) {
+			out += static_cast<char>(0xc0 | (c >> 6));
+		}
+		else {
+			if (c < 0x10000) {
+				out += static_cast<char>(0xe0 | (c >> 12));
+			}
+			else {
+				out += static_cast<char>(0xf0 | (c >> 18));
+				out += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+			}
+			out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+		}
+		out += static_cast<char>(0x80 | (c & 0x3f));
+	}
+}
+}
+
+CStatusQueue::CStatusQueue()
+	: buffer_(new header[capacity / sizeof(header)])
+{
+	static_assert(!(capacity & (capacity - 1)), "Capacity has to be a power of two");
+}
+
+bool CStatusQueue::Push(int userid, LPCTSTR user, CIpAddress const& ip, LPCTSTR status, int type)
+{
+	FILETIME utc;
+	FILETIME local;
+	GetSystemTimeAsFileTime(&utc);
+	FileTimeToLocalFileTime(&utc, &local);
+
+	// Same layout as the status messages of the admin protocol
+	scratch_.resize(textOffset);
+	scratch_[typeOffset] = static_cast<char>(type);
+	memcpy(&scratch_[timeOffset], &local.dwHighDateTime, 4);
+	memcpy(&scratch_[timeOffset + 4], &local.dwLowDateTime, 4);
+
+	char buffer[20 + INET6_ADDRSTRLEN];
+	sprintf(buffer, "(%06d)- ", userid);
+	scratch_ += buffer;
+	AppendUtf8(scratch_, user);
+	scratch_ += " (";
+	if (ip && InetNtopA(ip.GetFamily() == CIpAddress::ipv4 ? AF_INET : AF_INET6, const_cast<unsigned char*>(ip.data()), buffer, INET6_ADDRSTRLEN)) {
+		scratch_ += buffer;
+	}
+	scratch_ += ")> ";
+	AppendUtf8(scratch_, status);
+
+	size_t const len = scratch_.size();
+	size_t const needed = sizeof(header) + Align(len);
+
+	size_t head = head_.load(std::memory_order_relaxed);
+	size_t const tail = tail_.load(std::memory_order_acquire);
+
+	// A record never wraps around, the rest of the ring gets skipped instead
+	size_t const offset = head % capacity;
+	size_t const contiguous = capacity - offset;
+	size_t const total = needed + ((contiguous < needed) ? contiguous : 0);
+	if (total > capacity - (head - tail)) {
+		++dropped_;
+		return false;
+	}
+
+	if (contiguous < needed) {
+		header const marker = padding;
+		memcpy(data() + offset, &marker, sizeof(header));
+		head += contiguous;
+	}
+
+	char* p = data() + head % capacity;
+	header const h = static_cast<header>(len);
+	memcpy(p, &h, sizeof(header));
+	memcpy(p + sizeof(header), scratch_.c_str(), len);
+
+	head_.store(head + needed, std::memory_order_release);
+
+	return true;
+}
+
+int CStatusQueue::GetLoad() const
+{
+	size_t const used = head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_relaxed);
+	return static_cast<int>(used * 100 / capacity);
+}
@@ -0,0 +1,110 @@
+#ifndef FILEZILLA_SERVER_STATUS_QUEUE_HEADER
+#define FILEZILLA_SERVER_STATUS_QUEUE_HEADER
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/*
+Status messages of a server thread on their way to the main thread.
+
+Each server thread owns one queue, a ring buffer with the server thread as the
+only producer and the main thread as the only consumer. Neither side takes a
+lock, the positions in the ring are published through atomics.
+
+The producer formats a message straight into the layout of the status message
+of the admin protocol: One byte with the message type, the local time of the
+event as FILETIME, high part first, and the UTF-8 encoded text. The consumer
+drains all queued records at once and can pass them on as they are.
+
+A full ring never blocks the producer, further messages get dropped and
+counted. If neither the file logger nor an admin interface is around to see
+them, messages are not even formatted.
+*/
+
+class CStatusQueue final
+{
+public:
+	CStatusQueue();
+
+	CStatusQueue(CStatusQueue const&) = delete;
+	CStatusQueue& operator=(CStatusQueue const&) = delete;
+
+	// Producer side. Returns false if the message got dropped.
+	bool Push(int userid, LPCTSTR user, CIpAddress const& ip, LPCTSTR status, int type);
+
+	// Used part of the ring in percent
+	int GetLoad() const;
+
+	// Consumer side. Calls f with every queued record, oldest first, and
+	// returns the number of records. The space of a record is handed back to
+	// the producer once f returns.
+	template<typename F>
+	size_t Drain(F && f);
+
+	// Number of messages dropped since the last call
+	uint64_t TakeDropped() { return dropped_.exchange(0); }
+
+	// Whether messages should be queued at all
+	static bool IsEnabled() { return enabled_.load(std::memory_order_relaxed); }
+	static void SetEnabled(bool enabled) { enabled_ = enabled; }
+
+	// Size of the ring, has to be a power of two
+	static size_t const capacity = 256 * 1024;
+
+	// Offsets into a record
+	static size_t const typeOffset = 0;
+	static size_t const timeOffset = 1;
+	static size_t const textOffset = 9;
+
+private:
+	// Records start with their length, records are aligned to it
+	typedef uint32_t header;
+	static header const padding = 0xffffffffu;
+
+	static size_t Align(size_t len) { return (len + sizeof(header) - 1) & ~(sizeof(header) - 1); }
+
+	std::unique_ptr<header[]> buffer_;
+	char* data() const { return reinterpret_cast<char*>(buffer_.get()); }
+
+	// Both positions grow without bounds and wrap around with size_t, as the
+	// capacity is a power of two this does not affect the offset into the ring
+	std::atomic<size_t> head_{};
+	std::atomic<size_t> tail_{};
+
+	std::atomic<uint64_t> dropped_{};
+
+	// Only used by the producer, keeps its capacity between messages
+	std::string scratch_;
+
+	static std::atomic<bool> enabled_;
+};
+
+template<typename F>
+size_t CStatusQueue::Drain(F && f)
+{
+	size_t count = 0;
+
+	size_t tail = tail_.load(std::memory_order_relaxed);
+	size_t const head = head_.load(std::memory_order_acquire);
+	while (tail != head) {
+		size_t const offset = tail % capacity;
+
+		header len;
+		memcpy(&len, data() + offset, sizeof(header));
+		if (len == padding) {
+			tail += capacity - offset;
+		}
+		else {
+			f(std::string_view(data() + offset + sizeof(header), len));
+			tail += sizeof(header) + Align(len);
+			++count;
+		}
+		tail_.store(tail, std::memory_order_release);
+	}
+
+	return count;
+}
+
+#endif